@@ -0,0 +1,209 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: CatalogCache.cpp
+//
+// Purpose:
+//   This file contains the definitions of the on-disk cache of the DMV
+//   lists of the servers, which lets dbfs mount without listing them again.
+//
+#include "UtilsPrivate.h"
+
+// Permissions of the directories created for the cache.
+//
+#define CATALOG_CACHE_PERMISSIONS   0700
+
+// ---------------------------------------------------------------------------
+// Method: GetCatalogCacheDirectory
+//
+// Description:
+//    This method works out the directory the DMV lists are kept in and
+//    creates it if needed.
+//
+// Returns:
+//    true if the directory can be used.
+//
+static bool
+GetCatalogCacheDirectory(
+    string& directory)
+{
+    const char* base;
+
+    base = getenv("XDG_CACHE_HOME");
+    if (base && *base)
+    {
+        directory = base;
+    }
+    else
+    {
+        base = getenv("HOME");
+        if (!base || !*base)
+        {
+            return false;
+        }
+
+        directory = string(base) + "/.cache";
+    }
+
+    if (mkdir(directory.c_str(), CATALOG_CACHE_PERMISSIONS) == -1 && errno != EEXIST)
+    {
+        return false;
+    }
+
+    directory += LINUX_PATH_DELIM CATALOG_CACHE_DIRECTORY;
+
+    if (mkdir(directory.c_str(), CATALOG_CACHE_PERMISSIONS) == -1 && errno != EEXIST)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetCatalogCachePath
+//
+// Description:
+//    This method returns the path of the file keeping the DMV list of the
+//    server. The list is kept per host and login, since the login decides
+//    which DMVs can be seen. Characters which don't belong in a file name
+//    (e.g. in <host>\<instance>) are replaced.
+//
+// Returns:
+//    true if the cache can be used.
+//
+static bool
+GetCatalogCachePath(
+    const ServerInfo& serverInfo,
+    string& path)
+{
+    string name;
+
+    if (!GetCatalogCacheDirectory(path))
+    {
+        return false;
+    }
+
+    name = serverInfo.m_hostname + "@" + serverInfo.m_username;
+    for (char& c : name)
+    {
+        if (!isalnum((unsigned char)c) && c != '.' && c != '-' && c != '@')
+        {
+            c = '_';
+        }
+    }
+
+    path += LINUX_PATH_DELIM + name;
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: LoadCachedCatalog
+//
+// Description:
+//    This method reads the DMV list of the server kept by an earlier run.
+//    The file holds the header, the hash of the version of the server
+//    and a DMV name per line.
+//
+// Returns:
+//    true if there was a list.
+//
+bool
+LoadCachedCatalog(
+    const ServerInfo& serverInfo,
+    string& versionHash,
+    vector<string>& dmvNames)
+{
+    string      path;
+    string      line;
+    ifstream    file;
+
+    dmvNames.clear();
+
+    if (!GetCatalogCachePath(serverInfo, path))
+    {
+        return false;
+    }
+
+    file.open(path);
+    if (!file ||
+        !std::getline(file, line) || line != CATALOG_CACHE_HEADER ||
+        !std::getline(file, versionHash) || versionHash.empty())
+    {
+        return false;
+    }
+
+    while (std::getline(file, line))
+    {
+        if (!line.empty())
+        {
+            dmvNames.push_back(line);
+        }
+    }
+
+    return !dmvNames.empty();
+}
+
+// ---------------------------------------------------------------------------
+// Method: StoreCachedCatalog
+//
+// Description:
+//    This method keeps the DMV list of the server for the next runs. The
+//    list is written to a temporary file which then replaces the old one,
+//    so that a run starting at the same time never reads half a list. The
+//    temporary file gets a name of its own (mkstemp) as several threads
+//    of a run may store lists at the same time.
+//
+// Returns:
+//    VOID
+//
+void
+StoreCachedCatalog(
+    const ServerInfo& serverInfo,
+    const string& versionHash,
+    const vector<string>& dmvNames)
+{
+    string  path;
+    string  tempPath;
+    int     fd;
+    FILE*   file;
+    bool    failed;
+
+    if (!GetCatalogCachePath(serverInfo, path))
+    {
+        return;
+    }
+
+    tempPath = path + ".XXXXXX";
+
+    fd = mkstemp(&tempPath[0]);
+    if (fd == -1)
+    {
+        PrintMsg("Could not create %s - %s\n", tempPath.c_str(), strerror(errno));
+        return;
+    }
+
+    file = fdopen(fd, "w");
+    if (!file)
+    {
+        PrintMsg("Could not open %s - %s\n", tempPath.c_str(), strerror(errno));
+        close(fd);
+        unlink(tempPath.c_str());
+        return;
+    }
+
+    failed = fprintf(file, "%s\n%s\n", CATALOG_CACHE_HEADER, versionHash.c_str()) < 0;
+    for (const string& dmvName : dmvNames)
+    {
+        failed = failed || fprintf(file, "%s\n", dmvName.c_str()) < 0;
+    }
+    failed = (fclose(file) != 0) || failed;
+
+    if (failed || rename(tempPath.c_str(), path.c_str()) == -1)
+    {
+        PrintMsg("Could not write %s\n", path.c_str());
+        unlink(tempPath.c_str());
+    }
+}
@@ -0,0 +1,37 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: CatalogCache.h
+//
+// Purpose:
+//   This file contains the declarations of the on-disk cache of the DMV
+//   lists of the servers, which lets dbfs mount without listing them again.
+//
+#pragma once
+
+// Directory the lists are kept in, under the cache directory of the user
+// ($XDG_CACHE_HOME, or ~/.cache).
+//
+#define CATALOG_CACHE_DIRECTORY     "dbfs"
+
+// First line of a cache file. Changes if the format of the file does.
+//
+#define CATALOG_CACHE_HEADER        "dbfs-catalog 1"
+
+// Reads the DMV list of the server kept by an earlier run, along with the
+// version of the server it was listed on. Returns false if there is none.
+//
+bool
+LoadCachedCatalog(
+    const ServerInfo& serverInfo,
+    string& versionHash,
+    vector<string>& dmvNames);
+
+// Keeps the DMV list of the server for the next runs.
+//
+void
+StoreCachedCatalog(
+    const ServerInfo& serverInfo,
+    const string& versionHash,
+    const vector<string>& dmvNames);
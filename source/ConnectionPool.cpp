@@ -0,0 +1,509 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ConnectionPool.cpp
+//
+// Purpose:
+//   This file contains the definitions of the per-server pool of
+//   DB-Library connections.
+//
+#include "UtilsPrivate.h"
+
+// Largest text/image value the server sends - 2GB, the size of the max types.
+//
+#define SQLFS_MAX_TEXT_SIZE     "2147483647"
+
+// Pools indexed by "<username>@<hostname>".
+//
+static unordered_map<string, unique_ptr<SQLConnectionPool>> s_ConnectionPools;
+static mutex s_ConnectionPoolsLock;
+
+// ---------------------------------------------------------------------------
+// Method: SQLConnectionPool Constructor
+//
+// Description:
+//    Creates an empty pool. No connection is opened until the first
+//    call to Acquire().
+//
+// Returns:
+//    none
+//
+SQLConnectionPool::SQLConnectionPool(
+    const string& hostname,
+    const string& username,
+    const string& password,
+    size_t maxSize,
+    int idleTimeoutSec) :
+    m_hostname(hostname),
+    m_username(username),
+    m_password(password),
+    m_maxSize(max(maxSize, (size_t)1)),
+    m_idleTimeoutSec(idleTimeoutSec),
+    m_borrowed(0)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: SQLConnectionPool Destructor
+//
+// Description:
+//    Closes all the idle connections. Borrowed connections are expected
+//    to have been released by now.
+//
+SQLConnectionPool::~SQLConnectionPool()
+{
+    for (auto&& entry : m_idle)
+    {
+        CloseConnection(entry.m_dbConn);
+    }
+    m_idle.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Method: OpenConnection
+//
+// Description:
+//    This method opens up a DB connection to the server of this pool,
+//    switches it to the master database and lifts the limit on the size
+//    of large text values.
+//
+// Returns:
+//    Connection pointer (DBPROCESS *) on success
+//    NULL on error.
+//
+DBPROCESS*
+SQLConnectionPool::OpenConnection()
+{
+    LOGINREC*   login;
+    DBPROCESS*  dbConn = NULL;
+    RETCODE     status = SUCCEED;
+    char        hostname[MAXHOSTNAMELEN];
+    int         maxLen = MAXHOSTNAMELEN;
+
+    // Errors during the login are recorded in the context of this thread.
+    //
+    ResetDBErrorContext(NULL);
+
+    // Allocate a login params structure.
+    //
+    login = dblogin();
+    if (!login)
+    {
+        PrintMsg("Could not initialize dblogin() structure.\n");
+        status = FAIL;
+    }
+
+    // Initialize the login params in the structure.
+    //
+    if (status == SUCCEED)
+    {
+        DBSETLUSER(login, m_username.c_str());
+        DBSETLPWD(login, m_password.c_str());
+        DBSETLAPP(login, progName);
+        if (gethostname(hostname, maxLen) == 0)
+        {
+            DBSETLHOST(login, hostname);
+        }
+
+        dbConn = dbopen(login, m_hostname.c_str());
+        if (!dbConn)
+        {
+            PrintMsg("Could not connect to DB Server: %s - %s\n", m_hostname.c_str(),
+                     GetDBErrorContext(NULL)->m_message.c_str());
+            status = FAIL;
+        }
+        else
+        {
+            AttachDBErrorContext(dbConn);
+        }
+
+        // login structure no longer needed after logging in.
+        //
+        dbloginfree(login);
+    }
+
+    if (status == SUCCEED)
+    {
+        status = dbuse(dbConn, dbName);
+        if (status == FAIL)
+        {
+            PrintMsg("Could not switch to database %s on DB Server %s\n",
+                dbName, m_hostname.c_str());
+        }
+    }
+
+    // By default the server cuts (n)text and (n)varchar(max) values down
+    // to a few KB. Ask for values of any size.
+    //
+    if (status == SUCCEED)
+    {
+        status = dbsetopt(dbConn, DBTEXTSIZE, SQLFS_MAX_TEXT_SIZE, 0);
+        if (status == FAIL)
+        {
+            PrintMsg("Could not set the text size on DB Server %s\n",
+                m_hostname.c_str());
+        }
+    }
+
+    if (status == FAIL && dbConn)
+    {
+        CloseConnection(dbConn);
+        dbConn = NULL;
+    }
+
+    return dbConn;
+}
+
+// ---------------------------------------------------------------------------
+// Method: CloseConnection
+//
+// Description:
+//    Closes a connection and frees its error context.
+//
+// Returns:
+//    VOID
+//
+void
+SQLConnectionPool::CloseConnection(
+    DBPROCESS* dbConn)
+{
+    DetachDBErrorContext(dbConn);
+    dbclose(dbConn);
+}
+
+// ---------------------------------------------------------------------------
+// Method: IsHealthy
+//
+// Description:
+//    Checks if an idle connection can be handed out. Connections that
+//    DB-Library already knows to be dead are rejected right away. If the
+//    connection has been idle for a while, the server may have dropped it
+//    without us noticing so a trivial query is sent to make sure.
+//
+// Returns:
+//    true if the connection is usable.
+//
+bool
+SQLConnectionPool::IsHealthy(
+    const IdleConnection& entry)
+{
+    bool    healthy = !DBDEAD(entry.m_dbConn);
+    RETCODE status;
+
+    if (healthy &&
+        Clock::now() - entry.m_lastUsed > std::chrono::seconds(SQLFS_POOL_HEALTH_CHECK_SEC))
+    {
+        dbcmd(entry.m_dbConn, "SELECT 1");
+        status = dbsqlexec(entry.m_dbConn);
+        while (status == SUCCEED)
+        {
+            status = dbresults(entry.m_dbConn);
+            if (status == SUCCEED)
+            {
+                dbcanquery(entry.m_dbConn);
+            }
+        }
+        healthy = (status == NO_MORE_RESULTS);
+        dbfreebuf(entry.m_dbConn);
+    }
+
+    return healthy;
+}
+
+// ---------------------------------------------------------------------------
+// Method: CollectExpiredLocked
+//
+// Description:
+//    Moves the connections that have been idle for longer than the idle
+//    timeout into the provided list. Must be called with m_lock held.
+//
+// Returns:
+//    VOID
+//
+void
+SQLConnectionPool::CollectExpiredLocked(
+    vector<DBPROCESS*>& expired)
+{
+    Clock::time_point deadline = Clock::now() - std::chrono::seconds(m_idleTimeoutSec);
+
+    // The oldest entries are at the front.
+    //
+    while (!m_idle.empty() && m_idle.front().m_lastUsed < deadline)
+    {
+        expired.push_back(m_idle.front().m_dbConn);
+        m_idle.pop_front();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: Acquire
+//
+// Description:
+//    Hands out a connection from the pool. The most recently used idle
+//    connection is preferred. Dead connections are closed and replaced
+//    with a new one. If the pool is at its maximum size, this waits for
+//    another caller to release a connection.
+//
+// Returns:
+//    Connection pointer (DBPROCESS *) on success
+//    NULL if a new connection could not be opened.
+//
+DBPROCESS*
+SQLConnectionPool::Acquire()
+{
+    DBPROCESS*          dbConn = NULL;
+    vector<DBPROCESS*>  expired;
+    IdleConnection      entry;
+    bool                found;
+
+    while (!dbConn)
+    {
+        found = false;
+        {
+            unique_lock<mutex> lock(m_lock);
+
+            CollectExpiredLocked(expired);
+
+            while (m_idle.empty() && m_borrowed >= m_maxSize)
+            {
+                m_released.wait(lock);
+            }
+
+            if (!m_idle.empty())
+            {
+                entry = m_idle.back();
+                m_idle.pop_back();
+                found = true;
+            }
+
+            // Either way the connection now counts against the limit.
+            //
+            m_borrowed++;
+        }
+
+        for (auto&& conn : expired)
+        {
+            CloseConnection(conn);
+        }
+        expired.clear();
+
+        if (found)
+        {
+            if (IsHealthy(entry))
+            {
+                dbConn = entry.m_dbConn;
+            }
+            else
+            {
+                PrintMsg("Replacing dead connection to %s\n", m_hostname.c_str());
+                CloseConnection(entry.m_dbConn);
+                Release(NULL, true);
+            }
+        }
+        else
+        {
+            dbConn = OpenConnection();
+            if (!dbConn)
+            {
+                Release(NULL, true);
+                break;
+            }
+        }
+    }
+
+    return dbConn;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Release
+//
+// Description:
+//    Returns a borrowed connection to the pool. Any pending results are
+//    discarded and the connection is switched back to the master database
+//    so that the next user gets it in the same state as a new one. If this
+//    is not possible the connection is closed instead.
+//
+//    A NULL connection just gives back the borrowed slot.
+//
+// Returns:
+//    VOID
+//
+void
+SQLConnectionPool::Release(
+    DBPROCESS* dbConn,
+    bool discard)
+{
+    vector<DBPROCESS*> expired;
+
+    if (dbConn)
+    {
+        dbfreebuf(dbConn);
+
+        if (!discard && !DBDEAD(dbConn))
+        {
+            // Custom queries are free to change the database.
+            //
+            const char* currentDb = dbname(dbConn);
+            if (currentDb && strcmp(currentDb, dbName) != 0)
+            {
+                discard = (dbuse(dbConn, dbName) == FAIL);
+            }
+        }
+
+        if (discard || DBDEAD(dbConn))
+        {
+            CloseConnection(dbConn);
+            dbConn = NULL;
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(m_lock);
+
+        m_borrowed--;
+        if (dbConn)
+        {
+            m_idle.push_back({ dbConn, Clock::now() });
+        }
+
+        // Close whatever went over the limit since it was last lowered.
+        //
+        while (m_idle.size() + m_borrowed > m_maxSize && !m_idle.empty())
+        {
+            expired.push_back(m_idle.front().m_dbConn);
+            m_idle.pop_front();
+        }
+
+        CollectExpiredLocked(expired);
+    }
+    m_released.notify_one();
+
+    for (auto&& conn : expired)
+    {
+        CloseConnection(conn);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: SetLimits
+//
+// Description:
+//    Updates the size and idle timeout of the pool. Connections beyond
+//    the new size are closed as they get released.
+//
+// Returns:
+//    VOID
+//
+void
+SQLConnectionPool::SetLimits(
+    size_t maxSize,
+    int idleTimeoutSec)
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_maxSize = max(maxSize, (size_t)1);
+        m_idleTimeoutSec = idleTimeoutSec;
+    }
+    m_released.notify_all();
+}
+
+// ---------------------------------------------------------------------------
+// Method: LookupConnectionPool
+//
+// Description:
+//    Finds or creates the pool for a server/login pair.
+//    Must be called with s_ConnectionPoolsLock held.
+//
+//    The password is part of the key (hashed, so that it isn't kept in
+//    one more place) - two config sections with the same login and
+//    different passwords must not share connections, or the one with the
+//    wrong password would pass for verified on the other's connection.
+//
+// Returns:
+//    Pointer to the pool.
+//
+static SQLConnectionPool*
+LookupConnectionPool(
+    const string& hostname,
+    const string& username,
+    const string& password,
+    size_t maxSize,
+    int idleTimeoutSec)
+{
+    string key = StringFormat("%s@%s#%zx", username.c_str(), hostname.c_str(),
+                              std::hash<string>()(password));
+
+    auto&& pool = s_ConnectionPools[key];
+    if (!pool)
+    {
+        pool.reset(new SQLConnectionPool(hostname, username, password,
+                                         maxSize, idleTimeoutSec));
+    }
+
+    return pool.get();
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetConnectionPool
+//
+// Description:
+//    Returns the pool for the given server/login pair. A pool with the
+//    default limits is created on first use.
+//
+// Returns:
+//    Pointer to the pool. The pool lives until DestroyConnectionPools().
+//
+SQLConnectionPool*
+GetConnectionPool(
+    const string& hostname,
+    const string& username,
+    const string& password)
+{
+    lock_guard<mutex> lock(s_ConnectionPoolsLock);
+
+    return LookupConnectionPool(hostname, username, password,
+                                SQLFS_DEFAULT_POOL_SIZE,
+                                SQLFS_DEFAULT_POOL_IDLE_TIMEOUT_SEC);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ConfigureConnectionPool
+//
+// Description:
+//    Sets the limits of the pool for the given server/login pair. This
+//    is called while parsing the config file.
+//
+// Returns:
+//    VOID
+//
+void
+ConfigureConnectionPool(
+    const string& hostname,
+    const string& username,
+    const string& password,
+    size_t maxSize,
+    int idleTimeoutSec)
+{
+    lock_guard<mutex> lock(s_ConnectionPoolsLock);
+
+    LookupConnectionPool(hostname, username, password,
+                         maxSize, idleTimeoutSec)->SetLimits(maxSize, idleTimeoutSec);
+}
+
+// ---------------------------------------------------------------------------
+// Method: DestroyConnectionPools
+//
+// Description:
+//    Closes all the pooled connections. Called when SQLFS is shutting down.
+//
+// Returns:
+//    VOID
+//
+void
+DestroyConnectionPools()
+{
+    lock_guard<mutex> lock(s_ConnectionPoolsLock);
+
+    s_ConnectionPools.clear();
+}
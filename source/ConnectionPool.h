@@ -0,0 +1,141 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ConnectionPool.h
+//
+// Purpose:
+//   This file contains the declarations of the per-server pool of
+//   DB-Library connections used to run queries without paying for a
+//   fresh login every time.
+//
+#pragma once
+
+// Default maximum number of connections kept open to a single server.
+//
+#define SQLFS_DEFAULT_POOL_SIZE                 4
+
+// Default number of seconds an unused connection stays in the pool
+// before it is closed.
+//
+#define SQLFS_DEFAULT_POOL_IDLE_TIMEOUT_SEC     300
+
+// A connection that has been idle for longer than this is pinged before
+// it is handed out again.
+//
+#define SQLFS_POOL_HEALTH_CHECK_SEC             30
+
+//--------------------------------------------------------------------
+// Class: SQLConnectionPool
+//
+// Description:
+//  Keeps a bounded set of logged in DBPROCESS handles for one
+//  server/login pair. Callers borrow a handle with Acquire() and give
+//  it back with Release(). Handles are opened lazily, closed once they
+//  have been idle for longer than the idle timeout and checked for
+//  liveness before being reused.
+//
+// Dev notes:
+//  The pool never hands out more than m_maxSize handles at a time.
+//  Callers block in Acquire() until one is released.
+//
+class SQLConnectionPool
+{
+public:
+    // Constructor
+    //
+    SQLConnectionPool(
+        const string& hostname,
+        const string& username,
+        const string& password,
+        size_t maxSize,
+        int idleTimeoutSec);
+
+    // Destructor - closes all the idle connections.
+    //
+    ~SQLConnectionPool();
+
+    // Borrows a connection from the pool, opening a new one if needed.
+    // Returns NULL if a new connection could not be established.
+    //
+    DBPROCESS* Acquire();
+
+    // Returns a borrowed connection to the pool. If discard is set or the
+    // connection is dead, it is closed instead of being kept.
+    //
+    void Release(
+        DBPROCESS* dbConn,
+        bool discard);
+
+    // Updates the size and idle timeout of the pool.
+    //
+    void SetLimits(
+        size_t maxSize,
+        int idleTimeoutSec);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // An open connection that is currently not borrowed.
+    //
+    struct IdleConnection
+    {
+        DBPROCESS*          m_dbConn;
+        Clock::time_point   m_lastUsed;
+    };
+
+    // Logs in to the server and returns a new connection.
+    //
+    DBPROCESS* OpenConnection();
+
+    // Closes a connection.
+    //
+    void CloseConnection(
+        DBPROCESS* dbConn);
+
+    // Checks if an idle connection can still be used.
+    //
+    bool IsHealthy(
+        const IdleConnection& entry);
+
+    // Moves the connections which exceeded the idle timeout out of the
+    // idle list so that they can be closed without holding the lock.
+    //
+    void CollectExpiredLocked(
+        vector<DBPROCESS*>& expired);
+
+    string                      m_hostname;
+    string                      m_username;
+    string                      m_password;
+    size_t                      m_maxSize;      // Max connections open.
+    int                         m_idleTimeoutSec;
+    size_t                      m_borrowed;     // Connections handed out
+                                                // or being opened.
+    deque<IdleConnection>       m_idle;         // Most recently used last.
+    mutex                       m_lock;
+    condition_variable          m_released;
+};
+
+// Returns the pool for the given server/login pair, creating it with
+// the default limits if this is the first use.
+//
+SQLConnectionPool*
+GetConnectionPool(
+    const string& hostname,
+    const string& username,
+    const string& password);
+
+// Sets the limits of the pool for the given server/login pair.
+//
+void
+ConfigureConnectionPool(
+    const string& hostname,
+    const string& username,
+    const string& password,
+    size_t maxSize,
+    int idleTimeoutSec);
+
+// Closes all the pooled connections.
+//
+void
+DestroyConnectionPools();
@@ -10,125 +10,558 @@
 //
 #include "UtilsPrivate.h"
 
+// Query files read so far, keyed by their path.
+//
+static unordered_map<string, shared_ptr<const CustomQueryText>> s_CustomQueries;
+static mutex s_CustomQueriesLock;
+
 // ---------------------------------------------------------------------------
-// Method: ExecuteCustomQuery
+// Method: ParseCustomQueryParameters
 //
 // Description:
-//  This method reads the query from queryFilePath and puts the output 
-//  in queryResultPath.
+//  This method takes the names of the parameters from their declaration,
+//  e.g. "@spid int, @amount decimal(10, 2)". The declarations are split on
+//  the commas outside parentheses and each starts with the name.
 //
-//  queryFilePath - absolute path to a file that contains query.
-//  queryResultPath - absolute path ot a file that is used to store query output.
+// Returns:
+//    0 on success and -1 if a declaration doesn't start with a name.
+//
+static int
+ParseCustomQueryParameters(
+    const string& parameters,
+    vector<string>& names)
+{
+    string  declaration;
+    string  name;
+    int     depth = 0;
+
+    names.clear();
+
+    for (size_t i = 0; i <= parameters.length(); i++)
+    {
+        if (i < parameters.length() &&
+            (parameters[i] != CUSTOM_QUERY_ARGUMENT_SEPARATOR || depth > 0))
+        {
+            depth += (parameters[i] == '(') - (parameters[i] == ')');
+            declaration += parameters[i];
+            continue;
+        }
+
+        declaration = Trim(declaration);
+        name = declaration.substr(0, declaration.find_first_of(" \t"));
+        if (name.length() < 2 || name[0] != '@')
+        {
+            return -1;
+        }
+
+        names.push_back(name);
+        declaration.clear();
+    }
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ParseCustomQueryDirectives
+//
+// Description:
+//  This method looks for dbfs directives in the comment lines at the top
+//  of the query, e.g.
+//
+//      -- dbfs:ttl=30
+//      -- dbfs:params=@spid int
+//      SELECT ... WHERE session_id = @spid
+//
+//  Parsing stops at the first line which is not a "--" comment.
 //
 // Returns:
 //    none.
 //
 void
-ExecuteCustomQuery(
+ParseCustomQueryDirectives(
+    CustomQueryText& query)
+{
+    stringstream    lines(query.m_query);
+    string          line;
+    string          name;
+    string          value;
+    size_t          start;
+    size_t          equals;
+    int             ttlSec;
+
+    query.m_ttlSec = -1;
+
+    while (std::getline(lines, line))
+    {
+        start = line.find_first_not_of(" \t\r");
+        if (start == string::npos)
+        {
+            continue;
+        }
+        if (line.compare(start, 2, "--") != 0)
+        {
+            break;
+        }
+
+        start = line.find_first_not_of(" \t", start + 2);
+        if (start == string::npos ||
+            line.compare(start, strlen(CUSTOM_QUERY_DIRECTIVE_PREFIX), CUSTOM_QUERY_DIRECTIVE_PREFIX) != 0)
+        {
+            continue;
+        }
+        start += strlen(CUSTOM_QUERY_DIRECTIVE_PREFIX);
+
+        equals = line.find('=', start);
+        if (equals == string::npos)
+        {
+            PrintMsg("Ignoring directive without value in %s.\n", query.m_path.c_str());
+            continue;
+        }
+
+        name = Trim(line.substr(start, equals - start));
+        value = Trim(line.substr(equals + 1));
+
+        if (name == CUSTOM_QUERY_TTL_DIRECTIVE)
+        {
+            try
+            {
+                ttlSec = stoi(value);
+            }
+            catch (const exception&)
+            {
+                ttlSec = -1;
+            }
+
+            if (ttlSec < 0)
+            {
+                PrintMsg("Ignoring bad ttl '%s' in %s.\n", value.c_str(), query.m_path.c_str());
+                continue;
+            }
+            query.m_ttlSec = ttlSec;
+        }
+        else if (name == CUSTOM_QUERY_PARAMS_DIRECTIVE)
+        {
+            if (ParseCustomQueryParameters(value, query.m_parameterNames))
+            {
+                PrintMsg("Ignoring bad params '%s' in %s.\n", value.c_str(), query.m_path.c_str());
+                query.m_parameterNames.clear();
+                continue;
+            }
+            query.m_parameters = value;
+        }
+        else
+        {
+            PrintMsg("Ignoring unknown directive '%s' in %s.\n", name.c_str(), query.m_path.c_str());
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetCustomQuery
+//
+// Description:
+//  This method returns the query in the query file. The file is only read
+//  again if its identity (device, inode, mtime and size) changed since the
+//  last read, so a query that is run over and over costs a stat() rather
+//  than a read of the file.
+//
+//  queryFilePath - absolute path to a file that contains query.
+//  query - set to the query.
+//
+// Returns:
+//    0 on success and -1 if the file can't be read.
+//
+int
+GetCustomQuery(
     const string& queryFilePath,
-    const string& queryResultPath,
-    const string& hostname,
-    const string& username,
-    const string& password)
+    shared_ptr<const CustomQueryText>& query)
 {
-    string responseString;
+    struct stat                 stbuf;
+    string                      version;
+    shared_ptr<CustomQueryText> text;
+
+    if (stat(queryFilePath.c_str(), &stbuf) == -1)
+    {
+        PrintMsg("Custom query %s can't be read - %s\n", queryFilePath.c_str(), strerror(errno));
+        return -1;
+    }
+
+    version = to_string(stbuf.st_dev) + ":" + to_string(stbuf.st_ino) + ":" +
+              to_string(stbuf.st_mtim.tv_sec) + "." + to_string(stbuf.st_mtim.tv_nsec) + ":" +
+              to_string(stbuf.st_size);
+
+    {
+        lock_guard<mutex> lock(s_CustomQueriesLock);
+
+        auto itr = s_CustomQueries.find(queryFilePath);
+        if (itr != s_CustomQueries.end() && itr->second->m_version == version)
+        {
+            query = itr->second;
+            return 0;
+        }
+    }
 
     // Read the query
     //
     ifstream ifs(queryFilePath);
-    string query((std::istreambuf_iterator<char>(ifs)),
-                        (std::istreambuf_iterator<char>()));
-    // Execute the query.
-    //
-    // We want the column names as well so use type as TYPE_TSV.
-    //
-    int result = ExecuteQuery(query, responseString, hostname,
-                              username, password, TYPE_TSV);
+    if (!ifs)
+    {
+        PrintMsg("Custom query %s can't be read.\n", queryFilePath.c_str());
+        return -1;
+    }
+
+    text = make_shared<CustomQueryText>();
+    text->m_path = queryFilePath;
+    text->m_version = version;
+    text->m_query.assign((std::istreambuf_iterator<char>(ifs)),
+                         (std::istreambuf_iterator<char>()));
+
+    ParseCustomQueryDirectives(*text);
+
+    query = text;
 
-    if (!result)
+    lock_guard<mutex> lock(s_CustomQueriesLock);
+    s_CustomQueries[queryFilePath] = query;
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ForgetCustomQuery
+//
+// Description:
+//  This method drops the query read from the query file, so a file that is
+//  deleted or moved away doesn't keep its query in memory.
+//
+//  queryFilePath - absolute path to the query file.
+//
+// Returns:
+//    none.
+//
+void
+ForgetCustomQuery(
+    const string& queryFilePath)
+{
+    lock_guard<mutex> lock(s_CustomQueriesLock);
+    s_CustomQueries.erase(queryFilePath);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ForgetMissingCustomQueries
+//
+// Description:
+//  This method drops the queries read from files of the directory that are
+//  no longer in it.
+//
+//  userQueriesPath - the directory the user specified for the queries.
+//  queries - the query files now in the directory.
+//
+// Returns:
+//    none.
+//
+static void
+ForgetMissingCustomQueries(
+    const string& userQueriesPath,
+    const map<string, VirtualNodeType>& queries)
+{
+    string prefix = userQueriesPath + LINUX_PATH_DELIM;
+
+    lock_guard<mutex> lock(s_CustomQueriesLock);
+
+    for (auto itr = s_CustomQueries.begin(); itr != s_CustomQueries.end();)
     {
-        // Open file to write response.
-        //
-        int fd = open(queryResultPath.c_str(), O_RDWR);
-        if (fd == -1)
+        const string& path = itr->first;
+
+        if (path.compare(0, prefix.length(), prefix) == 0 &&
+            queries.find(path.substr(prefix.length())) == queries.end())
         {
-            ReturnErrnoAndPrintError(__FUNCTION__, "open failed");
+            itr = s_CustomQueries.erase(itr);
         }
         else
         {
-            // Write in the response.
-            //
-            result = pwrite(fd, responseString.c_str(), responseString.length(), 0);
-            if (result == -1)
-            {
-                result = ReturnErrnoAndPrintError(__FUNCTION__, "pwrite failed");
-            }
+            ++itr;
+        }
+    }
+}
 
-            // Close fd after write.
-            //
-            result = close(fd);
-            if (result == -1)
+// ---------------------------------------------------------------------------
+// Method: GetCustomQueryNodeType
+//
+// Description:
+//  This method works out how the query file shows in the custom query
+//  directory. A query with parameters is a directory whose entries are
+//  its calls.
+//
+// Returns:
+//    NODE_CUSTOM_QUERY_TEMPLATE if the query has parameters and
+//    NODE_CUSTOM_QUERY_FILE otherwise, or if it can't be read.
+//
+VirtualNodeType
+GetCustomQueryNodeType(
+    const string& queryFilePath)
+{
+    shared_ptr<const CustomQueryText> query;
+
+    if (GetCustomQuery(queryFilePath, query) == 0 && !query->m_parameterNames.empty())
+    {
+        return NODE_CUSTOM_QUERY_TEMPLATE;
+    }
+
+    return NODE_CUSTOM_QUERY_FILE;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ParseCustomQueryArguments
+//
+// Description:
+//  This method splits the name of a call, e.g. "@spid=73,@db=master", into
+//  the values of the parameters of the query. The '@' of the names can be
+//  left out and they are matched regardless of case, like SQL Server does.
+//  Nothing is printed for a name which isn't a call - the shell looks up
+//  all kinds of names.
+//
+//  values - set to the values in the order the parameters are declared.
+//
+// Returns:
+//    0 on success and -1 if a parameter is missing, unknown or repeated.
+//
+int
+ParseCustomQueryArguments(
+    const CustomQueryText& query,
+    const string& arguments,
+    vector<string>& values)
+{
+    vector<bool>    assigned(query.m_parameterNames.size(), false);
+    string          name;
+    size_t          equals;
+    size_t          i;
+
+    values.assign(query.m_parameterNames.size(), string());
+
+    for (auto&& argument : Split(arguments, CUSTOM_QUERY_ARGUMENT_SEPARATOR))
+    {
+        equals = argument.find('=');
+        if (equals == string::npos)
+        {
+            return -1;
+        }
+
+        name = argument.substr(0, equals);
+        if (name.empty() || name[0] != '@')
+        {
+            name = "@" + name;
+        }
+
+        for (i = 0; i < query.m_parameterNames.size(); i++)
+        {
+            if (strcasecmp(query.m_parameterNames[i].c_str(), name.c_str()) == 0)
             {
-                result = ReturnErrnoAndPrintError(__FUNCTION__, "close failed");
+                break;
             }
         }
+
+        if (i == query.m_parameterNames.size() || assigned[i])
+        {
+            return -1;
+        }
+
+        values[i] = argument.substr(equals + 1);
+        assigned[i] = true;
+    }
+
+    for (i = 0; i < assigned.size(); i++)
+    {
+        if (!assigned[i])
+        {
+            return -1;
+        }
     }
+
+    return 0;
 }
 
 // ---------------------------------------------------------------------------
-// Method: RemoveCustomQueriesOutputFiles
+// Method: FormatCustomQueryArguments
 //
 // Description:
-//  Remove all the files under custom query dump directory.
+//  This method makes the name of a call from the values of the parameters
+//  of the query, in the order and with the names they are declared with,
+//  e.g. "@spid=73,@db=master". Names which ParseCustomQueryArguments takes
+//  for the same call give the same name.
 //
-//  dumpPath - absolute path to a custom query dump directory.
+// Returns:
+//    The name of the call.
+//
+string
+FormatCustomQueryArguments(
+    const CustomQueryText& query,
+    const vector<string>& values)
+{
+    string arguments;
+
+    for (size_t i = 0; i < query.m_parameterNames.size(); i++)
+    {
+        if (i > 0)
+        {
+            arguments += CUSTOM_QUERY_ARGUMENT_SEPARATOR;
+        }
+        arguments += query.m_parameterNames[i] + "=" + values[i];
+    }
+
+    return arguments;
+}
+
+// ---------------------------------------------------------------------------
+// Method: QuoteUnicodeLiteral
+//
+// Description:
+//  This method makes an N'...' literal of the value.
 //
 // Returns:
-//    none.
+//    The literal.
 //
-void 
-RemoveCustomQueriesOutputFiles(
-    DIR* dp,
-    const string& dumpPath)
+static string
+QuoteUnicodeLiteral(
+    const string& value)
 {
-    struct dirent*  de;
-    string          filepath;
+    return "N'" + StringReplace(value, "'", "''") + "'";
+}
+
+// ---------------------------------------------------------------------------
+// Method: BuildCustomQueryBatch
+//
+// Description:
+//  This method makes the batch sent to the server for the query.
+//
+//  A query with parameters is run through sp_executesql with the values
+//  passed as parameters, never pasted into the query text. The text is
+//  the same for every call, so the server compiles one plan for the query
+//  and reuses it whatever the values. The values are passed as nvarchar
+//  and converted to the declared types by the server.
+//
+// Returns:
+//    The batch.
+//
+string
+BuildCustomQueryBatch(
+    const CustomQueryText& query,
+    const vector<string>& values)
+{
+    string batch;
+
+    if (query.m_parameterNames.empty())
+    {
+        return query.m_query;
+    }
+
+    assert(values.size() == query.m_parameterNames.size());
+
+    batch = "EXEC sp_executesql " + QuoteUnicodeLiteral(query.m_query) +
+            ", " + QuoteUnicodeLiteral(query.m_parameters);
+
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        batch += ", " + query.m_parameterNames[i] + " = " + QuoteUnicodeLiteral(values[i]);
+    }
+
+    return batch;
+}
 
-    // Remove old files from custom query dump directory
+// ---------------------------------------------------------------------------
+// Method: ExecuteCustomQuery
+//
+// Description:
+//  This method runs the query and takes a snapshot of the output of each
+//  of its result sets.
+//
+//  query - the query read from the query file.
+//  values - the values of the parameters, in the order they are declared.
+//  snapshots - set to the output of the result sets of the query. Left
+//              empty on error.
+//
+// Returns:
+//    0 on success and -1 on error.
+//
+int
+ExecuteCustomQuery(
+    const CustomQueryText& query,
+    const vector<string>& values,
+    const string& hostname,
+    const string& username,
+    const string& password,
+    vector<shared_ptr<const ResultSnapshot>>& snapshots)
+{
+    // Execute the query.
+    // We want the column names as well so use type as TYPE_TSV.
     //
-    while ((de = readdir(dp)) != NULL)
+    int error;
+
+    error = TakeResultSnapshots(BuildCustomQueryBatch(query, values),
+                                hostname, username, password, TYPE_TSV, snapshots);
+    if (error)
     {
-        if (de->d_type == DT_REG)
-        {
-            filepath = StringFormat("%s/%s", dumpPath.c_str(), de->d_name);
+        PrintMsg("Custom query %s failed.\n", query.m_path.c_str());
+    }
 
-            // Do the best to remove the file
-            //
-            (void) remove(filepath.c_str());
-        }
+    return error;
+}
+
+// ---------------------------------------------------------------------------
+// Method: StreamCustomQuery
+//
+// Description:
+//  This method runs the query and writes its output into the sink as the
+//  rows arrive.
+//
+//  query - the query read from the query file.
+//  values - the values of the parameters, in the order they are declared.
+//
+// Returns:
+//    0 on success and -1 on error.
+//
+int
+StreamCustomQuery(
+    const CustomQueryText& query,
+    const vector<string>& values,
+    const string& hostname,
+    const string& username,
+    const string& password,
+    RowSink& sink)
+{
+    int error;
+
+    error = ExecuteQuery(BuildCustomQueryBatch(query, values),
+                         sink, hostname, username, password, TYPE_TSV);
+    if (error)
+    {
+        PrintMsg("Custom query %s failed.\n", query.m_path.c_str());
     }
+
+    return error;
 }
 
 // ---------------------------------------------------------------------------
-// Method: CreateCustomQueriesOutputFiles
+// Method: RefreshCustomQueryFiles
 //
 // Description:
-//  Create 
+//  Make the files of the custom query directory of the server match the
+//  query files in the directory the user specified. This way a query file
+//  which is added or removed is reflected properly.
 //
-//  dumpPath - absolute path to a custom query dump directory.
+//  customQueryDir - the custom query directory in the virtual tree.
 //
 // Returns:
 //    none.
 //
 void 
-CreateCustomQueriesOutputFiles(
+RefreshCustomQueryFiles(
     const string& servername,
-    const string& dumpPath)
+    const shared_ptr<VirtualNode>& customQueryDir)
 {
-    DIR*            userQueriesDir;
-    string          userQueriesPath;
-    string          filepath;
-    struct dirent*  de;
+    DIR*                            userQueriesDir;
+    string                          userQueriesPath;
+    struct dirent*                  de;
+    map<string, VirtualNodeType>    queries;
 
     userQueriesPath = GetUserCustomQueryPath(servername);
     if (!userQueriesPath.empty())
@@ -144,14 +577,19 @@ CreateCustomQueriesOutputFiles(
             {
                 if (de->d_type == DT_REG)
                 {
-                    // Create new files with the same name in
-                    // the dump directory for storing results
+                    // There is a file with the same name for the result
+                    // of each query, or a directory for its calls if it
+                    // has parameters.
                     //
-                    filepath = StringFormat("%s/%s", dumpPath.c_str(), de->d_name);
-                    CreateFile(filepath.c_str());
+                    queries[de->d_name] = GetCustomQueryNodeType(
+                        userQueriesPath + LINUX_PATH_DELIM + de->d_name);
                 }
             }
             closedir(userQueriesDir);
         }
+
+        ForgetMissingCustomQueries(userQueriesPath, queries);
     }
+
+    GetVirtualTree()->ReplaceCustomQueries(customQueryDir, queries);
 }
@@ -14,24 +14,133 @@
 //
 #define CUSTOM_QUERY_FOLDER_NAME                    "customQueries"
 
-// Execute a user custom query
+// Separates the name of a query file from the number of the result set in
+// the names of its result files, e.g. "diag.1".
+//
+#define CUSTOM_QUERY_RESULT_SEPARATOR               "."
+
+// Prefix of the directives a query file can start with, in SQL comments,
+// e.g. "-- dbfs:ttl=5".
+//
+#define CUSTOM_QUERY_DIRECTIVE_PREFIX               "dbfs:"
+
+// Directive setting the number of seconds the result of the query is
+// served from memory.
+//
+#define CUSTOM_QUERY_TTL_DIRECTIVE                  "ttl"
+
+// Directive declaring the parameters of the query, in the form taken by
+// sp_executesql, e.g. "-- dbfs:params=@spid int, @db nvarchar(128)".
+//
+#define CUSTOM_QUERY_PARAMS_DIRECTIVE               "params"
+
+// Separates the arguments of a call of a parameterized query, e.g.
+// "customQueries/blocking_for/@spid=73,@db=master".
+//
+#define CUSTOM_QUERY_ARGUMENT_SEPARATOR             ','
+
+// A query file read into memory.
+//
+struct CustomQueryText
+{
+    string  m_path;
+    string  m_query;
+
+    // Seconds the result is cached for, from the ttl directive. -1 if the
+    // file doesn't have one.
+    //
+    int     m_ttlSec;
+
+    // Declaration of the parameters from the params directive and the
+    // names declared in it, with the '@'. Empty if the query has none.
+    //
+    string          m_parameters;
+    vector<string>  m_parameterNames;
+
+    // Identity of the file this was read from - device, inode, mtime and
+    // size. Changes whenever the file is edited or replaced.
+    //
+    string  m_version;
+};
+
+// Returns the query in the file, reading it only if it changed since it
+// was last read.
+//
+int
+GetCustomQuery(
+    const string& queryFilePath,
+    shared_ptr<const CustomQueryText>& query);
+
+// Drops the query read from the file, once the file is deleted or moved
+// away.
 //
 void
+ForgetCustomQuery(
+    const string& queryFilePath);
+
+// Returns the type of node of the query file in the custom query directory
+// - a file, or a directory of its calls if it has parameters.
+//
+VirtualNodeType
+GetCustomQueryNodeType(
+    const string& queryFilePath);
+
+// Takes the ttl and params directives out of the comments at the top of
+// the query.
+//
+void
+ParseCustomQueryDirectives(
+    CustomQueryText& query);
+
+// Matches the arguments of a call of the parameterized query with its
+// parameters. Returns -1 unless every parameter gets exactly one value.
+//
+int
+ParseCustomQueryArguments(
+    const CustomQueryText& query,
+    const string& arguments,
+    vector<string>& values);
+
+// Makes the name of the call of the parameterized query with the values,
+// the way the calls are listed.
+//
+string
+FormatCustomQueryArguments(
+    const CustomQueryText& query,
+    const vector<string>& values);
+
+// Makes the batch running the query with the values of its parameters.
+//
+string
+BuildCustomQueryBatch(
+    const CustomQueryText& query,
+    const vector<string>& values);
+
+// Execute a user custom query, with the values of its parameters.
+//
+int
 ExecuteCustomQuery(
-    const string& queryFilePath,
-    const string& queryResultPath,
+    const CustomQueryText& query,
+    const vector<string>& values,
     const string& hostname,
     const string& username,
-    const string& password);
+    const string& password,
+    vector<shared_ptr<const ResultSnapshot>>& snapshots);
 
-// Remove all the output files in custom query dump directory.
+// Execute a user custom query, writing its output into the sink as the
+// rows arrive.
 //
-void RemoveCustomQueriesOutputFiles(
-    DIR* dp,
-    const string& dumpPath);
+int
+StreamCustomQuery(
+    const CustomQueryText& query,
+    const vector<string>& values,
+    const string& hostname,
+    const string& username,
+    const string& password,
+    RowSink& sink);
 
-// Create output files in custom query dump directory.
+// Update the files of a custom query directory to match the query files.
 //
-void CreateCustomQueriesOutputFiles(
+void RefreshCustomQueryFiles(
     const string& servername,
-    const string& dumpPath);
\ No newline at end of file
+    const shared_ptr<VirtualNode>& customQueryDir);
@@ -0,0 +1,382 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: CustomQueryWatcher.cpp
+//
+// Purpose:
+//   This file contains the definitions of the watcher keeping the custom
+//   query directories in step with the query files of the user.
+//
+#include "UtilsPrivate.h"
+
+// Events of the directory of query files that change its list of files,
+// or whether a query file has parameters.
+//
+#define CUSTOM_QUERY_WATCH_EVENTS   (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                                     IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | \
+                                     IN_ONLYDIR)
+
+// The process wide watcher.
+//
+static CustomQueryWatcher s_CustomQueryWatcher;
+
+// ---------------------------------------------------------------------------
+// Method: CustomQueryWatcher Constructor
+//
+// Description:
+//    Creates a watcher which is not watching anything yet.
+//
+// Returns:
+//    none
+//
+CustomQueryWatcher::CustomQueryWatcher() :
+    m_inotifyFd(-1),
+    m_stopFd(-1)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: Start
+//
+// Description:
+//    This method watches the directory of query files of every server
+//    which has one. The custom query directory is read once more after
+//    the watch is in place, so that files created in between are not
+//    missed. If inotify can't be used, the directories keep being read
+//    on opendir.
+//
+// Returns:
+//    VOID
+//
+void
+CustomQueryWatcher::Start()
+{
+    WatchedDirectory    watched;
+    int                 wd;
+
+    if (m_inotifyFd != -1)
+    {
+        return;
+    }
+
+    m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    m_stopFd = eventfd(0, EFD_CLOEXEC);
+    if (m_inotifyFd == -1 || m_stopFd == -1)
+    {
+        PrintMsg("Could not watch the custom queries - %s\n", strerror(errno));
+        Stop();
+        return;
+    }
+
+    for (auto&& itr : g_ServerInfoMap)
+    {
+        if (itr.second->m_customQueriesPath.empty())
+        {
+            continue;
+        }
+
+        watched.m_servername = itr.first;
+        watched.m_userQueriesPath = itr.second->m_customQueriesPath;
+        watched.m_customQueryDir = GetVirtualTree()->Lookup(
+            (LINUX_PATH_DELIM + itr.first + LINUX_PATH_DELIM CUSTOM_QUERY_FOLDER_NAME).c_str());
+        if (!watched.m_customQueryDir)
+        {
+            continue;
+        }
+
+        wd = inotify_add_watch(m_inotifyFd, watched.m_userQueriesPath.c_str(),
+                               CUSTOM_QUERY_WATCH_EVENTS);
+        if (wd == -1)
+        {
+            PrintMsg("Could not watch %s - %s\n",
+                watched.m_userQueriesPath.c_str(), strerror(errno));
+            continue;
+        }
+
+        RefreshCustomQueryFiles(watched.m_servername, watched.m_customQueryDir);
+
+        lock_guard<mutex> lock(m_lock);
+        m_watchedServers.insert(watched.m_servername);
+        m_watches[wd] = watched;
+    }
+
+    m_thread = thread(&CustomQueryWatcher::Run, this);
+}
+
+// ---------------------------------------------------------------------------
+// Method: Stop
+//
+// Description:
+//    This method stops the thread and closes the watches.
+//
+// Returns:
+//    VOID
+//
+void
+CustomQueryWatcher::Stop()
+{
+    uint64_t one = 1;
+
+    if (m_thread.joinable())
+    {
+        if (write(m_stopFd, &one, sizeof(one)) != sizeof(one))
+        {
+            PrintMsg("Could not stop the custom query watcher - %s\n", strerror(errno));
+        }
+        m_thread.join();
+    }
+
+    if (m_inotifyFd != -1)
+    {
+        close(m_inotifyFd);
+        m_inotifyFd = -1;
+    }
+
+    if (m_stopFd != -1)
+    {
+        close(m_stopFd);
+        m_stopFd = -1;
+    }
+
+    lock_guard<mutex> lock(m_lock);
+    m_watches.clear();
+    m_watchedServers.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Method: IsWatched
+//
+// Description:
+//    This method checks if the custom query directory of the server is
+//    kept up to date by the watcher.
+//
+// Returns:
+//    bool
+//
+bool
+CustomQueryWatcher::IsWatched(
+    const string& servername)
+{
+    lock_guard<mutex> lock(m_lock);
+
+    return m_watchedServers.count(servername) != 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Run
+//
+// Description:
+//    This method is the main loop of the thread. It waits for inotify
+//    events, or for Stop(), and handles the events.
+//
+// Returns:
+//    VOID
+//
+void
+CustomQueryWatcher::Run()
+{
+    char                        buffer[CUSTOM_QUERY_EVENT_BUFFER_SIZE]
+                                    __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* event;
+    struct pollfd               fds[2];
+    ssize_t                     length;
+
+    fds[0].fd = m_inotifyFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_stopFd;
+    fds[1].events = POLLIN;
+
+    while (true)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            PrintMsg("Custom query watcher failed - %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents)
+        {
+            break;
+        }
+
+        while ((length = read(m_inotifyFd, buffer, sizeof(buffer))) > 0)
+        {
+            for (char* ptr = buffer; ptr < buffer + length;
+                 ptr += sizeof(struct inotify_event) + event->len)
+            {
+                event = (const struct inotify_event*)ptr;
+                HandleEvent(event);
+            }
+        }
+    }
+
+    // Whatever happened, opendir reads the directories from now on.
+    //
+    lock_guard<mutex> lock(m_lock);
+    m_watchedServers.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Method: HandleEvent
+//
+// Description:
+//    This method adds a file to the custom query directory for a query
+//    file created or moved in, and removes the file of a query file
+//    deleted or moved away. Like on opendir, only regular files count.
+//    A query file which was written to is looked at again, since gaining
+//    or losing parameters turns its file into a directory or back.
+//
+//    Once the watched directory itself is deleted or moved the watch is
+//    dropped and the custom query directory goes back to being read on
+//    opendir.
+//
+// Returns:
+//    VOID
+//
+void
+CustomQueryWatcher::HandleEvent(
+    const struct inotify_event* event)
+{
+    WatchedDirectory    watched;
+    struct stat         stbuf;
+    string              path;
+
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        RefreshAll();
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(m_lock);
+
+        auto itr = m_watches.find(event->wd);
+        if (itr == m_watches.end())
+        {
+            return;
+        }
+        watched = itr->second;
+
+        if (event->mask & IN_IGNORED)
+        {
+            m_watchedServers.erase(watched.m_servername);
+            m_watches.erase(itr);
+        }
+    }
+
+    if (event->mask & IN_IGNORED)
+    {
+        PrintMsg("Stopped watching %s\n", watched.m_userQueriesPath.c_str());
+        RefreshCustomQueryFiles(watched.m_servername, watched.m_customQueryDir);
+        return;
+    }
+
+    if (event->mask & IN_MOVE_SELF)
+    {
+        // The path no longer leads to the directory. IN_IGNORED follows.
+        //
+        inotify_rm_watch(m_inotifyFd, event->wd);
+        return;
+    }
+
+    if (event->len == 0 || (event->mask & IN_ISDIR))
+    {
+        return;
+    }
+
+    if (event->mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE))
+    {
+        path = watched.m_userQueriesPath + LINUX_PATH_DELIM + event->name;
+        if (lstat(path.c_str(), &stbuf) == 0 && S_ISREG(stbuf.st_mode))
+        {
+            GetVirtualTree()->SetNode(watched.m_customQueryDir, event->name,
+                                      GetCustomQueryNodeType(path));
+        }
+    }
+    else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        ForgetCustomQuery(watched.m_userQueriesPath + LINUX_PATH_DELIM + event->name);
+        GetVirtualTree()->RemoveNode(watched.m_customQueryDir, event->name);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: RefreshAll
+//
+// Description:
+//    This method reads all the watched directories again. The kernel drops
+//    events when too many are queued.
+//
+// Returns:
+//    VOID
+//
+void
+CustomQueryWatcher::RefreshAll()
+{
+    vector<WatchedDirectory> watches;
+
+    {
+        lock_guard<mutex> lock(m_lock);
+        for (auto&& itr : m_watches)
+        {
+            watches.push_back(itr.second);
+        }
+    }
+
+    for (auto&& watched : watches)
+    {
+        RefreshCustomQueryFiles(watched.m_servername, watched.m_customQueryDir);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: StartCustomQueryWatcher
+//
+// Description:
+//    This method starts watching the query files of all the servers.
+//
+// Returns:
+//    VOID
+//
+void
+StartCustomQueryWatcher()
+{
+    s_CustomQueryWatcher.Start();
+}
+
+// ---------------------------------------------------------------------------
+// Method: StopCustomQueryWatcher
+//
+// Description:
+//    This method stops watching the query files.
+//
+// Returns:
+//    VOID
+//
+void
+StopCustomQueryWatcher()
+{
+    s_CustomQueryWatcher.Stop();
+}
+
+// ---------------------------------------------------------------------------
+// Method: IsCustomQueryDirWatched
+//
+// Description:
+//    This method checks if the custom query directory of the server is
+//    kept up to date by the watcher.
+//
+// Returns:
+//    bool
+//
+bool
+IsCustomQueryDirWatched(
+    const string& servername)
+{
+    return s_CustomQueryWatcher.IsWatched(servername);
+}
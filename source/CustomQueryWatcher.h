@@ -0,0 +1,99 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: CustomQueryWatcher.h
+//
+// Purpose:
+//   This file contains the declarations of the watcher keeping the custom
+//   query directories in step with the query files of the user.
+//
+#pragma once
+
+// Size of the buffer the inotify events are read into.
+//
+#define CUSTOM_QUERY_EVENT_BUFFER_SIZE  4096
+
+//--------------------------------------------------------------------
+// Class: CustomQueryWatcher
+//
+// Description:
+//  Watches the directories of the users' query files with inotify and adds
+//  or removes the files of the custom query directories as query files
+//  come and go. This way opendir doesn't need to read the directory of
+//  the user every time.
+//
+// Dev notes:
+//  A server whose directory is not watched (inotify failed, or the
+//  directory was removed or moved) is not in m_watchedServers. Its custom
+//  query directory is refreshed on opendir as before.
+//
+class CustomQueryWatcher
+{
+public:
+    // Constructor
+    //
+    CustomQueryWatcher();
+
+    // Watches the query file directories of all the servers and starts
+    // the thread handling the events.
+    //
+    void Start();
+
+    // Stops the thread and the watches.
+    //
+    void Stop();
+
+    // Returns true if the custom query directory of the server is kept up
+    // to date by the watcher.
+    //
+    bool IsWatched(
+        const string& servername);
+
+private:
+    // A watched directory of query files.
+    //
+    struct WatchedDirectory
+    {
+        string                  m_servername;
+        string                  m_userQueriesPath;
+        shared_ptr<VirtualNode> m_customQueryDir;
+    };
+
+    // Main loop of the thread.
+    //
+    void Run();
+
+    // Updates the custom query directory for the event.
+    //
+    void HandleEvent(
+        const struct inotify_event* event);
+
+    // Reads all the directories again after events were lost.
+    //
+    void RefreshAll();
+
+    int                                     m_inotifyFd;
+    int                                     m_stopFd;       // eventfd - stops the thread.
+    thread                                  m_thread;
+    mutex                                   m_lock;         // Guards the members below.
+    unordered_map<int, WatchedDirectory>    m_watches;      // Keyed by watch descriptor.
+    set<string>                             m_watchedServers;
+};
+
+// Starts watching the query files of all the servers.
+//
+void
+StartCustomQueryWatcher();
+
+// Stops watching the query files.
+//
+void
+StopCustomQueryWatcher();
+
+// Returns true if the custom query directory of the server is kept up to
+// date without reading the directory of the user.
+//
+bool
+IsCustomQueryDirWatched(
+    const string& servername);
@@ -0,0 +1,836 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: DbfsService.cpp
+//
+// Purpose:
+//   This file contains the definitions of the parts of the file system
+//   which don't depend on the FUSE API in use - starting and stopping it
+//   and fetching the content of the dbfs files.
+//
+#include "UtilsPrivate.h"
+#include "SingleFlight.h"
+
+// Fetches of DMV contents currently running, keyed by the path of the
+// DMV file - which is made of the server, the DMV and the format.
+//
+static SingleFlight<shared_ptr<const ResultSnapshot>> s_DmvFetches;
+
+// Whether the DMVs of a server have been listed, with --lazy.
+//
+struct ServerCatalogState
+{
+    ServerCatalogState() :
+        m_loaded(false)
+    {
+    }
+
+    std::atomic<bool>                       m_loaded;
+    mutex                                   m_lock;         // Held while listing.
+    std::chrono::steady_clock::time_point   m_lastAttempt;
+    string                                  m_error;        // Content of the error file.
+};
+
+// Catalog state of every server, keyed by the server name. Filled in by
+// StartSQLFs and only read afterwards.
+//
+static unordered_map<string, unique_ptr<ServerCatalogState>> s_ServerCatalogs;
+
+// A run of the query of a custom query file or call, as worked out on
+// open.
+//
+struct CustomQueryRun
+{
+    shared_ptr<const CustomQueryText>   m_query;
+    vector<string>                      m_values;   // Of the parameters of a call.
+    string                              m_cacheKey;
+    int                                 m_cacheTTL;
+};
+
+// Custom queries currently streaming, keyed like their results in the
+// result cache.
+//
+static unordered_map<string, shared_ptr<ResultStream>> s_CustomQueryStreams;
+static mutex s_CustomQueryStreamsLock;
+
+// ---------------------------------------------------------------------------
+// Method: ApplyServerCatalog
+//
+// Description:
+//    This method makes the DMV files of the server directory match the
+//    list of DMVs. Files of DMVs which are still listed keep their node.
+//
+// Returns:
+//    VOID
+//
+static void
+ApplyServerCatalog(
+    const string& servername,
+    const ServerInfo* serverInfo,
+    const vector<string>& dmvNames)
+{
+    shared_ptr<VirtualNode> serverDir;
+    vector<string>          jsonNames;
+    VirtualTree*            tree = GetVirtualTree();
+
+    serverDir = tree->LookupChild(tree->GetRoot(), servername.c_str());
+    assert(serverDir);
+
+    tree->ReplaceFiles(serverDir, dmvNames, NODE_DMV_FILE);
+
+    if (serverInfo->m_version >= 16)
+    {
+        for (const string& dmvName : dmvNames)
+        {
+            jsonNames.push_back(dmvName + JSON_FILE_EXTENSION);
+        }
+        tree->ReplaceFiles(serverDir, jsonNames, NODE_DMV_JSON_FILE);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: RevalidateServerCatalog
+//
+// Description:
+//    This method checks a DMV list read from the catalog cache against
+//    the server in the background, with --lazy. If the version of the
+//    server changed the DMVs are listed again, the files updated and the
+//    cache rewritten.
+//
+//    The check is also the first login to the server. If it fails the
+//    DMV files are taken away and the error file put in their place, as
+//    if the list had not been cached. The next use of the directory after
+//    SQLFS_CATALOG_RETRY_SEC lists the DMVs from the server.
+//
+// Returns:
+//    VOID
+//
+static void
+RevalidateServerCatalog(
+    const string& servername,
+    const string& versionHash)
+{
+    QueueOnQueryWorker(servername, [servername, versionHash]() -> int
+    {
+        ServerInfo*     serverInfo = GetServerInfo(servername);
+        string          currentVersion;
+        vector<string>  dmvNames;
+        VirtualTree*    tree = GetVirtualTree();
+
+        if (FetchServerVersion(serverInfo->m_hostname, serverInfo->m_username,
+                               serverInfo->m_password, currentVersion))
+        {
+            PrintMsg("Could not check the cached DMV list of server %s\n",
+                servername.c_str());
+
+            ServerCatalogState& state = *s_ServerCatalogs.at(servername);
+            lock_guard<mutex>   lock(state.m_lock);
+
+            state.m_error = "Could not log in to server " + servername +
+                            " (" + serverInfo->m_hostname + "). It will be tried again in " +
+                            to_string(SQLFS_CATALOG_RETRY_SEC) + " seconds.\n";
+            state.m_lastAttempt = std::chrono::steady_clock::now();
+            state.m_loaded = false;
+
+            ApplyServerCatalog(servername, serverInfo, vector<string>());
+            tree->ReplaceFiles(tree->LookupChild(tree->GetRoot(), servername.c_str()),
+                               { SERVER_ERROR_FILE_NAME }, NODE_ERROR_FILE);
+            return -1;
+        }
+
+        if (currentVersion == versionHash)
+        {
+            return 0;
+        }
+
+        PrintMsg("Server %s changed version, listing its DMVs again\n",
+            servername.c_str());
+
+        if (FetchDmvNames(serverInfo->m_hostname, serverInfo->m_username,
+                          serverInfo->m_password, dmvNames))
+        {
+            PrintMsg("Failed to query DMV list of server %s\n", servername.c_str());
+            return -1;
+        }
+
+        ApplyServerCatalog(servername, serverInfo, dmvNames);
+        StoreCachedCatalog(*serverInfo, currentVersion, dmvNames);
+
+        return 0;
+    });
+}
+
+// ---------------------------------------------------------------------------
+// Method: StartSQLFs
+//
+// Description:
+//    This method gets invoked as the first step in FUSE setup.
+//    It mainly creates the dump directory (if one is not already present),
+//    starts the query engine and workers and creates the DMV's for all
+//    the servers.
+//
+// Returns:
+//    VOID
+//
+void
+StartSQLFs()
+{
+    int                 result;
+    class ServerInfo*   entry;
+
+    // Creating the dump dir.
+    //
+    result = mkdir(g_UserPaths.m_dumpPath.c_str(), DEFAULT_PERMISSIONS);
+    if (result == -1)
+    {
+        PrintMsg("Mkdir failed for %s - %s\n", 
+            g_UserPaths.m_dumpPath.c_str(), strerror(errno));
+        KillSelf();
+    }
+
+    // Queries are run by the engine from now on. This can't be done
+    // earlier - the threads would not survive FUSE daemonizing.
+    //
+    if (!StartQueryEngine(SQLFS_DEFAULT_QUERY_ENGINE_THREADS))
+    {
+        PrintMsg("Could not start the query engine. Queries will block.\n");
+    }
+
+    // Queries are handed over to the workers so that the FUSE threads stay
+    // free for metadata operations.
+    //
+    StartQueryWorkers(g_NumThreads);
+
+    // Create local DMV entries for all the servers.
+    //
+    for (auto&& itr : g_ServerInfoMap)
+    {
+        entry = itr.second;
+        CreateDbfsFiles(itr.first, entry);
+
+        // The DMVs are only listed when the directory is first used.
+        //
+        if (g_LazyMount)
+        {
+            s_ServerCatalogs[itr.first] = make_unique<ServerCatalogState>();
+        }
+    }
+
+    // Keep the custom query directories in step with the query files.
+    //
+    StartCustomQueryWatcher();
+}
+
+// ---------------------------------------------------------------------------
+// Method: StopSQLFs
+//
+// Description:
+//    This method gets invoked if and when FUSE instance is closing. 
+//    It stops the query workers and engine and closes all the pooled
+//    server connections.
+//
+// Returns:
+//    VOID
+//
+void
+StopSQLFs()
+{
+    PrintMsg("Closing SQLFS\n");
+
+    StopCustomQueryWatcher();
+
+    // No more queries can be in flight after this.
+    //
+    StopQueryWorkers();
+    StopQueryEngine();
+
+    GetResultCache()->Clear();
+
+    // Log out of all the servers.
+    //
+    DestroyConnectionPools();
+
+    ShutdownDBLibrary();
+}
+
+// ---------------------------------------------------------------------------
+// Method: LoadServerCatalog
+//
+// Description:
+//    This method lists the DMVs of the server and creates their files,
+//    unless it was already done. Only used with --lazy, where the mount
+//    comes up with just the server directories.
+//
+//    A list in the catalog cache is used right away and checked against
+//    the server in the background - unless that check failed to log in
+//    before, in which case the server is contacted here.
+//
+//    Callers using the same server wait for the listing, so that they
+//    find the files. The listing asks for the version and the DMVs in one
+//    round trip, run by a query worker like any other query of the
+//    server. If the server can't be reached an error file is put into its
+//    directory instead and the listing is tried again on the first use
+//    after SQLFS_CATALOG_RETRY_SEC.
+//
+// Returns:
+//    VOID
+//
+void
+LoadServerCatalog(
+    const string& servername)
+{
+    ServerInfo*             serverInfo;
+    shared_ptr<VirtualNode> serverDir;
+    vector<string>          dmvNames;
+    string                  versionHash;
+    VirtualTree*            tree = GetVirtualTree();
+    auto                    now = std::chrono::steady_clock::now();
+
+    auto itr = s_ServerCatalogs.find(servername);
+    if (itr == s_ServerCatalogs.end() || itr->second->m_loaded)
+    {
+        return;
+    }
+
+    ServerCatalogState& state = *itr->second;
+    lock_guard<mutex>   lock(state.m_lock);
+
+    if (state.m_loaded ||
+        (!state.m_error.empty() &&
+         now - state.m_lastAttempt < std::chrono::seconds(SQLFS_CATALOG_RETRY_SEC)))
+    {
+        return;
+    }
+
+    serverInfo = GetServerInfo(servername);
+    serverDir = tree->LookupChild(tree->GetRoot(), servername.c_str());
+    assert(serverInfo && serverDir);
+
+    state.m_lastAttempt = now;
+
+    if (state.m_error.empty() && LoadCachedCatalog(*serverInfo, versionHash, dmvNames))
+    {
+        ApplyServerCatalog(servername, serverInfo, dmvNames);
+        tree->ReplaceFiles(serverDir, vector<string>(), NODE_ERROR_FILE);
+
+        RevalidateServerCatalog(servername, versionHash);
+
+        state.m_loaded = true;
+        return;
+    }
+
+    PrintMsg("Listing the DMVs of server %s\n", servername.c_str());
+
+    if (RunOnQueryWorker(servername, [&]() -> int
+        {
+            return FetchServerCatalog(serverInfo->m_hostname, serverInfo->m_username,
+                                      serverInfo->m_password, versionHash, dmvNames);
+        }))
+    {
+        PrintMsg("Failed to query DMV list of server %s\n", servername.c_str());
+
+        state.m_error = "Could not list the DMVs of server " + servername +
+                        " (" + serverInfo->m_hostname + "). It will be tried again in " +
+                        to_string(SQLFS_CATALOG_RETRY_SEC) + " seconds.\n";
+
+        tree->ReplaceFiles(serverDir, { SERVER_ERROR_FILE_NAME }, NODE_ERROR_FILE);
+        return;
+    }
+
+    ApplyServerCatalog(servername, serverInfo, dmvNames);
+    tree->ReplaceFiles(serverDir, vector<string>(), NODE_ERROR_FILE);
+
+    StoreCachedCatalog(*serverInfo, versionHash, dmvNames);
+
+    state.m_error.clear();
+    state.m_loaded = true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetServerError
+//
+// Description:
+//    This method takes the reason the DMVs of the server could not be
+//    listed as the content of its error file.
+//
+// Returns:
+//    VOID
+//
+static void
+GetServerError(
+    const string& servername,
+    shared_ptr<const ResultSnapshot>& snapshot)
+{
+    string error;
+
+    auto itr = s_ServerCatalogs.find(servername);
+    if (itr != s_ServerCatalogs.end())
+    {
+        lock_guard<mutex> lock(itr->second->m_lock);
+        error = itr->second->m_error;
+    }
+
+    snapshot = make_shared<const ResultSnapshot>(std::move(error));
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetDmvFileContent
+//
+// Description:
+//    This function is responsible for fetching the content of the file(DMV)
+//    being opened from the appropriate server and in the appropriate form.
+//
+//    The node of the file carries the name of the server, the DMV and the
+//    format. An appropriate SQL query is sent to the required server. The
+//    response of the SQL Query is taken as an in-memory snapshot.
+//
+//    If results of the DMV are cached, a snapshot taken less than the TTL
+//    ago is returned instead of querying the server. The caller looks in
+//    the cache before it hands the fetch to a query worker; looking again
+//    here finds a snapshot stored by a fetch which finished in between.
+//
+// Returns:
+//    0 on success, 
+//    -1 on internal error.
+//
+static int
+GetDmvFileContent(
+    const VirtualNode& node,
+    shared_ptr<const ResultSnapshot>& snapshot)
+{
+    int                 error = 0;
+    string              query;
+    string              hostname;
+    string              username;
+    string              password;
+    int                 cacheTTL;
+
+    if (node.m_format == TYPE_JSON)
+    {
+        query = "SELECT * FROM [master].[sys].[" + node.m_dmvName + "] FOR JSON AUTO, ROOT('info')";
+    }
+    else
+    {
+        query = "SELECT * FROM [master].[sys].[" + node.m_dmvName + "]";
+    }
+
+    // Serve the result from memory if it was fetched recently enough.
+    //
+    cacheTTL = GetDmvCacheTTL(node.m_servername, node.m_dmvName);
+    if (cacheTTL > 0)
+    {
+        snapshot = GetResultCache()->Lookup(node.m_path);
+        if (snapshot)
+        {
+            return 0;
+        }
+    }
+
+    // Fetch the details for the server.
+    //
+    GetServerDetails(node.m_servername, hostname, username, password);
+
+    error = TakeResultSnapshot(query, hostname, username, password, node.m_format, snapshot);
+    if (error)
+    {
+        PrintMsg("Querying the SQL failed. error = %d\n", error);
+    }
+    else if (cacheTTL > 0)
+    {
+        // Keep it for the next opens.
+        //
+        GetResultCache()->Store(node.m_path, snapshot, cacheTTL);
+    }
+
+    return error;
+}
+
+// ---------------------------------------------------------------------------
+// Method: PrepareCustomQueryRun
+//
+// Description:
+//    This method reads the query of the custom query file, or of the call
+//    of a parameterized query along with its arguments, and works out how
+//    its result is cached.
+//
+//    The result is served from memory for the number of seconds set by
+//    the ttl directive of the query file, or else the cache TTL of the
+//    server. It is cached per version of the query file, so editing the
+//    query never serves the output of the old one.
+//
+// Returns:
+//    0 on success,
+//    -1 if the query file can't be read or no longer fits the node.
+//
+static int
+PrepareCustomQueryRun(
+    const shared_ptr<VirtualNode>& node,
+    const ServerInfo* serverInfo,
+    CustomQueryRun& run)
+{
+    bool isCall = node->m_type == NODE_CUSTOM_QUERY_CALL_FILE;
+
+    // Get the path to the custom query directory user specified and
+    // construct the full path name to the query file.
+    //
+    if (GetCustomQuery(serverInfo->m_customQueriesPath + "/" +
+                       (isCall ? node->m_queryName : node->m_name), run.m_query))
+    {
+        return -1;
+    }
+
+    // The parameters of the query may have changed since the call was
+    // looked up.
+    //
+    if (isCall == run.m_query->m_parameterNames.empty() ||
+        (isCall && ParseCustomQueryArguments(*run.m_query, node->m_name, run.m_values)))
+    {
+        return -1;
+    }
+
+    run.m_cacheTTL = (run.m_query->m_ttlSec >= 0) ? run.m_query->m_ttlSec : serverInfo->m_cacheTTLSec;
+    run.m_cacheKey = node->m_path + "@" + run.m_query->m_version;
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetCustomQueryFileContent
+//
+// Description:
+//    This method runs the query of the custom query file, or of the call
+//    of a parameterized query with its arguments, on a query worker and
+//    takes the output of its first result set as the content of the file.
+//    The other result sets become the result files next to it, all from
+//    this one run.
+//
+// Returns:
+//    0 on success,
+//    -1 if the query file can't be read or the query failed.
+//
+static int
+GetCustomQueryFileContent(
+    const shared_ptr<VirtualNode>& node,
+    const ServerInfo* serverInfo,
+    shared_ptr<const ResultSnapshot>& snapshot)
+{
+    CustomQueryRun                              run;
+    vector<shared_ptr<const ResultSnapshot>>    resultSets;
+    int                                         error;
+
+    if (PrepareCustomQueryRun(node, serverInfo, run))
+    {
+        return -1;
+    }
+
+    if (run.m_cacheTTL > 0)
+    {
+        snapshot = GetResultCache()->Lookup(run.m_cacheKey);
+        if (snapshot)
+        {
+            return 0;
+        }
+    }
+
+    error = RunOnQueryWorker(node->m_servername, [&]() -> int
+    {
+        return ExecuteCustomQuery(
+            *run.m_query,
+            run.m_values,
+            serverInfo->m_hostname,
+            serverInfo->m_username,
+            serverInfo->m_password,
+            resultSets);
+    });
+    if (error)
+    {
+        return -1;
+    }
+
+    if (resultSets.empty())
+    {
+        return 0;
+    }
+
+    snapshot = resultSets.front();
+    resultSets.erase(resultSets.begin());
+    GetVirtualTree()->SetResultSets(node, resultSets);
+
+    if (run.m_cacheTTL > 0)
+    {
+        // Keep it for the next opens.
+        //
+        GetResultCache()->Store(run.m_cacheKey, snapshot, run.m_cacheTTL);
+    }
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: StreamCustomQueryFileContent
+//
+// Description:
+//    This method starts the query of the custom query file, or of the
+//    call, on a query worker and returns right away with the stream its
+//    first result set is read from as the rows arrive. Opens of the same
+//    version of the query while it runs share the stream instead of
+//    running it again.
+//
+//    Once the query is done its output becomes the content of the file,
+//    the other result sets become the result files and the result is
+//    cached, all as if it had been fetched on open.
+//
+// Returns:
+//    0 on success, with either the stream or - for a result served from
+//    the cache - the snapshot set,
+//    -1 if the query file can't be read.
+//
+static int
+StreamCustomQueryFileContent(
+    const shared_ptr<VirtualNode>& node,
+    const ServerInfo* serverInfo,
+    shared_ptr<const ResultSnapshot>& snapshot,
+    shared_ptr<ResultStream>& stream)
+{
+    auto run = make_shared<CustomQueryRun>();
+
+    if (PrepareCustomQueryRun(node, serverInfo, *run))
+    {
+        return -1;
+    }
+
+    if (run->m_cacheTTL > 0)
+    {
+        snapshot = GetResultCache()->Lookup(run->m_cacheKey);
+        if (snapshot)
+        {
+            return 0;
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(s_CustomQueryStreamsLock);
+
+        auto itr = s_CustomQueryStreams.find(run->m_cacheKey);
+        if (itr != s_CustomQueryStreams.end())
+        {
+            stream = itr->second;
+            return 0;
+        }
+
+        stream = make_shared<ResultStream>();
+        s_CustomQueryStreams[run->m_cacheKey] = stream;
+    }
+
+    QueueOnQueryWorker(node->m_servername, [node, serverInfo, run, stream]() -> int
+    {
+        shared_ptr<const ResultSnapshot>            content;
+        vector<shared_ptr<const ResultSnapshot>>    resultSets;
+        vector<string>                              otherOutputs;
+        StreamRowSink                               sink(*stream, otherOutputs);
+        int                                         error;
+
+        error = StreamCustomQuery(
+            *run->m_query,
+            run->m_values,
+            serverInfo->m_hostname,
+            serverInfo->m_username,
+            serverInfo->m_password,
+            sink);
+
+        stream->Finish(error ? -EIO : 0);
+
+        content = stream->GetSnapshot();
+        if (content)
+        {
+            for (string& output : otherOutputs)
+            {
+                resultSets.push_back(make_shared<const ResultSnapshot>(std::move(output)));
+            }
+            GetVirtualTree()->SetResultSets(node, resultSets);
+            GetVirtualTree()->UpdateContent(node, content);
+
+            if (run->m_cacheTTL > 0)
+            {
+                GetResultCache()->Store(run->m_cacheKey, content, run->m_cacheTTL);
+            }
+        }
+
+        // From now on opens find the result in the cache or run the
+        // query again.
+        //
+        lock_guard<mutex> lock(s_CustomQueryStreamsLock);
+        s_CustomQueryStreams.erase(run->m_cacheKey);
+
+        return error;
+    });
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: LookupCustomQueryCall
+//
+// Description:
+//    This method finds the call of the parameterized query with the name,
+//    adding it to the directory of the query the first time. Any name
+//    which gives a value to each parameter of the query is a call - the
+//    directory only lists the ones used lately.
+//
+//    Names which only differ in the order of the arguments, their case or
+//    the '@' are the same call, which is kept under the name made by
+//    FormatCustomQueryArguments().
+//
+// Returns:
+//    The node of the call or NULL if the name is not a call of the query.
+//
+shared_ptr<VirtualNode>
+LookupCustomQueryCall(
+    const shared_ptr<VirtualNode>& templateDir,
+    const char* name)
+{
+    shared_ptr<VirtualNode>             node;
+    shared_ptr<const CustomQueryText>   query;
+    vector<string>                      values;
+    ServerInfo*                         serverInfo;
+    VirtualTree*                        tree = GetVirtualTree();
+
+    node = tree->LookupChild(templateDir, name);
+    if (node || templateDir->m_type != NODE_CUSTOM_QUERY_TEMPLATE)
+    {
+        if (node && node->m_type == NODE_CUSTOM_QUERY_CALL_FILE)
+        {
+            node->MarkUsed();
+        }
+        return node;
+    }
+
+    serverInfo = GetServerInfo(templateDir->m_servername);
+    if (!serverInfo || serverInfo->m_customQueriesPath.empty() ||
+        GetCustomQuery(serverInfo->m_customQueriesPath + "/" + templateDir->m_name, query) ||
+        ParseCustomQueryArguments(*query, name, values))
+    {
+        return nullptr;
+    }
+
+    return tree->AddCall(templateDir, FormatCustomQueryArguments(*query, values),
+                         SQLFS_MAX_CUSTOM_QUERY_CALLS);
+}
+
+// ---------------------------------------------------------------------------
+// Method: FetchDbfsFileContent
+//
+// Description:
+//    This method fetches the content of a dbfs file being opened:
+//    1. If this is a DMV - it will query the server for the content.
+//    2. If this is a custom query file, it will run the query. A call of a
+//       parameterized query runs it with the arguments in its name.
+//    The calling FUSE thread just waits for a query worker to do it.
+//    A result file of a custom query is a result set of its latest run.
+//    3. If this is the error file of a server, it is the reason the server
+//       could not be reached.
+//
+// Returns:
+//    0 on success,
+//    -1 on internal error.
+//
+int
+FetchDbfsFileContent(
+    const shared_ptr<VirtualNode>& node,
+    shared_ptr<const ResultSnapshot>& snapshot)
+{
+    int         error = 0;
+    ServerInfo* serverInfo;
+    int         cacheTTL;
+
+    if (node->m_type == NODE_CUSTOM_QUERY_FILE || node->m_type == NODE_CUSTOM_QUERY_CALL_FILE)
+    {
+        serverInfo = GetServerInfo(node->m_servername);
+        if (serverInfo && !serverInfo->m_customQueriesPath.empty())
+        {
+            error = GetCustomQueryFileContent(node, serverInfo, snapshot);
+        }
+    }
+    else if (node->m_type == NODE_CUSTOM_QUERY_RESULT_FILE)
+    {
+        snapshot = GetVirtualTree()->GetResultSet(node);
+        if (!snapshot)
+        {
+            error = -1;
+        }
+    }
+    else if (node->IsDmvFile())
+    {
+        // A cached result is served right here, without waiting for a
+        // query worker.
+        //
+        cacheTTL = GetDmvCacheTTL(node->m_servername, node->m_dmvName);
+        if (cacheTTL > 0)
+        {
+            snapshot = GetResultCache()->Lookup(node->m_path);
+        }
+
+        // Concurrent opens of the same DMV file share one fetch
+        // and its snapshot.
+        //
+        if (!snapshot)
+        {
+            snapshot = s_DmvFetches.Do(node->m_path, [&]()
+            {
+                shared_ptr<const ResultSnapshot> result;
+
+                RunOnQueryWorker(node->m_servername, [&]() -> int
+                {
+                    return GetDmvFileContent(*node, result);
+                });
+
+                return result;
+            });
+        }
+
+        if (!snapshot)
+        {
+            error = -1;
+        }
+    }
+    else if (node->m_type == NODE_ERROR_FILE)
+    {
+        GetServerError(node->m_servername, snapshot);
+    }
+
+    return error;
+}
+
+// ---------------------------------------------------------------------------
+// Method: StreamDbfsFileContent
+//
+// Description:
+//    This method opens the content of a dbfs file with --stream. A custom
+//    query file or call which has to run its query gets a stream to read
+//    the output from as it arrives. Everything else is fetched as by
+//    FetchDbfsFileContent.
+//
+// Returns:
+//    0 on success,
+//    -1 on internal error.
+//
+int
+StreamDbfsFileContent(
+    const shared_ptr<VirtualNode>& node,
+    shared_ptr<const ResultSnapshot>& snapshot,
+    shared_ptr<ResultStream>& stream)
+{
+    ServerInfo* serverInfo;
+
+    if (node->m_type == NODE_CUSTOM_QUERY_FILE || node->m_type == NODE_CUSTOM_QUERY_CALL_FILE)
+    {
+        serverInfo = GetServerInfo(node->m_servername);
+        if (serverInfo && !serverInfo->m_customQueriesPath.empty())
+        {
+            return StreamCustomQueryFileContent(node, serverInfo, snapshot, stream);
+        }
+    }
+
+    return FetchDbfsFileContent(node, snapshot);
+}
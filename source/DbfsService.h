@@ -0,0 +1,71 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: DbfsService.h
+//
+// Purpose:
+//   This file contains the declarations of the parts of the file system
+//   which don't depend on the FUSE API in use - starting and stopping it
+//   and fetching the content of the dbfs files.
+//
+#pragma once
+
+// Name of the file put into the directory of a server whose DMVs could
+// not be listed. Reading it tells why.
+//
+#define SERVER_ERROR_FILE_NAME          "DBFS_SERVER_ERROR"
+
+// Number of seconds to wait before trying again to list the DMVs of a
+// server which could not be reached.
+//
+#define SQLFS_CATALOG_RETRY_SEC         30
+
+// Number of calls of a parameterized custom query kept in its directory
+// (see VirtualTree::AddCall).
+//
+#define SQLFS_MAX_CUSTOM_QUERY_CALLS    64
+
+// Creates the dump directory, starts the query threads and creates the
+// dbfs files of all the servers. Called by the FUSE backends once the
+// file system is up.
+//
+void
+StartSQLFs();
+
+// Stops the query threads and releases the server connections.
+//
+void
+StopSQLFs();
+
+// With --lazy, lists the DMVs of the server and creates their files the
+// first time something inside its directory is used.
+//
+void
+LoadServerCatalog(
+    const string& servername);
+
+// Returns the entry of the directory of a parameterized custom query with
+// the name, which is created for a call of the query the first time it is
+// looked up. NULL if the name is neither an entry nor a call.
+//
+shared_ptr<VirtualNode>
+LookupCustomQueryCall(
+    const shared_ptr<VirtualNode>& templateDir,
+    const char* name);
+
+// Fetches the content of the dbfs file into a new snapshot.
+//
+int
+FetchDbfsFileContent(
+    const shared_ptr<VirtualNode>& node,
+    shared_ptr<const ResultSnapshot>& snapshot);
+
+// With --stream, opens the content of the dbfs file. Either the snapshot
+// or, for a custom query still running, the stream of its output is set.
+//
+int
+StreamDbfsFileContent(
+    const shared_ptr<VirtualNode>& node,
+    shared_ptr<const ResultSnapshot>& snapshot,
+    shared_ptr<ResultStream>& stream);
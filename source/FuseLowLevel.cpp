@@ -0,0 +1,1811 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: FuseLowLevel.cpp
+//
+// Purpose:
+//   This file contains the file system backend on the low-level (inode
+//   based) libfuse 3 API. It is built instead of sqlfs.cpp when
+//   DBFS_USE_FUSE3_LOWLEVEL is defined (make FUSE3_LOWLEVEL=1).
+//
+//   Compared to the high-level backend no path is resolved for the
+//   operations on the dbfs files, readdirplus hands the attributes out
+//   together with the names, reads of the scratch files can be spliced
+//   and the kernel is told to drop the cached content of refreshed files.
+//
+#include "UtilsPrivate.h"
+
+#ifdef DBFS_USE_FUSE3_LOWLEVEL
+
+// The mounted session.
+//
+static struct fuse_session* s_Session;
+
+// The inodes the kernel knows about.
+//
+static InodeTable s_Inodes;
+
+// Invalidations of refreshed dbfs files waiting to be sent.
+//
+static InvalidationQueue s_Invalidations;
+
+// ---------------------------------------------------------------------------
+// Method: InodeTable Constructor
+//
+// Description:
+//    Creates an empty table. The root is not kept in it - the kernel never
+//    forgets the root.
+//
+// Returns:
+//    none
+//
+InodeTable::InodeTable() :
+    m_nextScratchInode(SCRATCH_INODE_BASE)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: Get
+//
+// Description:
+//    This method finds what the inode refers to.
+//
+// Returns:
+//    true if the inode is known.
+//
+bool
+InodeTable::Get(
+    fuse_ino_t ino,
+    shared_ptr<VirtualNode>& node,
+    string& path)
+{
+    if (ino == FUSE_ROOT_ID)
+    {
+        node = GetVirtualTree()->GetRoot();
+        path = node->m_path;
+        return true;
+    }
+
+    lock_guard<mutex> lock(m_lock);
+
+    auto itr = m_inodes.find(ino);
+    if (itr == m_inodes.end())
+    {
+        return false;
+    }
+
+    node = itr->second.m_node;
+    path = itr->second.m_path;
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Remember
+//
+// Description:
+//    This method counts a lookup. Virtual nodes are known by the inode
+//    number in their attributes. Scratch files are known by their path and
+//    get a new inode number the first time they are looked up.
+//
+// Returns:
+//    The inode number.
+//
+fuse_ino_t
+InodeTable::Remember(
+    const shared_ptr<VirtualNode>& node,
+    const string& path)
+{
+    fuse_ino_t          ino;
+    lock_guard<mutex>   lock(m_lock);
+
+    if (node)
+    {
+        ino = node->m_stat.st_ino;
+        if (ino == FUSE_ROOT_ID)
+        {
+            return ino;
+        }
+    }
+    else
+    {
+        auto itr = m_scratchInodes.find(path);
+        if (itr != m_scratchInodes.end())
+        {
+            ino = itr->second;
+        }
+        else
+        {
+            ino = m_nextScratchInode++;
+            m_scratchInodes.emplace(path, ino);
+        }
+    }
+
+    LowLevelInode& inode = m_inodes[ino];
+
+    if (inode.m_lookups == 0)
+    {
+        inode.m_node = node;
+        inode.m_path = path;
+    }
+    inode.m_lookups++;
+
+    return ino;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Forget
+//
+// Description:
+//    This method drops lookups of the inode and removes it once the kernel
+//    has forgotten all of them.
+//
+// Returns:
+//    VOID
+//
+void
+InodeTable::Forget(
+    fuse_ino_t ino,
+    uint64_t nlookup)
+{
+    lock_guard<mutex> lock(m_lock);
+
+    auto itr = m_inodes.find(ino);
+    if (itr == m_inodes.end())
+    {
+        return;
+    }
+
+    itr->second.m_lookups -= min(nlookup, itr->second.m_lookups);
+    if (itr->second.m_lookups == 0)
+    {
+        if (!itr->second.m_node)
+        {
+            m_scratchInodes.erase(itr->second.m_path);
+        }
+        m_inodes.erase(itr);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: Rename
+//
+// Description:
+//    This method updates the paths of the scratch file or directory that
+//    was renamed and of everything below it.
+//
+// Returns:
+//    VOID
+//
+void
+InodeTable::Rename(
+    const string& from,
+    const string& to)
+{
+    vector<pair<string, fuse_ino_t>>    moved;
+    string                              newPath;
+    lock_guard<mutex>                   lock(m_lock);
+
+    for (auto itr = m_scratchInodes.begin(); itr != m_scratchInodes.end();)
+    {
+        if (itr->first == from ||
+            (itr->first.compare(0, from.size(), from) == 0 && itr->first[from.size()] == '/'))
+        {
+            moved.emplace_back(itr->first, itr->second);
+            itr = m_scratchInodes.erase(itr);
+        }
+        else
+        {
+            ++itr;
+        }
+    }
+
+    for (auto&& entry : moved)
+    {
+        newPath = to + entry.first.substr(from.size());
+
+        m_inodes[entry.second].m_path = newPath;
+        m_scratchInodes[newPath] = entry.second;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: InvalidationQueue Constructor
+//
+// Description:
+//    Creates a queue without a thread.
+//
+// Returns:
+//    none
+//
+InvalidationQueue::InvalidationQueue() :
+    m_session(nullptr),
+    m_running(false)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: Start
+//
+// Description:
+//    This method starts the thread sending the notifications.
+//
+// Returns:
+//    VOID
+//
+void
+InvalidationQueue::Start(
+    struct fuse_session* session)
+{
+    lock_guard<mutex> lock(m_lock);
+
+    if (m_running)
+    {
+        return;
+    }
+
+    m_session = session;
+    m_running = true;
+    m_thread = thread(&InvalidationQueue::Run, this);
+}
+
+// ---------------------------------------------------------------------------
+// Method: Stop
+//
+// Description:
+//    This method stops the thread. Once the file system is going away the
+//    cached content doesn't matter anymore.
+//
+// Returns:
+//    VOID
+//
+void
+InvalidationQueue::Stop()
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (!m_running)
+        {
+            return;
+        }
+        m_running = false;
+        m_inodes.clear();
+    }
+
+    m_changed.notify_all();
+    m_thread.join();
+}
+
+// ---------------------------------------------------------------------------
+// Method: Queue
+//
+// Description:
+//    This method queues the invalidation of the inode.
+//
+// Returns:
+//    VOID
+//
+void
+InvalidationQueue::Queue(
+    fuse_ino_t ino)
+{
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (!m_running)
+        {
+            return;
+        }
+        m_inodes.push_back(ino);
+    }
+
+    m_changed.notify_one();
+}
+
+// ---------------------------------------------------------------------------
+// Method: Run
+//
+// Description:
+//    This method is the main loop of the thread. It drops the cached pages
+//    and attributes of the queued inodes.
+//
+// Returns:
+//    VOID
+//
+void
+InvalidationQueue::Run()
+{
+    fuse_ino_t  ino;
+    int         result;
+
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(m_lock);
+            m_changed.wait(lock, [this] { return !m_inodes.empty() || !m_running; });
+            if (!m_running)
+            {
+                break;
+            }
+            ino = m_inodes.front();
+            m_inodes.pop_front();
+        }
+
+        // -ENOENT only means the kernel has nothing cached of the inode.
+        //
+        result = fuse_lowlevel_notify_inval_inode(m_session, ino, 0, 0);
+        if (result && result != -ENOENT)
+        {
+            PrintMsg("Invalidating inode %llu failed - %s\n",
+                (unsigned long long)ino, strerror(-result));
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetChildPath
+//
+// Description:
+//    This method builds the path of the entry of the directory.
+//
+// Returns:
+//    The path relative to the mount directory.
+//
+static string
+GetChildPath(
+    const string& parentPath,
+    const char* name)
+{
+    if (parentPath == "/")
+    {
+        return parentPath + name;
+    }
+
+    return parentPath + "/" + name;
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetNodeAttributes
+//
+// Description:
+//    This method gets the attributes of the virtual node, or of the scratch
+//    file at the path if node is NULL, and stamps them with the inode number.
+//
+// Returns:
+//    0 on success and errno on error.
+//
+static int
+GetNodeAttributes(
+    const shared_ptr<VirtualNode>& node,
+    const string& path,
+    fuse_ino_t ino,
+    struct stat& stbuf)
+{
+    string fpath;
+
+    if (node)
+    {
+        GetVirtualTree()->GetAttributes(node, stbuf);
+    }
+    else
+    {
+        fpath = CalculateDumpPath(path);
+        if (lstat(fpath.c_str(), &stbuf) == -1)
+        {
+            return errno;
+        }
+    }
+
+    stbuf.st_ino = ino;
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetAttrTimeout
+//
+// Description:
+//    This method returns how long the kernel may cache the attributes of
+//    an inode. In page cache mode they are not cached: the invalidation
+//    of a changed file is queued and may reach the kernel after the first
+//    read, which must not be cut short at the size of the old content.
+//
+// Returns:
+//    The timeout in seconds.
+//
+static double
+GetAttrTimeout()
+{
+    return g_UsePageCache ? 0.0 : LOWLEVEL_ATTR_TIMEOUT_SEC;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReplyEntry
+//
+// Description:
+//    This method counts a lookup of the node or scratch file and replies
+//    with its entry.
+//
+// Returns:
+//    VOID
+//
+static void
+ReplyEntry(
+    fuse_req_t req,
+    const shared_ptr<VirtualNode>& node,
+    const string& path,
+    const struct stat& stbuf)
+{
+    struct fuse_entry_param entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.ino = s_Inodes.Remember(node, path);
+    entry.attr = stbuf;
+    entry.attr.st_ino = entry.ino;
+    entry.attr_timeout = GetAttrTimeout();
+    entry.entry_timeout = LOWLEVEL_ATTR_TIMEOUT_SEC;
+
+    if (fuse_reply_entry(req, &entry) == -ENOENT)
+    {
+        // The request was interrupted - the kernel never got the entry.
+        //
+        s_Inodes.Forget(entry.ino, 1);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: IsVirtualChild
+//
+// Description:
+//    This method checks if the name is an entry of the virtual directory.
+//
+// Returns:
+//    bool
+//
+static bool
+IsVirtualChild(
+    const shared_ptr<VirtualNode>& parent,
+    const char* name)
+{
+    return parent && GetVirtualTree()->LookupChild(parent, name) != nullptr;
+}
+
+// ---------------------------------------------------------------------------
+// Method: InitLowLevelImpl
+//
+// Description:
+//    This method gets invoked as the first step in FUSE setup, after the
+//    process has daemonized. It asks for splicing where the kernel
+//    supports it.
+//
+// Returns:
+//    VOID
+//
+static void
+InitLowLevelImpl(
+    void* userdata,
+    struct fuse_conn_info* conn)
+{
+    (void)userdata;
+
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                   FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_SPLICE_MOVE |
+                                   FUSE_CAP_READDIRPLUS);
+
+    StartSQLFs();
+
+    s_Invalidations.Start(s_Session);
+}
+
+// ---------------------------------------------------------------------------
+// Method: DestroyLowLevelImpl
+//
+// Description:
+//    This method gets invoked if and when FUSE instance is closing.
+//
+// Returns:
+//    VOID
+//
+static void
+DestroyLowLevelImpl(
+    void* userdata)
+{
+    (void)userdata;
+
+    s_Invalidations.Stop();
+
+    StopSQLFs();
+}
+
+// ---------------------------------------------------------------------------
+// Method: LookupLowLevelImpl
+//
+// Description:
+//    This method finds the entry of the directory. Entries of the virtual
+//    directories are nodes of the tree, everything else is looked up in
+//    the dump directory.
+//
+// Returns:
+//    VOID
+//
+static void
+LookupLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char* name)
+{
+    shared_ptr<VirtualNode> parentNode;
+    shared_ptr<VirtualNode> node;
+    string                  parentPath;
+    string                  path;
+    struct stat             stbuf;
+    int                     error;
+
+    if (!s_Inodes.Get(parent, parentNode, parentPath))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (parentNode)
+    {
+        // With --lazy, looking up a file of a server lists its DMVs
+        // first. The custom queries don't need them.
+        //
+        if (g_LazyMount && parentNode->IsServerDirectory() &&
+            strcmp(name, CUSTOM_QUERY_FOLDER_NAME) != 0)
+        {
+            LoadServerCatalog(parentNode->m_servername);
+        }
+
+        // A call of a parameterized custom query is created when first
+        // looked up.
+        //
+        node = LookupCustomQueryCall(parentNode, name);
+    }
+
+    path = node ? node->m_path : GetChildPath(parentPath, name);
+
+    error = GetNodeAttributes(node, path, 0, stbuf);
+    if (error)
+    {
+        fuse_reply_err(req, error);
+        return;
+    }
+
+    ReplyEntry(req, node, path, stbuf);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ForgetLowLevelImpl
+//
+// Description:
+//    This method drops lookups the kernel no longer needs.
+//
+// Returns:
+//    VOID
+//
+static void
+ForgetLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    uint64_t nlookup)
+{
+    s_Inodes.Forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ForgetMultiLowLevelImpl
+//
+// Description:
+//    This method drops lookups of several inodes at once.
+//
+// Returns:
+//    VOID
+//
+static void
+ForgetMultiLowLevelImpl(
+    fuse_req_t req,
+    size_t count,
+    struct fuse_forget_data* forgets)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        s_Inodes.Forget(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetattrLowLevelImpl
+//
+// Description:
+//    This method answers getattr from memory for the virtual nodes and
+//    from the dump directory for all other files. An open dbfs file
+//    reports the size of its snapshot.
+//
+// Returns:
+//    VOID
+//
+static void
+GetattrLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info* fi)
+{
+    shared_ptr<VirtualNode> node;
+    string                  path;
+    struct stat             stbuf;
+    int                     error;
+    FileHandle*             handle;
+
+    if (!s_Inodes.Get(ino, node, path))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    error = GetNodeAttributes(node, path, ino, stbuf);
+    if (error)
+    {
+        fuse_reply_err(req, error);
+        return;
+    }
+
+    handle = fi ? (FileHandle*)(uintptr_t)fi->fh : NULL;
+    if (handle && handle->m_snapshot)
+    {
+        stbuf.st_size = handle->m_snapshot->GetSize();
+    }
+
+    fuse_reply_attr(req, &stbuf, GetAttrTimeout());
+}
+
+// ---------------------------------------------------------------------------
+// Method: SetattrLowLevelImpl
+//
+// Description:
+//    This method changes the mode, owner, size or times of a scratch file.
+//    The virtual nodes can't be changed.
+//
+// Returns:
+//    VOID
+//
+static void
+SetattrLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct stat* attr,
+    int to_set,
+    struct fuse_file_info* fi)
+{
+    shared_ptr<VirtualNode> node;
+    string                  path;
+    string                  fpath;
+    struct stat             stbuf;
+    struct timespec         times[2];
+    int                     result = 0;
+    int                     error;
+
+    if (!s_Inodes.Get(ino, node, path))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (node)
+    {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    fpath = CalculateDumpPath(path);
+
+    if (to_set & FUSE_SET_ATTR_MODE)
+    {
+        result = chmod(fpath.c_str(), attr->st_mode);
+    }
+
+    if (!result && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+    {
+        result = lchown(fpath.c_str(),
+                        (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t)-1,
+                        (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t)-1);
+    }
+
+    if (!result && (to_set & FUSE_SET_ATTR_SIZE))
+    {
+        if (fi && ((FileHandle*)(uintptr_t)fi->fh)->m_fd != -1)
+        {
+            result = ftruncate(((FileHandle*)(uintptr_t)fi->fh)->m_fd, attr->st_size);
+        }
+        else
+        {
+            result = truncate(fpath.c_str(), attr->st_size);
+        }
+    }
+
+    if (!result && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+    {
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1] = times[0];
+
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+        {
+            times[0].tv_nsec = UTIME_NOW;
+        }
+        else if (to_set & FUSE_SET_ATTR_ATIME)
+        {
+            times[0] = attr->st_atim;
+        }
+
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+        {
+            times[1].tv_nsec = UTIME_NOW;
+        }
+        else if (to_set & FUSE_SET_ATTR_MTIME)
+        {
+            times[1] = attr->st_mtim;
+        }
+
+        result = utimensat(AT_FDCWD, fpath.c_str(), times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    if (result == -1)
+    {
+        fuse_reply_err(req, -ReturnErrnoAndPrintError(__FUNCTION__, "setattr failed"));
+        return;
+    }
+
+    error = GetNodeAttributes(node, path, ino, stbuf);
+    if (error)
+    {
+        fuse_reply_err(req, error);
+        return;
+    }
+
+    fuse_reply_attr(req, &stbuf, GetAttrTimeout());
+}
+
+// ---------------------------------------------------------------------------
+// Method: MkdirLowLevelImpl
+//
+// Description:
+//    This method creates a scratch directory in the dump directory.
+//
+// Returns:
+//    VOID
+//
+static void
+MkdirLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char* name,
+    mode_t mode)
+{
+    shared_ptr<VirtualNode> parentNode;
+    string                  parentPath;
+    string                  path;
+    string                  fpath;
+    struct stat             stbuf;
+    int                     error;
+
+    if (!s_Inodes.Get(parent, parentNode, parentPath))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    // The virtual nodes already exist.
+    //
+    if (IsVirtualChild(parentNode, name))
+    {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+
+    path = GetChildPath(parentPath, name);
+    fpath = CalculateDumpPath(path);
+
+    if (mkdir(fpath.c_str(), mode) == -1)
+    {
+        fuse_reply_err(req, -ReturnErrnoAndPrintError(__FUNCTION__, "mkdir failed"));
+        return;
+    }
+
+    error = GetNodeAttributes(nullptr, path, 0, stbuf);
+    if (error)
+    {
+        fuse_reply_err(req, error);
+        return;
+    }
+
+    ReplyEntry(req, nullptr, path, stbuf);
+}
+
+// ---------------------------------------------------------------------------
+// Method: RemoveEntry
+//
+// Description:
+//    This method removes a scratch file or directory. The virtual nodes
+//    can't be removed.
+//
+// Returns:
+//    VOID
+//
+static void
+RemoveEntry(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char* name,
+    bool isDirectory)
+{
+    shared_ptr<VirtualNode> parentNode;
+    string                  parentPath;
+    string                  fpath;
+    int                     result;
+
+    if (!s_Inodes.Get(parent, parentNode, parentPath))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (IsVirtualChild(parentNode, name))
+    {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    fpath = CalculateDumpPath(GetChildPath(parentPath, name));
+
+    result = isDirectory ? rmdir(fpath.c_str()) : unlink(fpath.c_str());
+    if (result == -1)
+    {
+        result = -ReturnErrnoAndPrintError(__FUNCTION__,
+                                           isDirectory ? "rmdir failed" : "unlink failed");
+    }
+
+    fuse_reply_err(req, result);
+}
+
+// ---------------------------------------------------------------------------
+// Method: UnlinkLowLevelImpl
+//
+// Description:
+//    This method removes a scratch file.
+//
+// Returns:
+//    VOID
+//
+static void
+UnlinkLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char* name)
+{
+    RemoveEntry(req, parent, name, false);
+}
+
+// ---------------------------------------------------------------------------
+// Method: RmdirLowLevelImpl
+//
+// Description:
+//    This method removes a scratch directory.
+//
+// Returns:
+//    VOID
+//
+static void
+RmdirLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char* name)
+{
+    RemoveEntry(req, parent, name, true);
+}
+
+// ---------------------------------------------------------------------------
+// Method: RenameLowLevelImpl
+//
+// Description:
+//    This method renames a scratch file or directory. The virtual nodes
+//    can't be renamed or replaced.
+//
+// Returns:
+//    VOID
+//
+static void
+RenameLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char* name,
+    fuse_ino_t newparent,
+    const char* newname,
+    unsigned int flags)
+{
+    shared_ptr<VirtualNode> parentNode;
+    shared_ptr<VirtualNode> newParentNode;
+    string                  parentPath;
+    string                  newParentPath;
+    string                  from;
+    string                  to;
+    int                     result;
+
+    // RENAME_EXCHANGE and RENAME_NOREPLACE are not supported.
+    //
+    if (flags)
+    {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    if (!s_Inodes.Get(parent, parentNode, parentPath) ||
+        !s_Inodes.Get(newparent, newParentNode, newParentPath))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (IsVirtualChild(parentNode, name) || IsVirtualChild(newParentNode, newname))
+    {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    from = GetChildPath(parentPath, name);
+    to = GetChildPath(newParentPath, newname);
+
+    result = rename(CalculateDumpPath(from).c_str(), CalculateDumpPath(to).c_str());
+    if (result == -1)
+    {
+        result = -ReturnErrnoAndPrintError(__FUNCTION__, "rename failed");
+    }
+    else
+    {
+        s_Inodes.Rename(from, to);
+    }
+
+    fuse_reply_err(req, result);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReleaseFileHandle
+//
+// Description:
+//    This method closes the file of the handle, if any, and frees it.
+//
+// Returns:
+//    0 on success and errno on error.
+//
+static int
+ReleaseFileHandle(
+    FileHandle* handle)
+{
+    int result = 0;
+
+    if (handle->m_fd != -1 && close(handle->m_fd) == -1)
+    {
+        result = -ReturnErrnoAndPrintError(__FUNCTION__, "close failed");
+    }
+
+    delete handle;
+
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Method: OpenLowLevelImpl
+//
+// Description:
+//    This method opens a file. A dbfs file gets its content fetched into
+//    the snapshot of the handle, or with --stream the stream of the output
+//    of its query. The kernel keeps what it has cached of the file only in
+//    page cache mode and only if the content hasn't changed - otherwise
+//    the file is invalidated.
+//    Scratch files are opened in the dump directory.
+//
+// Returns:
+//    VOID
+//
+static void
+OpenLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info* fi)
+{
+    shared_ptr<VirtualNode> node;
+    string                  path;
+    string                  fpath;
+    FileHandle*             handle;
+    int                     fd = -1;
+    bool                    unchanged;
+
+    if (!s_Inodes.Get(ino, node, path))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (node)
+    {
+        if (!node->IsFile())
+        {
+            fuse_reply_err(req, EISDIR);
+            return;
+        }
+
+        // dbfs files are read only.
+        //
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+    }
+    else
+    {
+        fpath = CalculateDumpPath(path);
+        fd = open(fpath.c_str(), fi->flags & ~O_NOFOLLOW);
+        if (fd == -1)
+        {
+            fuse_reply_err(req, -ReturnErrnoAndPrintError(__FUNCTION__, "open failed"));
+            return;
+        }
+    }
+
+    handle = new FileHandle();
+    handle->m_fd = fd;
+    handle->m_node = node;
+
+    if (node)
+    {
+        if (g_StreamResults ?
+            StreamDbfsFileContent(node, handle->m_snapshot, handle->m_stream) :
+            FetchDbfsFileContent(node, handle->m_snapshot))
+        {
+            delete handle;
+            fuse_reply_err(req, EIO);
+            return;
+        }
+
+        if (handle->m_snapshot)
+        {
+            unchanged = GetVirtualTree()->UpdateContent(node, handle->m_snapshot);
+            if (g_UsePageCache)
+            {
+                fi->keep_cache = unchanged;
+                if (!unchanged)
+                {
+                    s_Invalidations.Queue(ino);
+                }
+            }
+        }
+    }
+
+    fi->direct_io = !g_UsePageCache;
+
+    // The size of the output of a query still running isn't known, so the
+    // kernel must pass on reads past the size reported for the file. What
+    // it has cached of the file is about to be stale.
+    //
+    if (handle->m_stream)
+    {
+        fi->direct_io = 1;
+        if (g_UsePageCache)
+        {
+            s_Invalidations.Queue(ino);
+        }
+    }
+    fi->fh = (uintptr_t)handle;
+
+    if (fuse_reply_open(req, fi) == -ENOENT)
+    {
+        // The request was interrupted - there will be no release.
+        //
+        ReleaseFileHandle(handle);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: CreateLowLevelImpl
+//
+// Description:
+//    This method creates and opens a scratch file in the dump directory.
+//
+// Returns:
+//    VOID
+//
+static void
+CreateLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t parent,
+    const char* name,
+    mode_t mode,
+    struct fuse_file_info* fi)
+{
+    shared_ptr<VirtualNode> parentNode;
+    string                  parentPath;
+    string                  path;
+    string                  fpath;
+    FileHandle*             handle;
+    struct fuse_entry_param entry;
+    int                     fd;
+
+    if (!s_Inodes.Get(parent, parentNode, parentPath))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (IsVirtualChild(parentNode, name))
+    {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+
+    path = GetChildPath(parentPath, name);
+    fpath = CalculateDumpPath(path);
+
+    fd = open(fpath.c_str(), (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+    if (fd == -1)
+    {
+        fuse_reply_err(req, -ReturnErrnoAndPrintError(__FUNCTION__, "open failed"));
+        return;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    if (fstat(fd, &entry.attr) == -1)
+    {
+        fuse_reply_err(req, -ReturnErrnoAndPrintError(__FUNCTION__, "fstat failed"));
+        close(fd);
+        return;
+    }
+
+    handle = new FileHandle();
+    handle->m_fd = fd;
+
+    entry.ino = s_Inodes.Remember(nullptr, path);
+    entry.attr.st_ino = entry.ino;
+    entry.attr_timeout = GetAttrTimeout();
+    entry.entry_timeout = LOWLEVEL_ATTR_TIMEOUT_SEC;
+
+    fi->direct_io = !g_UsePageCache;
+    fi->fh = (uintptr_t)handle;
+
+    if (fuse_reply_create(req, &entry, fi) == -ENOENT)
+    {
+        s_Inodes.Forget(entry.ino, 1);
+        ReleaseFileHandle(handle);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReadLowLevelImpl
+//
+// Description:
+//    This method serves reads of a dbfs file straight out of its snapshot,
+//    without copying it. Reads of scratch files and of snapshots kept in a
+//    memory file are handed to libfuse as a file descriptor so that they
+//    can be spliced. Reads of the output of a query still running wait
+//    until it has arrived.
+//
+// Returns:
+//    VOID
+//
+static void
+ReadLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    size_t size,
+    off_t off,
+    struct fuse_file_info* fi)
+{
+    FileHandle*                         handle = (FileHandle*)(uintptr_t)fi->fh;
+    struct fuse_bufvec                  buffer = FUSE_BUFVEC_INIT(size);
+    shared_ptr<const ResultSnapshot>    content = handle->m_snapshot;
+    unique_ptr<char[]>                  data;
+    ssize_t                             copied;
+
+    (void)ino;
+
+    // Once the query of a stream is done it is read like a snapshot.
+    //
+    if (!content && handle->m_stream)
+    {
+        content = handle->m_stream->GetSnapshot();
+    }
+
+    if (content)
+    {
+        const ResultSnapshot& snapshot = *content;
+
+        if (off < 0 || (size_t)off >= snapshot.GetSize())
+        {
+            fuse_reply_buf(req, NULL, 0);
+        }
+        else if (snapshot.GetDescriptor() != -1)
+        {
+            buffer.buf[0].size = min(size, snapshot.GetSize() - (size_t)off);
+            buffer.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            buffer.buf[0].fd = snapshot.GetDescriptor();
+            buffer.buf[0].pos = off;
+
+            fuse_reply_data(req, &buffer, FUSE_BUF_SPLICE_MOVE);
+        }
+        else
+        {
+            fuse_reply_buf(req, snapshot.GetData() + off, min(size, snapshot.GetSize() - (size_t)off));
+        }
+        return;
+    }
+
+    // The query is still running - wait for the output.
+    //
+    if (handle->m_stream)
+    {
+        data.reset(new char[size ? size : 1]);
+        copied = handle->m_stream->Read(data.get(), size, off);
+        if (copied < 0)
+        {
+            fuse_reply_err(req, -copied);
+        }
+        else
+        {
+            fuse_reply_buf(req, data.get(), copied);
+        }
+        return;
+    }
+
+    // A dbfs file without content.
+    //
+    if (handle->m_fd == -1)
+    {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    buffer.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buffer.buf[0].fd = handle->m_fd;
+    buffer.buf[0].pos = off;
+
+    fuse_reply_data(req, &buffer, FUSE_BUF_SPLICE_MOVE);
+}
+
+// ---------------------------------------------------------------------------
+// Method: WriteLowLevelImpl
+//
+// Description:
+//    This method writes to a scratch file. dbfs files can't be written to.
+//
+// Returns:
+//    VOID
+//
+static void
+WriteLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    const char* buf,
+    size_t size,
+    off_t off,
+    struct fuse_file_info* fi)
+{
+    FileHandle* handle = (FileHandle*)(uintptr_t)fi->fh;
+    ssize_t     written;
+
+    (void)ino;
+
+    if (handle->m_fd == -1)
+    {
+        PrintMsg("Cannot write to the dbfs files.\n");
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    written = pwrite(handle->m_fd, buf, size, off);
+    if (written == -1)
+    {
+        fuse_reply_err(req, -ReturnErrnoAndPrintError(__FUNCTION__, "pwrite failed"));
+        return;
+    }
+
+    fuse_reply_write(req, written);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReleaseLowLevelImpl
+//
+// Description:
+//    This method closes the file.
+//
+// Returns:
+//    VOID
+//
+static void
+ReleaseLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info* fi)
+{
+    (void)ino;
+
+    fuse_reply_err(req, ReleaseFileHandle((FileHandle*)(uintptr_t)fi->fh));
+}
+
+// ---------------------------------------------------------------------------
+// Method: FsyncLowLevelImpl
+//
+// Description:
+//    This method syncs a scratch file. dbfs files have nothing to sync.
+//
+// Returns:
+//    VOID
+//
+static void
+FsyncLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    int datasync,
+    struct fuse_file_info* fi)
+{
+    FileHandle* handle = (FileHandle*)(uintptr_t)fi->fh;
+    int         result = 0;
+
+    (void)ino;
+
+    if (handle->m_fd != -1)
+    {
+        result = datasync ? fdatasync(handle->m_fd) : fsync(handle->m_fd);
+        if (result == -1)
+        {
+            result = -ReturnErrnoAndPrintError(__FUNCTION__, "fsync failed");
+        }
+    }
+
+    fuse_reply_err(req, result);
+}
+
+// ---------------------------------------------------------------------------
+// Method: OpendirLowLevelImpl
+//
+// Description:
+//    This method lists the directory. A virtual directory is listed from
+//    memory, merged with the scratch files users have put into its
+//    counterpart in the dump directory. A custom query directory which the
+//    watcher doesn't keep up to date gets its files refreshed first.
+//
+// Returns:
+//    VOID
+//
+static void
+OpendirLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info* fi)
+{
+    shared_ptr<VirtualNode>             node;
+    string                              path;
+    string                              fpath;
+    vector<shared_ptr<VirtualNode>>     children;
+    set<string>                         virtualNames;
+    LowLevelDirHandle*                  handle;
+    LowLevelDirEntry                    entry;
+    Route                               route;
+    DIR*                                dp;
+    struct dirent*                      de;
+
+    if (!s_Inodes.Get(ino, node, path))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (node && node->IsFile())
+    {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    handle = new LowLevelDirHandle();
+    handle->m_path = path;
+
+    if (node)
+    {
+        ParseRoute(path.c_str(), route);
+        if (route.m_type == ROUTE_CUSTOM_QUERY_DIR &&
+            !IsCustomQueryDirWatched(node->m_servername))
+        {
+            RefreshCustomQueryFiles(node->m_servername, node);
+        }
+
+        // With --lazy, the DMVs of a server are listed when its directory
+        // is first listed.
+        //
+        if (g_LazyMount && node->IsServerDirectory())
+        {
+            LoadServerCatalog(node->m_servername);
+        }
+
+        GetVirtualTree()->ListChildNodes(node, children);
+        for (auto&& child : children)
+        {
+            entry.m_name = child->m_name;
+            entry.m_node = child;
+            GetVirtualTree()->GetAttributes(child, entry.m_stat);
+
+            virtualNames.insert(entry.m_name);
+            handle->m_entries.push_back(entry);
+        }
+    }
+
+    // A virtual directory doesn't need a counterpart in the dump directory.
+    //
+    fpath = CalculateDumpPath(path);
+    dp = opendir(fpath.c_str());
+    if (!dp && !node)
+    {
+        delete handle;
+        fuse_reply_err(req, -ReturnErrnoAndPrintError(__FUNCTION__, "opendir failed"));
+        return;
+    }
+
+    if (dp)
+    {
+        while ((de = readdir(dp)) != NULL)
+        {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+                virtualNames.count(de->d_name))
+            {
+                continue;
+            }
+
+            if (fstatat(dirfd(dp), de->d_name, &entry.m_stat, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+                continue;
+            }
+
+            entry.m_name = de->d_name;
+            entry.m_node = nullptr;
+            entry.m_stat.st_ino = LOWLEVEL_UNKNOWN_INODE;
+            handle->m_entries.push_back(entry);
+        }
+        closedir(dp);
+    }
+
+    fi->fh = (uintptr_t)handle;
+
+    if (fuse_reply_open(req, fi) == -ENOENT)
+    {
+        delete handle;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: FillDirectory
+//
+// Description:
+//    This method fills the reply to readdir or readdirplus with the entries
+//    starting at the offset. Offsets 0 and 1 are "." and "..". With plus,
+//    every entry returned counts as a lookup and carries the attributes, so
+//    no lookup follows for it.
+//
+// Returns:
+//    VOID
+//
+static void
+FillDirectory(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    size_t size,
+    off_t off,
+    struct fuse_file_info* fi,
+    bool plus)
+{
+    LowLevelDirHandle*      handle = (LowLevelDirHandle*)(uintptr_t)fi->fh;
+    vector<char>            buffer(size);
+    size_t                  used = 0;
+    size_t                  length;
+    size_t                  count = handle->m_entries.size() + 2;
+    const char*             name;
+    struct fuse_entry_param entry;
+
+    for (size_t i = max<off_t>(off, 0); i < count; i++)
+    {
+        memset(&entry, 0, sizeof(entry));
+
+        if (i < 2)
+        {
+            name = (i == 0) ? "." : "..";
+            entry.attr.st_mode = S_IFDIR;
+            entry.attr.st_ino = (i == 0) ? ino : LOWLEVEL_UNKNOWN_INODE;
+        }
+        else
+        {
+            name = handle->m_entries[i - 2].m_name.c_str();
+            entry.attr = handle->m_entries[i - 2].m_stat;
+        }
+
+        if (!plus)
+        {
+            length = fuse_add_direntry(req, buffer.data() + used, size - used,
+                                       name, &entry.attr, i + 1);
+            if (length > size - used)
+            {
+                break;
+            }
+        }
+        else
+        {
+            // The entry must fit before its lookup is counted.
+            //
+            length = fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0);
+            if (length > size - used)
+            {
+                break;
+            }
+
+            // "." and ".." are never looked up - inode 0 tells the kernel
+            // not to use the attributes.
+            //
+            if (i >= 2)
+            {
+                const LowLevelDirEntry& dirEntry = handle->m_entries[i - 2];
+
+                entry.ino = s_Inodes.Remember(dirEntry.m_node,
+                                              dirEntry.m_node ? dirEntry.m_node->m_path :
+                                              GetChildPath(handle->m_path, name));
+                entry.attr.st_ino = entry.ino;
+                entry.attr_timeout = GetAttrTimeout();
+                entry.entry_timeout = LOWLEVEL_ATTR_TIMEOUT_SEC;
+            }
+
+            fuse_add_direntry_plus(req, buffer.data() + used, size - used,
+                                   name, &entry, i + 1);
+        }
+
+        used += length;
+    }
+
+    fuse_reply_buf(req, buffer.data(), used);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReaddirLowLevelImpl
+//
+// Description:
+//    This method returns the names of the entries of the directory.
+//
+// Returns:
+//    VOID
+//
+static void
+ReaddirLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    size_t size,
+    off_t off,
+    struct fuse_file_info* fi)
+{
+    FillDirectory(req, ino, size, off, fi, false);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReaddirplusLowLevelImpl
+//
+// Description:
+//    This method returns the entries of the directory along with their
+//    attributes.
+//
+// Returns:
+//    VOID
+//
+static void
+ReaddirplusLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    size_t size,
+    off_t off,
+    struct fuse_file_info* fi)
+{
+    FillDirectory(req, ino, size, off, fi, true);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReleasedirLowLevelImpl
+//
+// Description:
+//    This method frees the listing of the directory.
+//
+// Returns:
+//    VOID
+//
+static void
+ReleasedirLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info* fi)
+{
+    (void)ino;
+
+    delete (LowLevelDirHandle*)(uintptr_t)fi->fh;
+    fuse_reply_err(req, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Method: StatfsLowLevelImpl
+//
+// Description:
+//    This method reports the statistics of the file system holding the
+//    dump directory.
+//
+// Returns:
+//    VOID
+//
+static void
+StatfsLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino)
+{
+    struct statvfs stbuf;
+
+    (void)ino;
+
+    if (statvfs(g_UserPaths.m_dumpPath.c_str(), &stbuf) == -1)
+    {
+        fuse_reply_err(req, -ReturnErrnoAndPrintError(__FUNCTION__, "statvfs failed"));
+        return;
+    }
+
+    fuse_reply_statfs(req, &stbuf);
+}
+
+// ---------------------------------------------------------------------------
+// Method: AccessLowLevelImpl
+//
+// Description:
+//    This method checks the access to a file. dbfs files can't be written.
+//
+// Returns:
+//    VOID
+//
+static void
+AccessLowLevelImpl(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    int mask)
+{
+    shared_ptr<VirtualNode> node;
+    string                  path;
+    string                  fpath;
+    int                     result = 0;
+
+    if (!s_Inodes.Get(ino, node, path))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (node)
+    {
+        if (node->IsFile() && (mask & W_OK))
+        {
+            result = EACCES;
+        }
+    }
+    else
+    {
+        fpath = CalculateDumpPath(path);
+        if (access(fpath.c_str(), mask) == -1)
+        {
+            result = errno;
+        }
+    }
+
+    fuse_reply_err(req, result);
+}
+
+// ---------------------------------------------------------------------------
+// Structure to map the low-level requests to user level functions for the
+// mount directory. Links, symlinks, special files and extended attributes
+// are not supported by this backend.
+//
+static void
+InitializeLowLevelOperations(
+    struct fuse_lowlevel_ops* operations)
+{
+    memset(operations, 0, sizeof(*operations));
+
+    operations->init = InitLowLevelImpl;
+    operations->destroy = DestroyLowLevelImpl;
+    operations->lookup = LookupLowLevelImpl;
+    operations->forget = ForgetLowLevelImpl;
+    operations->forget_multi = ForgetMultiLowLevelImpl;
+    operations->getattr = GetattrLowLevelImpl;
+    operations->setattr = SetattrLowLevelImpl;
+    operations->mkdir = MkdirLowLevelImpl;
+    operations->unlink = UnlinkLowLevelImpl;
+    operations->rmdir = RmdirLowLevelImpl;
+    operations->rename = RenameLowLevelImpl;
+    operations->open = OpenLowLevelImpl;
+    operations->create = CreateLowLevelImpl;
+    operations->read = ReadLowLevelImpl;
+    operations->write = WriteLowLevelImpl;
+    operations->release = ReleaseLowLevelImpl;
+    operations->fsync = FsyncLowLevelImpl;
+    operations->opendir = OpendirLowLevelImpl;
+    operations->readdir = ReaddirLowLevelImpl;
+    operations->readdirplus = ReaddirplusLowLevelImpl;
+    operations->releasedir = ReleasedirLowLevelImpl;
+    operations->statfs = StatfsLowLevelImpl;
+    operations->access = AccessLowLevelImpl;
+}
+
+// ---------------------------------------------------------------------------
+// Method: StartFuse
+//
+// Description:
+//    This method mounts the file system at the mount point and serves it
+//    until it is unmounted or a signal arrives. The process daemonizes
+//    before the session loop starts, unless running in foreground.
+//
+// Returns:
+//    0 on success and -1 on error.
+//
+int
+StartFuse(
+    char* ProgramName)
+{
+    struct fuse_args            args = FUSE_ARGS_INIT(0, NULL);
+    struct fuse_lowlevel_ops    operations;
+    struct fuse_loop_config     loopConfig;
+    int                         result;
+
+    InitializeLowLevelOperations(&operations);
+
+    result = -1;
+
+    fuse_opt_add_arg(&args, ProgramName);
+
+    s_Session = fuse_session_new(&args, &operations, sizeof(operations), NULL);
+    if (s_Session)
+    {
+        if (fuse_set_signal_handlers(s_Session) == 0)
+        {
+            if (fuse_session_mount(s_Session, g_UserPaths.m_mountPath.c_str()) == 0)
+            {
+                fuse_daemonize(g_RunInForeground);
+
+                PrintMsg("Starting fuse\n");
+
+                // With more than one thread every thread gets its own
+                // channel to the kernel (clone_fd), so they don't all wait
+                // on the same descriptor.
+                //
+                if (g_NumThreads == 1)
+                {
+                    result = fuse_session_loop(s_Session) ? -1 : 0;
+                }
+                else
+                {
+                    loopConfig.clone_fd = 1;
+                    loopConfig.max_idle_threads = g_NumThreads;
+                    result = fuse_session_loop_mt(s_Session, &loopConfig) ? -1 : 0;
+                }
+
+                fuse_session_unmount(s_Session);
+            }
+            fuse_remove_signal_handlers(s_Session);
+        }
+        fuse_session_destroy(s_Session);
+        s_Session = nullptr;
+    }
+
+    fuse_opt_free_args(&args);
+
+    return result;
+}
+
+#endif // DBFS_USE_FUSE3_LOWLEVEL
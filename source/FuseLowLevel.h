@@ -0,0 +1,150 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: FuseLowLevel.h
+//
+// Purpose:
+//   This file contains the declarations used by the file system backend
+//   on the low-level (inode based) libfuse 3 API.
+//
+#pragma once
+
+#ifdef DBFS_USE_FUSE3_LOWLEVEL
+
+// Inode numbers handed out for the scratch files. They start far above the
+// numbers of the virtual nodes so that the two never meet.
+//
+#define SCRATCH_INODE_BASE          (1ULL << 48)
+
+// Inode number reported by readdir for entries which have not been looked
+// up, the same value the high-level API reports.
+//
+#define LOWLEVEL_UNKNOWN_INODE      0xffffffff
+
+// Number of seconds the kernel may cache attributes and names, except in
+// page cache mode (see GetAttrTimeout).
+//
+#define LOWLEVEL_ATTR_TIMEOUT_SEC   1.0
+
+// An inode the kernel knows about.
+//
+struct LowLevelInode
+{
+    shared_ptr<VirtualNode> m_node;     // NULL for scratch files.
+    string                  m_path;     // Relative to the mount directory.
+    uint64_t                m_lookups;  // Lookups the kernel hasn't forgotten.
+};
+
+//--------------------------------------------------------------------
+// Class: InodeTable
+//
+// Description:
+//  Maps the inode numbers handed to the kernel back to what they refer
+//  to. Virtual nodes keep the inode number they were created with, so the
+//  operations on them never resolve a path. Scratch files get a number
+//  when they are first looked up. An entry lives until the kernel forgets
+//  all the lookups of it.
+//
+class InodeTable
+{
+public:
+    // Constructor
+    //
+    InodeTable();
+
+    // Finds the inode. Returns false if the kernel passed an unknown one.
+    //
+    bool Get(
+        fuse_ino_t ino,
+        shared_ptr<VirtualNode>& node,
+        string& path);
+
+    // Counts a lookup of the virtual node, or the scratch file at the path
+    // if node is NULL, and returns its inode number.
+    //
+    fuse_ino_t Remember(
+        const shared_ptr<VirtualNode>& node,
+        const string& path);
+
+    // Drops nlookup lookups of the inode.
+    //
+    void Forget(
+        fuse_ino_t ino,
+        uint64_t nlookup);
+
+    // Moves the scratch files under the path to the new path.
+    //
+    void Rename(
+        const string& from,
+        const string& to);
+
+private:
+    mutex                                       m_lock;
+    unordered_map<fuse_ino_t, LowLevelInode>    m_inodes;
+    unordered_map<string, fuse_ino_t>           m_scratchInodes;    // Path to inode.
+    fuse_ino_t                                  m_nextScratchInode;
+};
+
+//--------------------------------------------------------------------
+// Class: InvalidationQueue
+//
+// Description:
+//  Tells the kernel to drop what it has cached of the dbfs files whose
+//  content was refreshed. The notifications must not be sent from the
+//  request handlers, so they are queued for a thread of their own.
+//
+class InvalidationQueue
+{
+public:
+    // Constructor
+    //
+    InvalidationQueue();
+
+    // Starts the thread sending the notifications on the session.
+    //
+    void Start(
+        struct fuse_session* session);
+
+    // Stops the thread. Pending notifications are dropped.
+    //
+    void Stop();
+
+    // Queues the invalidation of the inode.
+    //
+    void Queue(
+        fuse_ino_t ino);
+
+private:
+    // Main loop of the thread.
+    //
+    void Run();
+
+    struct fuse_session*    m_session;
+    thread                  m_thread;
+    mutex                   m_lock;     // Guards the members below.
+    condition_variable      m_changed;
+    deque<fuse_ino_t>       m_inodes;
+    bool                    m_running;
+};
+
+// An entry of an open directory.
+//
+struct LowLevelDirEntry
+{
+    string                  m_name;
+    struct stat             m_stat;
+    shared_ptr<VirtualNode> m_node;     // NULL for scratch files.
+};
+
+// State of an open directory. A pointer to it is kept in fuse_file_info::fh.
+// The entries are listed once on opendir so that the offsets passed to
+// readdir stay meaningful.
+//
+struct LowLevelDirHandle
+{
+    string                      m_path;
+    vector<LowLevelDirEntry>    m_entries;
+};
+
+#endif // DBFS_USE_FUSE3_LOWLEVEL
@@ -0,0 +1,121 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: PathRouter.cpp
+//
+// Purpose:
+//   This file contains the definitions of the parser that works out what
+//   a path of the mount directory refers to.
+//
+#include "UtilsPrivate.h"
+
+// Maximum number of path components the router looks at. Paths with more
+// components than this are not any of the known shapes.
+//
+#define MAX_ROUTE_COMPONENTS    4
+
+// ---------------------------------------------------------------------------
+// Method: ParseRoute
+//
+// Description:
+//    This method splits the path into its components in a single pass,
+//    without copying them, and matches them against the known shapes.
+//    Empty components (repeated or trailing separators) are skipped.
+//
+//    The extension is only recognised at the very end of the name, so a
+//    DMV whose name merely contains ".json" is not taken for a JSON file.
+//
+// Returns:
+//    VOID
+//
+void
+ParseRoute(
+    const char* path,
+    Route& route)
+{
+    PathSlice   components[MAX_ROUTE_COMPONENTS];
+    size_t      count = 0;
+    size_t      extensionLength = strlen(JSON_FILE_EXTENSION);
+    const char* end;
+
+    route = Route();
+    route.m_type = ROUTE_NONE;
+    route.m_format = TYPE_TSV;
+
+    while (*path)
+    {
+        if (*path == '/')
+        {
+            path++;
+            continue;
+        }
+
+        end = strchrnul(path, '/');
+        if (count == MAX_ROUTE_COMPONENTS)
+        {
+            return;
+        }
+        components[count++] = PathSlice(path, end - path);
+        path = end;
+    }
+
+    if (count > 0)
+    {
+        route.m_server = components[0];
+    }
+
+    switch (count)
+    {
+    case 0:
+        route.m_type = ROUTE_ROOT;
+        break;
+
+    case 1:
+        route.m_type = ROUTE_SERVER;
+        break;
+
+    case 2:
+        route.m_name = components[1];
+        route.m_stem = components[1];
+
+        if (route.m_name.Equals(CUSTOM_QUERY_FOLDER_NAME))
+        {
+            route.m_type = ROUTE_CUSTOM_QUERY_DIR;
+            break;
+        }
+
+        route.m_type = ROUTE_SERVER_FILE;
+
+        if (route.m_name.m_length > extensionLength &&
+            PathSlice(route.m_name.m_data + route.m_name.m_length - extensionLength,
+                      extensionLength).Equals(JSON_FILE_EXTENSION))
+        {
+            route.m_stem.m_length -= extensionLength;
+            route.m_format = TYPE_JSON;
+        }
+        break;
+
+    case 3:
+        if (components[1].Equals(CUSTOM_QUERY_FOLDER_NAME))
+        {
+            route.m_type = ROUTE_CUSTOM_QUERY_FILE;
+            route.m_name = components[2];
+            route.m_stem = components[2];
+        }
+        break;
+
+    case 4:
+        if (components[1].Equals(CUSTOM_QUERY_FOLDER_NAME))
+        {
+            route.m_type = ROUTE_CUSTOM_QUERY_CALL;
+            route.m_query = components[2];
+            route.m_name = components[3];
+            route.m_stem = components[3];
+        }
+        break;
+
+    default:
+        break;
+    }
+}
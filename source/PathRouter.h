@@ -0,0 +1,96 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: PathRouter.h
+//
+// Purpose:
+//   This file contains the declarations of the parser that works out what
+//   a path of the mount directory refers to.
+//
+#pragma once
+
+// Extension of the DMV files with JSON content.
+//
+#define JSON_FILE_EXTENSION     ".json"
+
+//--------------------------------------------------------------------
+// Struct: PathSlice
+//
+// Description:
+//  A run of characters inside a path. It doesn't own the characters, so
+//  it is only valid as long as the path it was taken from.
+//
+struct PathSlice
+{
+    PathSlice() :
+        m_data(""),
+        m_length(0)
+    {
+    }
+
+    PathSlice(
+        const char* data,
+        size_t length) :
+        m_data(data),
+        m_length(length)
+    {
+    }
+
+    bool Empty() const
+    {
+        return m_length == 0;
+    }
+
+    // Returns true if the slice holds exactly the given string.
+    //
+    bool Equals(
+        const char* value) const
+    {
+        return strncmp(m_data, value, m_length) == 0 && value[m_length] == '\0';
+    }
+
+    string ToString() const
+    {
+        return string(m_data, m_length);
+    }
+
+    const char* m_data;
+    size_t      m_length;
+};
+
+// The shapes of paths dbfs knows about.
+//
+enum RouteType
+{
+    ROUTE_NONE,                 // Anything else - deeper scratch paths.
+    ROUTE_ROOT,                 // /
+    ROUTE_SERVER,               // /<server>
+    ROUTE_SERVER_FILE,          // /<server>/<file> - a DMV or a scratch file.
+    ROUTE_CUSTOM_QUERY_DIR,     // /<server>/customQueries
+    ROUTE_CUSTOM_QUERY_FILE,    // /<server>/customQueries/<query file>
+    ROUTE_CUSTOM_QUERY_CALL     // /<server>/customQueries/<query file>/<arguments>
+};
+
+//--------------------------------------------------------------------
+// Struct: Route
+//
+// Description:
+//  The result of parsing a path. The slices point into the parsed path.
+//
+struct Route
+{
+    RouteType   m_type;
+    PathSlice   m_server;
+    PathSlice   m_name;     // Last component, for the file routes.
+    PathSlice   m_stem;     // m_name without the .json extension.
+    FileFormat  m_format;   // TYPE_JSON if m_name has the .json extension.
+    PathSlice   m_query;    // The query file, for the custom query calls.
+};
+
+// Parses the path (relative to the mount directory) into the route.
+//
+void
+ParseRoute(
+    const char* path,
+    Route& route);
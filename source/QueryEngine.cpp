@@ -0,0 +1,519 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: QueryEngine.cpp
+//
+// Purpose:
+//   This file contains the definitions of the engine that waits for the
+//   responses of in-flight queries on the sockets of their connections.
+//
+#include "UtilsPrivate.h"
+
+// Epoll event id of the eventfd used to wake up the threads. Queries are
+// numbered from 1.
+//
+#define QUERY_ENGINE_WAKE_ID            0
+
+// Milliseconds a thread waits for events before looking for queries that
+// have timed out.
+//
+#define QUERY_ENGINE_POLL_INTERVAL_MS   1000
+
+// The process wide engine.
+//
+static QueryEngine s_QueryEngine;
+
+// ---------------------------------------------------------------------------
+// Method: QueryEngine Constructor
+//
+// Description:
+//    Creates an engine that is not running. Start() has to be called
+//    before queries can be submitted.
+//
+// Returns:
+//    none
+//
+QueryEngine::QueryEngine() :
+    m_epollFd(-1),
+    m_wakeFd(-1),
+    m_running(false),
+    m_nextId(QUERY_ENGINE_WAKE_ID + 1)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: QueryEngine Destructor
+//
+// Description:
+//    Stops the engine threads.
+//
+QueryEngine::~QueryEngine()
+{
+    Stop();
+}
+
+// ---------------------------------------------------------------------------
+// Method: Start
+//
+// Description:
+//    This method creates the epoll instance the sockets of the in-flight
+//    queries are registered with and starts the threads waiting on it.
+//
+//    The threads must be started in the process that serves the file
+//    system - fuse_main() forks when it daemonizes and threads don't
+//    survive a fork.
+//
+// Returns:
+//    true on success.
+//
+bool
+QueryEngine::Start(
+    int numThreads)
+{
+    struct epoll_event  event;
+
+    if (m_running)
+    {
+        return true;
+    }
+
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollFd == -1)
+    {
+        ReturnErrnoAndPrintError(__FUNCTION__, "epoll_create1 failed");
+        return false;
+    }
+
+    m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wakeFd == -1)
+    {
+        ReturnErrnoAndPrintError(__FUNCTION__, "eventfd failed");
+        close(m_epollFd);
+        m_epollFd = -1;
+        return false;
+    }
+
+    // The wake event is level triggered and never read so that once it
+    // is signalled every thread sees it.
+    //
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = QUERY_ENGINE_WAKE_ID;
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &event) == -1)
+    {
+        ReturnErrnoAndPrintError(__FUNCTION__, "epoll_ctl failed");
+        close(m_wakeFd);
+        close(m_epollFd);
+        m_wakeFd = -1;
+        m_epollFd = -1;
+        return false;
+    }
+
+    m_nextSweep = Clock::now();
+    m_running = true;
+
+    for (int i = 0; i < max(numThreads, 1); i++)
+    {
+        m_threads.emplace_back(&QueryEngine::Run, this);
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Stop
+//
+// Description:
+//    This method wakes up and joins the engine threads. Queries which are
+//    still waiting for a response are failed and their connections are
+//    marked to be thrown away.
+//
+// Returns:
+//    VOID
+//
+void
+QueryEngine::Stop()
+{
+    vector<InFlightQuery*>  remaining;
+    uint64_t                value = 1;
+
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (!m_running)
+        {
+            return;
+        }
+        m_running = false;
+    }
+
+    if (write(m_wakeFd, &value, sizeof(value)) == -1)
+    {
+        ReturnErrnoAndPrintError(__FUNCTION__, "write to eventfd failed");
+    }
+
+    for (auto&& worker : m_threads)
+    {
+        worker.join();
+    }
+    m_threads.clear();
+
+    {
+        lock_guard<mutex> lock(m_lock);
+        for (auto&& entry : m_inFlight)
+        {
+            remaining.push_back(entry.second);
+        }
+        m_inFlight.clear();
+    }
+
+    for (auto&& inFlight : remaining)
+    {
+        Complete(inFlight, FAIL, true);
+    }
+
+    close(m_wakeFd);
+    close(m_epollFd);
+    m_wakeFd = -1;
+    m_epollFd = -1;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Execute
+//
+// Description:
+//    This method sends the query on the given connection and hands the
+//    wait for the response over to the engine threads. The calling thread
+//    sleeps until the server has started to respond and then reads the
+//    results into the sink itself.
+//
+//    The connection must have been borrowed from a pool by the caller, who
+//    also gives it back once this returns.
+//
+// Returns:
+//    SUCCEED on success and FAIL on error.
+//
+RETCODE
+QueryEngine::Execute(
+    DBPROCESS* dbConn,
+    const string& query,
+    RowSink& sink,
+    const FileFormat type,
+    bool& discard)
+{
+    RETCODE             status;
+    InFlightQuery       inFlight;
+    uint64_t            id;
+    struct epoll_event  event;
+
+    discard = true;
+
+    ResetDBErrorContext(dbConn);
+
+    // Only send the query. The server works on it without any thread
+    // having to wait.
+    //
+    dbcmd(dbConn, query.c_str());
+
+    status = dbsqlsend(dbConn);
+    if (status == FAIL)
+    {
+        PrintMsg("Could not send the sql statement: %s\n",
+                 GetDBErrorContext(dbConn)->m_message.c_str());
+        return status;
+    }
+
+    inFlight.m_dbConn = dbConn;
+    inFlight.m_deadline = Clock::now() + std::chrono::seconds(SQLFS_MAX_RESPONSE_WAIT_SEC);
+    inFlight.m_status = FAIL;
+    inFlight.m_discard = true;
+    inFlight.m_done = false;
+
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (!m_running)
+        {
+            return FAIL;
+        }
+
+        id = m_nextId++;
+        m_inFlight[id] = &inFlight;
+    }
+
+    // One shot - the socket stays quiet until the response is read.
+    //
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = id;
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, dbiordesc(dbConn), &event) == -1)
+    {
+        ReturnErrnoAndPrintError(__FUNCTION__, "epoll_ctl failed");
+
+        // Unless it has already been failed by someone else.
+        //
+        if (Claim(id))
+        {
+            return FAIL;
+        }
+    }
+
+    {
+        unique_lock<mutex> lock(inFlight.m_lock);
+        inFlight.m_completed.wait(lock, [&inFlight] { return inFlight.m_done; });
+    }
+
+    if (inFlight.m_status == FAIL)
+    {
+        discard = inFlight.m_discard;
+        return FAIL;
+    }
+
+    return ReadResponse(dbConn, sink, type, discard);
+}
+
+// ---------------------------------------------------------------------------
+// Method: Run
+//
+// Description:
+//    This method is the main loop of the engine threads. It waits for the
+//    sockets of in-flight queries to become readable and wakes up their
+//    callers. Queries that have timed out are failed in between.
+//
+// Returns:
+//    VOID
+//
+void
+QueryEngine::Run()
+{
+    struct epoll_event  events[SQLFS_QUERY_ENGINE_MAX_EVENTS];
+    int                 count;
+    InFlightQuery*      inFlight;
+
+    while (m_running)
+    {
+        count = epoll_wait(m_epollFd, events, SQLFS_QUERY_ENGINE_MAX_EVENTS,
+                           QUERY_ENGINE_POLL_INTERVAL_MS);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ReturnErrnoAndPrintError(__FUNCTION__, "epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            if (events[i].data.u64 == QUERY_ENGINE_WAKE_ID)
+            {
+                continue;
+            }
+
+            inFlight = Claim(events[i].data.u64);
+            if (inFlight)
+            {
+                Complete(inFlight, SUCCEED, false);
+            }
+        }
+
+        ExpireTimedOut();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: Claim
+//
+// Description:
+//    This method takes the query with the given id out of the in-flight
+//    list. Only the caller which gets the query back may complete it.
+//
+// Returns:
+//    The query or NULL if it has already been claimed.
+//
+QueryEngine::InFlightQuery*
+QueryEngine::Claim(
+    uint64_t id)
+{
+    InFlightQuery*      inFlight = NULL;
+    lock_guard<mutex>   lock(m_lock);
+
+    auto itr = m_inFlight.find(id);
+    if (itr != m_inFlight.end())
+    {
+        inFlight = itr->second;
+        m_inFlight.erase(itr);
+    }
+
+    return inFlight;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReadResponse
+//
+// Description:
+//    This method is called by the thread which ran the query once the
+//    server has started to respond. It reads the results and writes them
+//    into the sink.
+//
+// Returns:
+//    SUCCEED on success and FAIL on error.
+//
+RETCODE
+QueryEngine::ReadResponse(
+    DBPROCESS* dbConn,
+    RowSink& sink,
+    const FileFormat type,
+    bool& discard)
+{
+    RETCODE status;
+
+    discard = true;
+
+    status = dbsqlok(dbConn);
+    if (status == SUCCEED)
+    {
+        dbresults(dbConn);
+
+        // A failed read leaves the output incomplete - the query failed.
+        //
+        status = CopyQueryResults(dbConn, sink, type);
+        discard = (status == FAIL);
+    }
+    else
+    {
+        PrintMsg("Could not execute the sql statement: %s\n",
+                 GetDBErrorContext(dbConn)->m_message.c_str());
+    }
+
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ExpireTimedOut
+//
+// Description:
+//    This method fails the queries which have not received a response in
+//    SQLFS_MAX_RESPONSE_WAIT_SEC - the same limit DB-Library applies to
+//    queries run synchronously. The scan is done at most once a poll
+//    interval no matter how many threads there are.
+//
+// Returns:
+//    VOID
+//
+void
+QueryEngine::ExpireTimedOut()
+{
+    vector<InFlightQuery*>  expired;
+    Clock::time_point       now = Clock::now();
+
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (now < m_nextSweep)
+        {
+            return;
+        }
+        m_nextSweep = now + std::chrono::milliseconds(QUERY_ENGINE_POLL_INTERVAL_MS);
+
+        for (auto itr = m_inFlight.begin(); itr != m_inFlight.end();)
+        {
+            if (itr->second->m_deadline <= now)
+            {
+                expired.push_back(itr->second);
+                itr = m_inFlight.erase(itr);
+            }
+            else
+            {
+                ++itr;
+            }
+        }
+    }
+
+    // The response may still arrive later so the connection can't be
+    // used again.
+    //
+    for (auto&& inFlight : expired)
+    {
+        GetDBErrorContext(inFlight->m_dbConn)->m_message = "Query timed out";
+        PrintMsg("Query timed out after %d seconds\n", SQLFS_MAX_RESPONSE_WAIT_SEC);
+        Complete(inFlight, FAIL, true);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: Complete
+//
+// Description:
+//    This method removes the socket of a claimed query from the epoll
+//    instance and wakes up the thread waiting for the query. A status of
+//    SUCCEED tells it that the response is ready to be read.
+//
+// Returns:
+//    VOID
+//
+void
+QueryEngine::Complete(
+    InFlightQuery* inFlight,
+    RETCODE status,
+    bool discard)
+{
+    // Fails harmlessly if the socket never got registered.
+    //
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, dbiordesc(inFlight->m_dbConn), NULL);
+
+    // The query lives on the stack of the waiting thread. Notify while
+    // holding the lock so that it can't return before this is done.
+    //
+    lock_guard<mutex> lock(inFlight->m_lock);
+    inFlight->m_status = status;
+    inFlight->m_discard = discard;
+    inFlight->m_done = true;
+    inFlight->m_completed.notify_one();
+}
+
+// ---------------------------------------------------------------------------
+// Method: StartQueryEngine
+//
+// Description:
+//    This method starts the process wide query engine.
+//
+// Returns:
+//    true on success.
+//
+bool
+StartQueryEngine(
+    int numThreads)
+{
+    return s_QueryEngine.Start(numThreads);
+}
+
+// ---------------------------------------------------------------------------
+// Method: StopQueryEngine
+//
+// Description:
+//    This method stops the process wide query engine. Queries run after
+//    this are executed synchronously.
+//
+// Returns:
+//    VOID
+//
+void
+StopQueryEngine()
+{
+    s_QueryEngine.Stop();
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetQueryEngine
+//
+// Description:
+//    This method returns the process wide query engine.
+//
+// Returns:
+//    Pointer to the engine.
+//
+QueryEngine*
+GetQueryEngine()
+{
+    return &s_QueryEngine;
+}
@@ -0,0 +1,147 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: QueryEngine.h
+//
+// Purpose:
+//   This file contains the declarations of the engine that waits for the
+//   responses of in-flight queries on the sockets of their connections.
+//
+#pragma once
+
+// Default number of threads waiting for and reading query responses.
+//
+#define SQLFS_DEFAULT_QUERY_ENGINE_THREADS      2
+
+// Maximum number of socket events handled per wakeup of a thread.
+//
+#define SQLFS_QUERY_ENGINE_MAX_EVENTS           64
+
+//--------------------------------------------------------------------
+// Class: QueryEngine
+//
+// Description:
+//  Runs queries without having a thread block while the server works on
+//  them. A query is sent with dbsqlsend() and the socket of its connection
+//  (dbiordesc) is registered with an epoll instance shared by a few engine
+//  threads. Once the server starts responding, one of the engine threads
+//  wakes up the caller, which reads the results into the sink itself. The
+//  engine threads never decode rows, so a long result can't hold them up
+//  and keep the responses of other queries and the timeouts waiting.
+//
+// Dev notes:
+//  Every in-flight query is known by an id that is stored in its epoll
+//  event. Whichever thread takes the id out of m_inFlight (a socket event,
+//  the timeout sweep or Stop()) owns the query from then on - this keeps
+//  a late event from touching a query that has already completed.
+//
+class QueryEngine
+{
+public:
+    // Constructor
+    //
+    QueryEngine();
+
+    // Destructor - stops the threads if they are still running.
+    //
+    ~QueryEngine();
+
+    // Creates the epoll instance and starts the engine threads.
+    //
+    bool Start(
+        int numThreads);
+
+    // Stops the engine threads and fails the queries still in flight.
+    //
+    void Stop();
+
+    // Returns true if queries can be submitted.
+    //
+    bool IsRunning() const
+    {
+        return m_running;
+    }
+
+    // Runs the query on the given connection and writes the results into
+    // the sink. Waits until the query has completed. On return discard
+    // tells if the connection has to be thrown away instead of reused.
+    //
+    RETCODE Execute(
+        DBPROCESS* dbConn,
+        const string& query,
+        RowSink& sink,
+        const FileFormat type,
+        bool& discard);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // A query whose response has not arrived yet. It lives on the stack
+    // of the thread which called Execute(). m_status is SUCCEED once the
+    // response can be read.
+    //
+    struct InFlightQuery
+    {
+        DBPROCESS*          m_dbConn;
+        Clock::time_point   m_deadline;
+        RETCODE             m_status;
+        bool                m_discard;
+        bool                m_done;
+        mutex               m_lock;
+        condition_variable  m_completed;
+    };
+
+    // Main loop of the engine threads.
+    //
+    void Run();
+
+    // Takes the query with the given id out of the in-flight list.
+    //
+    InFlightQuery* Claim(
+        uint64_t id);
+
+    // Reads the response of a query whose socket is readable.
+    //
+    static RETCODE ReadResponse(
+        DBPROCESS* dbConn,
+        RowSink& sink,
+        const FileFormat type,
+        bool& discard);
+
+    // Fails the queries which have waited for too long.
+    //
+    void ExpireTimedOut();
+
+    // Stops watching the socket of a query and wakes up its caller.
+    //
+    void Complete(
+        InFlightQuery* inFlight,
+        RETCODE status,
+        bool discard);
+
+    int                                         m_epollFd;
+    int                                         m_wakeFd;   // eventfd to stop the threads.
+    std::atomic<bool>                           m_running;
+    vector<thread>                              m_threads;
+    mutex                                       m_lock;     // Guards the members below.
+    uint64_t                                    m_nextId;
+    unordered_map<uint64_t, InFlightQuery*>     m_inFlight;
+    Clock::time_point                           m_nextSweep;
+};
+
+// Starts the process wide query engine.
+//
+bool
+StartQueryEngine(
+    int numThreads);
+
+// Stops the process wide query engine.
+//
+void
+StopQueryEngine();
+
+// Returns the process wide query engine.
+//
+QueryEngine*
+GetQueryEngine();
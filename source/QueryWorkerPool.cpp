@@ -0,0 +1,338 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: QueryWorkerPool.cpp
+//
+// Purpose:
+//   This file contains the definitions of the pool of threads that run
+//   the queries on behalf of the FUSE threads.
+//
+#include "UtilsPrivate.h"
+
+// The process wide pool.
+//
+static QueryWorkerPool s_QueryWorkers;
+
+// ---------------------------------------------------------------------------
+// Method: QueryWorkerPool Constructor
+//
+// Description:
+//    Creates a pool without any workers. Until Start() is called work is
+//    run by the thread submitting it.
+//
+// Returns:
+//    none
+//
+QueryWorkerPool::QueryWorkerPool() :
+    m_running(false),
+    m_maxInFlight(1),
+    m_nextQueue(0)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: QueryWorkerPool Destructor
+//
+// Description:
+//    Stops the workers.
+//
+QueryWorkerPool::~QueryWorkerPool()
+{
+    Stop();
+}
+
+// ---------------------------------------------------------------------------
+// Method: Start
+//
+// Description:
+//    This method starts the worker threads. Like the query engine this
+//    has to happen in the process serving the file system, after
+//    fuse_main() has daemonized.
+//
+//    One worker is kept from a server for the work of other servers
+//    waiting behind it, unless there is only one worker.
+//
+// Returns:
+//    VOID
+//
+void
+QueryWorkerPool::Start(
+    int numWorkers)
+{
+    lock_guard<mutex> lock(m_lock);
+
+    if (m_running)
+    {
+        return;
+    }
+
+    m_running = true;
+    m_maxInFlight = max(numWorkers - 1, 1);
+
+    for (int i = 0; i < max(numWorkers, 1); i++)
+    {
+        m_workers.emplace_back(&QueryWorkerPool::Run, this);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: Stop
+//
+// Description:
+//    This method wakes up and joins the workers. The tasks which were
+//    queued but not started are run by the calling thread so that no
+//    caller is left waiting on a future that is never set.
+//
+// Returns:
+//    VOID
+//
+void
+QueryWorkerPool::Stop()
+{
+    vector<std::packaged_task<int()>> remaining;
+
+    {
+        lock_guard<mutex> lock(m_lock);
+        if (!m_running)
+        {
+            return;
+        }
+        m_running = false;
+    }
+
+    m_workAvailable.notify_all();
+
+    for (auto&& worker : m_workers)
+    {
+        worker.join();
+    }
+    m_workers.clear();
+
+    {
+        lock_guard<mutex> lock(m_lock);
+        for (auto&& queue : m_queues)
+        {
+            for (auto&& task : queue->m_tasks)
+            {
+                remaining.push_back(std::move(task));
+            }
+            queue->m_tasks.clear();
+        }
+    }
+
+    for (auto&& task : remaining)
+    {
+        task();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: Submit
+//
+// Description:
+//    This method queues the work on the queue of the given server, creating
+//    the queue on first use, and wakes up a worker.
+//
+// Returns:
+//    The future the result of the work is delivered through.
+//
+std::future<int>
+QueryWorkerPool::Submit(
+    const string& servername,
+    function<int()> work)
+{
+    std::packaged_task<int()>   task(std::move(work));
+    std::future<int>            result = task.get_future();
+    WorkQueue*                  queue;
+
+    {
+        lock_guard<mutex> lock(m_lock);
+
+        if (m_running)
+        {
+            auto itr = m_queueIndex.find(servername);
+            if (itr == m_queueIndex.end())
+            {
+                itr = m_queueIndex.emplace(servername, m_queues.size()).first;
+                m_queues.emplace_back(new WorkQueue());
+            }
+            queue = m_queues[itr->second].get();
+            queue->m_tasks.push_back(std::move(task));
+        }
+    }
+
+    // The task was not moved into a queue - run it here.
+    //
+    if (task.valid())
+    {
+        task();
+    }
+    else
+    {
+        m_workAvailable.notify_one();
+    }
+
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Run
+//
+// Description:
+//    This method is the main loop of the workers. It takes one task at a
+//    time and runs it, waiting while there is no task it may take.
+//
+//    A worker finishing a task frees up a place for its server, and goes
+//    straight on to look for work itself, so it doesn't wake anybody up.
+//
+// Returns:
+//    VOID
+//
+void
+QueryWorkerPool::Run()
+{
+    std::packaged_task<int()>   task;
+    WorkQueue*                  queue;
+
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(m_lock);
+            queue = nullptr;
+            while (m_running && !(queue = TakeTask(task)))
+            {
+                m_workAvailable.wait(lock);
+            }
+            if (!queue)
+            {
+                break;
+            }
+        }
+
+        task();
+
+        {
+            lock_guard<mutex> lock(m_lock);
+            queue->m_inFlight--;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: TakeTask
+//
+// Description:
+//    This method goes through the queues in turn, starting after the one
+//    the last task was taken from, and takes the oldest task of the first
+//    one with work whose server is under the limit of tasks in flight.
+//    The limit only applies while more than one queue has work - with a
+//    single busy server it would just leave a worker idle. Once other
+//    work arrives, the busy server takes no more workers, and the next
+//    worker that finishes one of its tasks picks up the other work.
+//    Called with m_lock held.
+//
+// Returns:
+//    The queue the task was taken from, nullptr if there is none.
+//
+QueryWorkerPool::WorkQueue*
+QueryWorkerPool::TakeTask(
+    std::packaged_task<int()>& task)
+{
+    size_t      index;
+    WorkQueue*  queue;
+    size_t      numWaiting = 0;
+    size_t      maxInFlight;
+
+    for (auto&& waiting : m_queues)
+    {
+        numWaiting += waiting->m_tasks.empty() ? 0 : 1;
+    }
+    maxInFlight = (numWaiting > 1) ? m_maxInFlight : SIZE_MAX;
+
+    for (size_t i = 0; i < m_queues.size(); i++)
+    {
+        index = (m_nextQueue + i) % m_queues.size();
+        queue = m_queues[index].get();
+
+        if (!queue->m_tasks.empty() && queue->m_inFlight < maxInFlight)
+        {
+            task = std::move(queue->m_tasks.front());
+            queue->m_tasks.pop_front();
+            queue->m_inFlight++;
+            m_nextQueue = index + 1;
+            return queue;
+        }
+    }
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------
+// Method: StartQueryWorkers
+//
+// Description:
+//    This method starts the process wide query workers.
+//
+// Returns:
+//    VOID
+//
+void
+StartQueryWorkers(
+    int numWorkers)
+{
+    s_QueryWorkers.Start(numWorkers);
+}
+
+// ---------------------------------------------------------------------------
+// Method: StopQueryWorkers
+//
+// Description:
+//    This method stops the process wide query workers.
+//
+// Returns:
+//    VOID
+//
+void
+StopQueryWorkers()
+{
+    s_QueryWorkers.Stop();
+}
+
+// ---------------------------------------------------------------------------
+// Method: QueueOnQueryWorker
+//
+// Description:
+//    This method hands background work over to a query worker. Work still
+//    queued when the workers stop is run by the stopping thread, so it is
+//    done before the connections are closed.
+//
+// Returns:
+//    VOID
+//
+void
+QueueOnQueryWorker(
+    const string& servername,
+    function<int()> work)
+{
+    s_QueryWorkers.Submit(servername, std::move(work));
+}
+
+// ---------------------------------------------------------------------------
+// Method: RunOnQueryWorker
+//
+// Description:
+//    This method hands the work over to a query worker and waits for it.
+//    FUSE threads call this so that they are only ever waiting on a
+//    future while the query is running.
+//
+// Returns:
+//    The result of the work.
+//
+int
+RunOnQueryWorker(
+    const string& servername,
+    function<int()> work)
+{
+    return s_QueryWorkers.Submit(servername, std::move(work)).get();
+}
@@ -0,0 +1,121 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: QueryWorkerPool.h
+//
+// Purpose:
+//   This file contains the declarations of the pool of threads that run
+//   the queries on behalf of the FUSE threads.
+//
+#pragma once
+
+// Default number of threads running queries.
+//
+#define SQLFS_DEFAULT_QUERY_WORKERS     4
+
+// Most threads that can be asked for with -j/--threads.
+//
+#define SQLFS_MAX_QUERY_WORKERS         256
+
+//--------------------------------------------------------------------
+// Class: QueryWorkerPool
+//
+// Description:
+//  Runs the query work (fetching a DMV, running a custom query) off the
+//  FUSE threads. Work is queued per server and the workers take it from
+//  the queues in turn, oldest first, so every server gets its share no
+//  matter how many servers there are. While other servers have work
+//  waiting, all but one of the workers at most run the work of the same
+//  server, so a slow server never stops the work for other servers from
+//  being picked up. A server whose work is the only work waiting can use
+//  all the workers.
+//
+// Dev notes:
+//  Queues are never removed. m_nextQueue is the queue the next search
+//  for work starts at; it moves past the queue work was taken from.
+//
+class QueryWorkerPool
+{
+public:
+    // Constructor
+    //
+    QueryWorkerPool();
+
+    // Destructor - stops the workers if they are still running.
+    //
+    ~QueryWorkerPool();
+
+    // Starts the worker threads.
+    //
+    void Start(
+        int numWorkers);
+
+    // Stops the workers. Work still queued is run by the calling thread.
+    //
+    void Stop();
+
+    // Queues the work on the queue of the server. If the workers are not
+    // running the work is run right away on the calling thread.
+    //
+    std::future<int> Submit(
+        const string& servername,
+        function<int()> work);
+
+private:
+    // Queue of the work for one server.
+    //
+    struct WorkQueue
+    {
+        WorkQueue() : m_inFlight(0)
+        {
+        }
+
+        deque<std::packaged_task<int()>>    m_tasks;
+        size_t                              m_inFlight;     // Tasks being run.
+    };
+
+    // Main loop of the worker threads.
+    //
+    void Run();
+
+    // Takes the oldest task of the next queue with work that may run
+    // another task. Called with m_lock held.
+    //
+    WorkQueue* TakeTask(
+        std::packaged_task<int()>& task);
+
+    vector<thread>                  m_workers;
+    mutex                           m_lock;         // Guards the members below.
+    condition_variable              m_workAvailable;
+    bool                            m_running;
+    size_t                          m_maxInFlight;  // Per server.
+    size_t                          m_nextQueue;
+    vector<unique_ptr<WorkQueue>>   m_queues;
+    unordered_map<string, size_t>   m_queueIndex;   // Server name to queue.
+};
+
+// Starts the process wide query workers.
+//
+void
+StartQueryWorkers(
+    int numWorkers);
+
+// Stops the process wide query workers.
+//
+void
+StopQueryWorkers();
+
+// Queues the work on a query worker without waiting for it.
+//
+void
+QueueOnQueryWorker(
+    const string& servername,
+    function<int()> work);
+
+// Runs the work on a query worker and waits for its result.
+//
+int
+RunOnQueryWorker(
+    const string& servername,
+    function<int()> work);
@@ -0,0 +1,257 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ResultCache.cpp
+//
+// Purpose:
+//   This file contains the definitions of the in-memory cache of DMV
+//   query results.
+//
+#include "UtilsPrivate.h"
+
+// The process wide cache.
+//
+static ResultCache s_ResultCache;
+
+// ---------------------------------------------------------------------------
+// Method: Lookup
+//
+// Description:
+//    This method looks up the result stored for the key.
+//
+// Returns:
+//    The result or an empty pointer if there is none or it has expired.
+//
+shared_ptr<const ResultSnapshot>
+ResultCache::Lookup(
+    const string& key)
+{
+    lock_guard<mutex> lock(m_lock);
+
+    auto itr = m_entries.find(key);
+    if (itr == m_entries.end())
+    {
+        return nullptr;
+    }
+
+    if (itr->second.m_expiry <= Clock::now())
+    {
+        m_entries.erase(itr);
+        return nullptr;
+    }
+
+    return itr->second.m_result;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Store
+//
+// Description:
+//    This method stores the result for the key, replacing the previous
+//    one. The expired entries of other keys are dropped at the same time
+//    so that results nobody reads anymore don't pile up.
+//
+// Returns:
+//    VOID
+//
+void
+ResultCache::Store(
+    const string& key,
+    shared_ptr<const ResultSnapshot> result,
+    int ttlSec)
+{
+    Clock::time_point   now = Clock::now();
+    lock_guard<mutex>   lock(m_lock);
+
+    RemoveExpiredLocked(now);
+
+    if (ttlSec > 0)
+    {
+        if (result->GetDescriptor() != -1)
+        {
+            MakeRoomForFileLocked(key);
+        }
+
+        CacheEntry& entry = m_entries[key];
+
+        entry.m_result = std::move(result);
+        entry.m_expiry = now + std::chrono::seconds(ttlSec);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: Clear
+//
+// Description:
+//    This method drops all the results.
+//
+// Returns:
+//    VOID
+//
+void
+ResultCache::Clear()
+{
+    lock_guard<mutex> lock(m_lock);
+
+    m_entries.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Method: RemoveExpiredLocked
+//
+// Description:
+//    This method drops the results which have expired. Must be called with
+//    the lock held.
+//
+// Returns:
+//    VOID
+//
+void
+ResultCache::RemoveExpiredLocked(
+    Clock::time_point now)
+{
+    for (auto itr = m_entries.begin(); itr != m_entries.end();)
+    {
+        if (itr->second.m_expiry <= now)
+        {
+            itr = m_entries.erase(itr);
+        }
+        else
+        {
+            ++itr;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: MakeRoomForFileLocked
+//
+// Description:
+//    This method drops the results kept in a memory file which are closest
+//    to expiring until fewer than SQLFS_MAX_CACHED_SNAPSHOT_FILES are left.
+//    The result of the key is about to be replaced, so it doesn't count.
+//    Must be called with the lock held.
+//
+// Returns:
+//    VOID
+//
+void
+ResultCache::MakeRoomForFileLocked(
+    const string& key)
+{
+    size_t  files;
+    auto    oldest = m_entries.end();
+
+    while (true)
+    {
+        files = 0;
+        oldest = m_entries.end();
+
+        for (auto itr = m_entries.begin(); itr != m_entries.end(); ++itr)
+        {
+            if (itr->first == key || itr->second.m_result->GetDescriptor() == -1)
+            {
+                continue;
+            }
+
+            files++;
+            if (oldest == m_entries.end() || itr->second.m_expiry < oldest->second.m_expiry)
+            {
+                oldest = itr;
+            }
+        }
+
+        if (files < SQLFS_MAX_CACHED_SNAPSHOT_FILES)
+        {
+            break;
+        }
+
+        m_entries.erase(oldest);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetDmvCacheTTL
+//
+// Description:
+//    This method finds how long the result of a DMV of the given server
+//    may be served from the cache. A TTL set for the DMV in the section of
+//    the server wins over the TTL of the server, which in turn defaults to
+//    the one given on the command line.
+//
+// Returns:
+//    TTL in seconds, 0 if the result must not be cached.
+//
+int
+GetDmvCacheTTL(
+    const string& servername,
+    const string& dmvName)
+{
+    ServerInfo* serverInfo = GetServerInfo(servername);
+
+    if (!serverInfo)
+    {
+        return 0;
+    }
+
+    auto itr = serverInfo->m_dmvCacheTTLSec.find(dmvName);
+    if (itr != serverInfo->m_dmvCacheTTLSec.end())
+    {
+        return itr->second;
+    }
+
+    return serverInfo->m_cacheTTLSec;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ParseDmvCacheTTLs
+//
+// Description:
+//    This method parses a list of per DMV cache TTLs of the form
+//    <dmv name>:<seconds>,<dmv name>:<seconds>,...
+//
+// Returns:
+//    bool
+//
+bool
+ParseDmvCacheTTLs(
+    const string& str,
+    unordered_map<string, int>& dmvCacheTTLs)
+{
+    vector<string>  entries;
+    vector<string>  tokens;
+    int             ttl;
+
+    dmvCacheTTLs.clear();
+
+    entries = Split(str, ',');
+    for (auto&& entry : entries)
+    {
+        tokens = Split(entry, ':');
+        if (tokens.size() != 2 || !convertToInt(tokens[1], ttl) || ttl < 0)
+        {
+            fprintf(stderr, "Invalid DMV cache TTL \"%s\".\n", entry.c_str());
+            return false;
+        }
+
+        dmvCacheTTLs[Trim(tokens[0])] = ttl;
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetResultCache
+//
+// Description:
+//    This method returns the process wide result cache.
+//
+// Returns:
+//    Pointer to the cache.
+//
+ResultCache*
+GetResultCache()
+{
+    return &s_ResultCache;
+}
@@ -0,0 +1,102 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ResultCache.h
+//
+// Purpose:
+//   This file contains the declarations of the in-memory cache of DMV
+//   query results.
+//
+#pragma once
+
+// Default number of seconds a DMV result is served from memory. 0 turns
+// the cache off.
+//
+#define SQLFS_DEFAULT_CACHE_TTL_SEC     0
+
+// Most cached results kept in a memory file. Each of them holds a file
+// descriptor for as long as it is cached.
+//
+#define SQLFS_MAX_CACHED_SNAPSHOT_FILES 256
+
+//--------------------------------------------------------------------
+// Class: ResultCache
+//
+// Description:
+//  Keeps the results of DMV queries in memory for a limited time. The
+//  results are keyed by the path of the DMV file, which identifies the
+//  server, the DMV and the format. Every entry has its own expiry time,
+//  so different DMVs can stay fresh for different amounts of time.
+//
+// Dev notes:
+//  The results are immutable snapshots handed out as shared pointers, so
+//  a result stays valid for the handles reading it even after the entry
+//  expires or is replaced.
+//  Expired entries are dropped when they are looked up and whenever a
+//  result is stored. Large results hold the descriptor of their memory
+//  file, so only SQLFS_MAX_CACHED_SNAPSHOT_FILES of them are kept; storing
+//  another one drops the one closest to expiring.
+//
+class ResultCache
+{
+public:
+    // Returns the result stored for the key if it has not expired yet.
+    //
+    shared_ptr<const ResultSnapshot> Lookup(
+        const string& key);
+
+    // Stores the result for the key for ttlSec seconds.
+    //
+    void Store(
+        const string& key,
+        shared_ptr<const ResultSnapshot> result,
+        int ttlSec);
+
+    // Drops all the results.
+    //
+    void Clear();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct CacheEntry
+    {
+        shared_ptr<const ResultSnapshot>    m_result;
+        Clock::time_point           m_expiry;
+    };
+
+    // Drops the results which have expired.
+    //
+    void RemoveExpiredLocked(
+        Clock::time_point now);
+
+    // Drops the results kept in a memory file closest to expiring until
+    // there is room for another one, not counting the result of the key.
+    //
+    void MakeRoomForFileLocked(
+        const string& key);
+
+    mutex                               m_lock;
+    unordered_map<string, CacheEntry>   m_entries;
+};
+
+// Returns the number of seconds the result of the DMV of the given server
+// stays in the cache.
+//
+int
+GetDmvCacheTTL(
+    const string& servername,
+    const string& dmvName);
+
+// Parses a list of per DMV cache TTLs, "<dmv>:<seconds>,...".
+//
+bool
+ParseDmvCacheTTLs(
+    const string& str,
+    unordered_map<string, int>& dmvCacheTTLs);
+
+// Returns the process wide result cache.
+//
+ResultCache*
+GetResultCache();
@@ -0,0 +1,294 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ResultColumn.cpp
+//
+// Purpose:
+//   This file contains the definitions used to bind the columns of a
+//   result set to native buffers and to format their values as text.
+//
+#include "UtilsPrivate.h"
+
+// Number of bytes of a binary column converted to hex at a time.
+//
+#define HEX_CHUNK_LEN                   512
+
+// ---------------------------------------------------------------------------
+// Method: ResultColumn Constructor
+//
+// Description:
+//    Creates an unbound column.
+//
+// Returns:
+//    none
+//
+ResultColumn::ResultColumn() :
+    m_dbConn(NULL),
+    m_column(0),
+    m_kind(COLUMN_STRING),
+    m_nullIndicator(0)
+{
+    memset(&m_value, 0, sizeof(m_value));
+}
+
+// ---------------------------------------------------------------------------
+// Method: Bind
+//
+// Description:
+//    This method picks how the column is fetched based on its type and
+//    binds it. Numbers and dates are bound to native buffers so that
+//    DB-Library doesn't convert them into strings for every row.
+//
+//    Character and binary columns are left unbound. Their declared width
+//    says nothing about the data (it is 2GB for the max types) so no
+//    buffer is sized from it - the value is read with dbdata/dbdatlen
+//    from the row DB-Library has already received.
+//
+//    The remaining types are bound as null terminated strings into a
+//    buffer sized by the maximum length of an entry in the column.
+//
+// Returns:
+//    VOID
+//
+void
+ResultColumn::Bind(
+    DBPROCESS* dbConn,
+    int column)
+{
+    int     maxColumnEntryLen;
+    int     columnLen;
+
+    m_dbConn = dbConn;
+    m_column = column;
+
+    switch (dbcoltype(dbConn, column))
+    {
+    case SYBCHAR:
+    case SYBVARCHAR:
+    case SYBTEXT:
+    case SYBNTEXT:
+    case SYBNVARCHAR:
+    case XSYBCHAR:
+    case XSYBVARCHAR:
+    case XSYBNCHAR:
+    case XSYBNVARCHAR:
+        m_kind = COLUMN_CHARACTER;
+        return;
+
+    case SYBBINARY:
+    case SYBVARBINARY:
+    case SYBIMAGE:
+    case XSYBBINARY:
+    case XSYBVARBINARY:
+        m_kind = COLUMN_BINARY;
+        return;
+
+    case SYBINT1:
+    case SYBINT2:
+    case SYBINT4:
+    case SYBINT8:
+        m_kind = COLUMN_INTEGER;
+        dbbind(dbConn, column, BIGINTBIND, sizeof(m_value.m_integer),
+            (BYTE*)&m_value.m_integer);
+        break;
+
+    case SYBFLT8:
+    case SYBREAL:
+        m_kind = (dbcoltype(dbConn, column) == SYBREAL) ? COLUMN_REAL : COLUMN_FLOAT;
+        dbbind(dbConn, column, FLT8BIND, sizeof(m_value.m_float),
+            (BYTE*)&m_value.m_float);
+        break;
+
+    case SYBBIT:
+        m_kind = COLUMN_BIT;
+        dbbind(dbConn, column, BITBIND, sizeof(m_value.m_bit),
+            (BYTE*)&m_value.m_bit);
+        break;
+
+    case SYBDATETIME:
+    case SYBDATETIME4:
+        m_kind = COLUMN_DATETIME;
+        dbbind(dbConn, column, DATETIMEBIND, sizeof(m_value.m_datetime),
+            (BYTE*)&m_value.m_datetime);
+        break;
+
+    default:
+        m_kind = COLUMN_STRING;
+        maxColumnEntryLen = MAX_COLUMN_ENTRY_LEN;
+
+        // Calculate column entry length.
+        //
+        if ((columnLen = dbcollen(dbConn, column)) > maxColumnEntryLen)
+        {
+            maxColumnEntryLen = columnLen;
+        }
+
+        // The fourth argument is to specify the maximum size(bytes)
+        // that can be copied into the buffer. This avoids memory corruption.
+        //
+        m_string.resize(maxColumnEntryLen);
+        dbbind(dbConn, column, NTBSTRINGBIND, maxColumnEntryLen,
+            (BYTE*)&m_string[0]);
+        break;
+    }
+
+    // NULL is reported through the indicator instead of a made up value.
+    //
+    dbnullbind(dbConn, column, &m_nullIndicator);
+}
+
+// ---------------------------------------------------------------------------
+// Method: WriteHex
+//
+// Description:
+//    This method writes the data of a binary column as lower case hex
+//    digits, the same way DB-Library converts binary to a string. The
+//    value is converted in fixed size chunks so that large values don't
+//    need a buffer of their size.
+//
+// Returns:
+//    VOID
+//
+void
+ResultColumn::WriteHex(
+    RowSink& sink,
+    const BYTE* data,
+    DBINT length) const
+{
+    static const char   hexDigits[] = "0123456789abcdef";
+    char                buffer[HEX_CHUNK_LEN * 2];
+    DBINT               chunkLen;
+
+    while (length > 0)
+    {
+        chunkLen = min(length, (DBINT)HEX_CHUNK_LEN);
+        for (DBINT i = 0; i < chunkLen; i++)
+        {
+            buffer[2 * i] = hexDigits[data[i] >> 4];
+            buffer[2 * i + 1] = hexDigits[data[i] & 0xf];
+        }
+        sink.Write(buffer, 2 * chunkLen);
+
+        data += chunkLen;
+        length -= chunkLen;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: WriteValue
+//
+// Description:
+//    This method formats the value fetched for the current row into a
+//    buffer on the stack and writes it to the sink.
+//
+// Returns:
+//    VOID
+//
+void
+ResultColumn::WriteValue(
+    RowSink& sink) const
+{
+    char        buffer[VALUE_TEXT_MAX_LEN];
+    DBINT       length = 0;
+    const char* data;
+
+    if (m_nullIndicator == -1)
+    {
+        return;
+    }
+
+    switch (m_kind)
+    {
+    case COLUMN_CHARACTER:
+        // NULL has no data. Large values are passed on to the sink
+        // without being copied into its buffer.
+        //
+        data = (const char*)dbdata(m_dbConn, m_column);
+        if (data)
+        {
+            sink.Write(data, dbdatlen(m_dbConn, m_column));
+        }
+        break;
+
+    case COLUMN_BINARY:
+        data = (const char*)dbdata(m_dbConn, m_column);
+        if (data)
+        {
+            WriteHex(sink, (const BYTE*)data, dbdatlen(m_dbConn, m_column));
+        }
+        break;
+
+    case COLUMN_INTEGER:
+        length = FormatInt64(m_value.m_integer, buffer);
+        sink.Write(buffer, length);
+        break;
+
+    case COLUMN_FLOAT:
+        // The digits DB-Library's conversion to text gives, so that 0.1
+        // still reads 0.1 rather than 0.10000000000000001.
+        //
+        length = snprintf(buffer, sizeof(buffer), "%.15g", m_value.m_float);
+        sink.Write(buffer, length);
+        break;
+
+    case COLUMN_REAL:
+        length = snprintf(buffer, sizeof(buffer), "%.7g", m_value.m_float);
+        sink.Write(buffer, length);
+        break;
+
+    case COLUMN_BIT:
+        sink.Write(m_value.m_bit ? '1' : '0');
+        break;
+
+    case COLUMN_DATETIME:
+        // DB-Library's own conversion, so that dates read the way its
+        // date format gives them, as when they were bound as strings.
+        // Converting to a fixed size char pads the buffer with blanks
+        // past the returned length.
+        //
+        length = dbconvert(m_dbConn, SYBDATETIME, (const BYTE*)&m_value.m_datetime,
+                           sizeof(m_value.m_datetime), SYBCHAR, (BYTE*)buffer,
+                           sizeof(buffer));
+        if (length > 0)
+        {
+            sink.Write(buffer, length);
+        }
+        break;
+
+    case COLUMN_STRING:
+        data = m_string.c_str();
+        sink.Write(data, strlen(data));
+        break;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: BindResultColumns
+//
+// Description:
+//    This method resizes the vector to hold the required number of
+//    entries (equal to number of columns) and binds each of them.
+//
+// Returns:
+//    VOID
+//
+void
+BindResultColumns(
+    DBPROCESS* dbConn,
+    int numColumns,
+    vector<ResultColumn>& columns)
+{
+    // The vector must not be resized after this - DB-Library holds
+    // pointers into its elements.
+    //
+    columns.clear();
+    columns.resize(numColumns);
+
+    // Column numbers start from 1.
+    //
+    for (int i = 0; i < numColumns; i++)
+    {
+        columns[i].Bind(dbConn, i + 1);
+    }
+}
@@ -0,0 +1,99 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ResultColumn.h
+//
+// Purpose:
+//   This file contains the declarations used to bind the columns of a
+//   result set to native buffers and to format their values as text.
+//
+#pragma once
+
+// Minimum size of the buffer a column is bound to when it is fetched
+// as a string.
+//
+#define MAX_COLUMN_ENTRY_LEN            32
+
+// Size of the buffer the value of a number or date column is formatted
+// into.
+//
+#define VALUE_TEXT_MAX_LEN              64
+
+// The way the value of a column is fetched from DB-Library.
+//
+enum ColumnKind
+{
+    COLUMN_INTEGER,     // tinyint, smallint, int and bigint
+    COLUMN_FLOAT,       // float
+    COLUMN_REAL,        // real
+    COLUMN_BIT,         // bit
+    COLUMN_DATETIME,    // datetime and smalldatetime
+    COLUMN_CHARACTER,   // (n)char, (n)varchar including max, (n)text
+    COLUMN_BINARY,      // binary, varbinary including max, image
+    COLUMN_STRING       // everything else, converted by DB-Library
+};
+
+//--------------------------------------------------------------------
+// Class: ResultColumn
+//
+// Description:
+//  Holds the buffer one column of a result set is bound to. Numbers and
+//  dates are bound in their native form and only turned into text when
+//  written to the sink. Variable length character and binary columns are
+//  not bound at all - their data is read in place from the row buffer of
+//  DB-Library. All the other types are bound as strings.
+//
+// Dev notes:
+//  DB-Library keeps the address of the buffer, so an object must not
+//  move after Bind() has been called.
+//
+class ResultColumn
+{
+public:
+    // Constructor
+    //
+    ResultColumn();
+
+    // Binds the column (numbering starts from 1) of the current result
+    // set to this object according to its type.
+    //
+    void Bind(
+        DBPROCESS* dbConn,
+        int column);
+
+    // Writes the value of the column in the current row to the sink.
+    // NULL values are written as nothing.
+    //
+    void WriteValue(
+        RowSink& sink) const;
+
+private:
+    // Writes the data of a binary column as hex digits.
+    //
+    void WriteHex(
+        RowSink& sink,
+        const BYTE* data,
+        DBINT length) const;
+
+    DBPROCESS*      m_dbConn;
+    int             m_column;
+    ColumnKind      m_kind;
+    DBINT           m_nullIndicator;
+    union
+    {
+        DBBIGINT    m_integer;
+        DBFLT8      m_float;
+        DBBIT       m_bit;
+        DBDATETIME  m_datetime;
+    }               m_value;
+    string          m_string;
+};
+
+// This method binds all the columns of the current result set.
+//
+void
+BindResultColumns(
+    DBPROCESS* dbConn,
+    int numColumns,
+    vector<ResultColumn>& columns);
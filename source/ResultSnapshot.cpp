@@ -0,0 +1,424 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ResultSnapshot.cpp
+//
+// Purpose:
+//   This file contains the definitions of the in-memory snapshots of
+//   query results that open dbfs files are read from.
+//
+#include "UtilsPrivate.h"
+
+// ---------------------------------------------------------------------------
+// Method: CreateSnapshotFile
+//
+// Description:
+//    This method creates an empty memory file for the content of a
+//    snapshot.
+//
+// Returns:
+//    The descriptor of the file or -1 on error.
+//
+static int
+CreateSnapshotFile()
+{
+#ifdef SYS_memfd_create
+    return syscall(SYS_memfd_create, "dbfs-snapshot", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    return -1;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Method: ResultSnapshot Constructor
+//
+// Description:
+//    Creates a snapshot holding the given content. Large content is moved
+//    into a memory file.
+//
+// Returns:
+//    none
+//
+ResultSnapshot::ResultSnapshot(
+    string&& content) :
+    m_fd(-1),
+    m_data(nullptr),
+    m_size(content.size())
+{
+    int fd;
+
+    if (m_size >= SNAPSHOT_FILE_MIN_SIZE)
+    {
+        fd = CreateSnapshotFile();
+        if (fd != -1)
+        {
+            FileRowSink sink(fd);
+
+            if (sink.Write(content.data(), content.size()) ||
+                sink.Flush() ||
+                !MapFile(fd))
+            {
+                close(fd);
+            }
+        }
+    }
+
+    if (m_fd == -1)
+    {
+        m_content = std::move(content);
+        m_data = m_content.data();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: ResultSnapshot Constructor
+//
+// Description:
+//    Creates a snapshot of the content of the memory file. If the file
+//    can't be mapped its content is read into memory instead.
+//
+// Returns:
+//    none
+//
+ResultSnapshot::ResultSnapshot(
+    int fd,
+    size_t size) :
+    m_fd(-1),
+    m_data(nullptr),
+    m_size(size)
+{
+    ssize_t bytesRead;
+    size_t  done = 0;
+
+    if (MapFile(fd))
+    {
+        return;
+    }
+
+    m_content.resize(m_size);
+    while (done < m_size)
+    {
+        bytesRead = pread(fd, &m_content[done], m_size - done, done);
+        if (bytesRead <= 0)
+        {
+            if (bytesRead == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        done += bytesRead;
+    }
+    close(fd);
+
+    m_content.resize(done);
+    m_size = done;
+    m_data = m_content.data();
+}
+
+// ---------------------------------------------------------------------------
+// Method: MapFile
+//
+// Description:
+//    This method seals the memory file holding the content, so that its
+//    pages can't change while they are spliced or mapped, and maps it.
+//    The snapshot owns the file once this succeeds.
+//
+// Returns:
+//    true if the file was mapped.
+//
+bool
+ResultSnapshot::MapFile(
+    int fd)
+{
+    void* mapping;
+
+#ifdef F_ADD_SEALS
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+
+    mapping = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_fd = fd;
+    m_data = (const char*)mapping;
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ResultSnapshot Destructor
+//
+// Description:
+//    Unmaps and closes the memory file if there is one.
+//
+ResultSnapshot::~ResultSnapshot()
+{
+    if (m_fd != -1)
+    {
+        munmap((void*)m_data, m_size);
+        close(m_fd);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: Read
+//
+// Description:
+//    This method copies a part of the content into the buffer.
+//
+// Returns:
+//    Number of bytes copied.
+//
+size_t
+ResultSnapshot::Read(
+    char* buffer,
+    size_t size,
+    off_t offset) const
+{
+    if (offset < 0 || (size_t)offset >= m_size)
+    {
+        return 0;
+    }
+
+    size = min(size, m_size - (size_t)offset);
+    memcpy(buffer, m_data + offset, size);
+
+    return size;
+}
+
+// ---------------------------------------------------------------------------
+// Method: HasSameContent
+//
+// Description:
+//    This method compares the content with the content of another snapshot.
+//
+// Returns:
+//    bool
+//
+bool
+ResultSnapshot::HasSameContent(
+    const ResultSnapshot& other) const
+{
+    return m_size == other.m_size && memcmp(m_data, other.m_data, m_size) == 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: TakeResultSnapshot
+//
+// Description:
+//    This method executes the query on the given server and collects its
+//    whole output into a new snapshot.
+//
+// Returns:
+//    0 on success and -1 on error.
+//
+int
+TakeResultSnapshot(
+    const string& query,
+    const string& hostname,
+    const string& username,
+    const string& password,
+    const FileFormat type,
+    shared_ptr<const ResultSnapshot>& snapshot)
+{
+    vector<shared_ptr<const ResultSnapshot>>    snapshots;
+    SnapshotRowSink                             sink(snapshots, false);
+    int                                         error;
+
+    error = ExecuteQuery(query, sink, hostname, username, password, type);
+    if (!error)
+    {
+        sink.Finish();
+        snapshot = snapshots.front();
+    }
+
+    return error;
+}
+
+// ---------------------------------------------------------------------------
+// Method: TakeResultSnapshots
+//
+// Description:
+//    This method executes the query (a batch) on the given server and
+//    collects the output of each result set into a snapshot of its own.
+//    There is always at least one snapshot, empty if the batch returned
+//    no rows at all.
+//
+// Returns:
+//    0 on success and -1 on error.
+//
+int
+TakeResultSnapshots(
+    const string& query,
+    const string& hostname,
+    const string& username,
+    const string& password,
+    const FileFormat type,
+    vector<shared_ptr<const ResultSnapshot>>& snapshots)
+{
+    SnapshotRowSink sink(snapshots, true);
+    int             error;
+
+    snapshots.clear();
+
+    error = ExecuteQuery(query, sink, hostname, username, password, type);
+    if (!error)
+    {
+        sink.Finish();
+    }
+    else
+    {
+        snapshots.clear();
+    }
+
+    return error;
+}
+
+// ---------------------------------------------------------------------------
+// Method: SnapshotRowSink Constructor
+//
+// Description:
+//    The snapshots are appended to the vector owned by the caller.
+//
+// Returns:
+//    none
+//
+SnapshotRowSink::SnapshotRowSink(
+    vector<shared_ptr<const ResultSnapshot>>& snapshots,
+    bool allResultSets) :
+    FileRowSink(-1),
+    m_snapshots(snapshots),
+    m_allResultSets(allResultSets)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: SnapshotRowSink Destructor
+//
+// Description:
+//    Closes the memory file of a result set whose snapshot was never
+//    taken, e.g. because the query failed.
+//
+SnapshotRowSink::~SnapshotRowSink()
+{
+    if (m_fd != -1)
+    {
+        close(m_fd);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: SnapshotRowSink::NextResultSet
+//
+// Description:
+//    Takes the snapshot of the result set just written and starts the
+//    next one, if the sink takes all the result sets.
+//
+// Returns:
+//    true if the rows of the next result set are taken.
+//
+bool
+SnapshotRowSink::NextResultSet()
+{
+    if (!m_allResultSets)
+    {
+        return false;
+    }
+
+    if (Flush() == 0)
+    {
+        TakeSnapshot();
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: SnapshotRowSink::Finish
+//
+// Description:
+//    Takes the snapshot of the last result set. The output has already
+//    been flushed by ExecuteQuery.
+//
+// Returns:
+//    VOID
+//
+void
+SnapshotRowSink::Finish()
+{
+    TakeSnapshot();
+}
+
+// ---------------------------------------------------------------------------
+// Method: SnapshotRowSink::TakeSnapshot
+//
+// Description:
+//    Turns the output written so far into a snapshot - of the memory file
+//    if one was made, else of the content collected in memory.
+//
+// Returns:
+//    VOID
+//
+void
+SnapshotRowSink::TakeSnapshot()
+{
+    if (m_fd != -1)
+    {
+        m_snapshots.push_back(make_shared<const ResultSnapshot>(m_fd, (size_t)m_offset));
+        m_fd = -1;
+        m_offset = 0;
+    }
+    else
+    {
+        m_snapshots.push_back(make_shared<const ResultSnapshot>(std::move(m_content)));
+        m_content.clear();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: SnapshotRowSink::WriteOut
+//
+// Description:
+//    Collects the data in memory until there is enough of it for a memory
+//    file. Then the memory file is made and all the data is written to it.
+//    If it can't be made the output stays in memory, and making it isn't
+//    tried again for every write after that.
+//
+// Returns:
+//    0 on success and -errno on error.
+//
+int
+SnapshotRowSink::WriteOut(
+    const char* data,
+    size_t length)
+{
+    int error;
+
+    if (m_fd != -1)
+    {
+        return FileRowSink::WriteOut(data, length);
+    }
+
+    m_content.append(data, length);
+    if (m_content.size() < SNAPSHOT_FILE_MIN_SIZE ||
+        m_content.size() - length >= SNAPSHOT_FILE_MIN_SIZE)
+    {
+        return 0;
+    }
+
+    m_fd = CreateSnapshotFile();
+    if (m_fd == -1)
+    {
+        return 0;
+    }
+
+    error = FileRowSink::WriteOut(m_content.data(), m_content.size());
+    string().swap(m_content);
+
+    return error;
+}
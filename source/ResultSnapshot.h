@@ -0,0 +1,167 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ResultSnapshot.h
+//
+// Purpose:
+//   This file contains the declarations of the in-memory snapshots of
+//   query results that open dbfs files are read from.
+//
+#pragma once
+
+// Snapshots at least this large are kept in a memory file so that reads
+// can be spliced from it. Smaller ones fit a single FUSE read anyway.
+//
+#define SNAPSHOT_FILE_MIN_SIZE      (64 * 1024)
+
+//--------------------------------------------------------------------
+// Class: ResultSnapshot
+//
+// Description:
+//  The complete output of a query, taken once and never changed again.
+//  Open handles and the result cache share a snapshot through a
+//  shared_ptr, so it stays valid for as long as any of them uses it and
+//  can be read by any number of threads without locking.
+//
+// Dev notes:
+//  Large contents are kept in a sealed memfd which is mapped for direct
+//  access. Its descriptor lets the FUSE backends hand reads to the kernel
+//  as a file to splice from, so the content reaches the reader without
+//  being copied in user space. If the memory file can't be made (old
+//  kernel, out of descriptors) the content simply stays in m_content.
+//
+class ResultSnapshot
+{
+public:
+    // Constructor - takes over the content.
+    //
+    explicit ResultSnapshot(
+        string&& content);
+
+    // Constructor - takes over the memory file holding size bytes of
+    // content and seals it.
+    //
+    ResultSnapshot(
+        int fd,
+        size_t size);
+
+    // Destructor - unmaps and closes the memory file.
+    //
+    ~ResultSnapshot();
+
+    ResultSnapshot(const ResultSnapshot&) = delete;
+    ResultSnapshot& operator=(const ResultSnapshot&) = delete;
+
+    // Copies up to size bytes starting at offset into the buffer.
+    // Returns the number of bytes copied, 0 at or beyond the end.
+    //
+    size_t Read(
+        char* buffer,
+        size_t size,
+        off_t offset) const;
+
+    // Returns the size of the content.
+    //
+    size_t GetSize() const
+    {
+        return m_size;
+    }
+
+    // Returns the content.
+    //
+    const char* GetData() const
+    {
+        return m_data;
+    }
+
+    // Returns the descriptor of the memory file holding the content, -1 if
+    // the content is only in memory.
+    //
+    int GetDescriptor() const
+    {
+        return m_fd;
+    }
+
+    // Returns true if the other snapshot has the same content.
+    //
+    bool HasSameContent(
+        const ResultSnapshot& other) const;
+
+private:
+    // Seals and maps the memory file holding the content.
+    //
+    bool MapFile(
+        int fd);
+
+    string          m_content;      // Empty if the content is in the memory file.
+    int             m_fd;
+    const char*     m_data;
+    size_t          m_size;
+};
+
+//--------------------------------------------------------------------
+// Class: SnapshotRowSink
+//
+// Description:
+//  Takes a snapshot of the output of each result set of a query, or only
+//  of the first one. The output of a result set is collected in memory
+//  until it reaches SNAPSHOT_FILE_MIN_SIZE, and from then on is written
+//  straight into the memory file of the snapshot, so a large result is
+//  never held twice.
+//
+class SnapshotRowSink : public FileRowSink
+{
+public:
+    SnapshotRowSink(
+        vector<shared_ptr<const ResultSnapshot>>& snapshots,
+        bool allResultSets);
+
+    // Destructor - closes the memory file of an unfinished snapshot.
+    //
+    ~SnapshotRowSink();
+
+    bool NextResultSet() override;
+
+    // Takes the snapshot of the last result set. Called once the query
+    // is done.
+    //
+    void Finish();
+
+protected:
+    int WriteOut(
+        const char* data,
+        size_t length) override;
+
+private:
+    // Takes the snapshot of the output written so far and starts over.
+    //
+    void TakeSnapshot();
+
+    vector<shared_ptr<const ResultSnapshot>>&   m_snapshots;
+    bool                                        m_allResultSets;
+    string                                      m_content;  // Until the memory file is made.
+};
+
+// This method runs the query and takes a snapshot of its output.
+//
+int
+TakeResultSnapshot(
+    const string& query,
+    const string& hostname,
+    const string& username,
+    const string& password,
+    const FileFormat type,
+    shared_ptr<const ResultSnapshot>& snapshot);
+
+// This method runs the query and takes a snapshot of the output of each of
+// its result sets.
+//
+int
+TakeResultSnapshots(
+    const string& query,
+    const string& hostname,
+    const string& username,
+    const string& password,
+    const FileFormat type,
+    vector<shared_ptr<const ResultSnapshot>>& snapshots);
@@ -0,0 +1,240 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ResultStream.cpp
+//
+// Purpose:
+//   This file contains the definitions of the streams that the output of
+//   a query still running is read from as it arrives.
+//
+#include "UtilsPrivate.h"
+
+// ---------------------------------------------------------------------------
+// Method: ResultStream Constructor
+//
+// Description:
+//    Creates a stream without any output yet.
+//
+// Returns:
+//    none
+//
+ResultStream::ResultStream() :
+    m_wakeAt(SIZE_MAX),
+    m_finished(false),
+    m_error(0)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: Append
+//
+// Description:
+//    This method appends output of the query and wakes up the readers if
+//    the first of them has got what it is waiting for.
+//
+// Returns:
+//    VOID
+//
+void
+ResultStream::Append(
+    const char* data,
+    size_t length)
+{
+    lock_guard<mutex> lock(m_lock);
+
+    m_content.append(data, length);
+
+    if (m_content.size() >= m_wakeAt)
+    {
+        m_wakeAt = SIZE_MAX;
+        m_changed.notify_all();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: Finish
+//
+// Description:
+//    This method marks the end of the output. The output of a query which
+//    succeeded is moved into a snapshot, which the readers are served
+//    from from then on.
+//
+// Returns:
+//    VOID
+//
+void
+ResultStream::Finish(
+    int error)
+{
+    lock_guard<mutex> lock(m_lock);
+
+    if (!error)
+    {
+        m_snapshot = make_shared<const ResultSnapshot>(std::move(m_content));
+
+        // A large output is copied into the memory file of the snapshot,
+        // so the buffer may still be here - give it back.
+        //
+        string().swap(m_content);
+    }
+
+    m_error = error;
+    m_finished = true;
+    m_changed.notify_all();
+}
+
+// ---------------------------------------------------------------------------
+// Method: Read
+//
+// Description:
+//    This method copies as much of the range of the output as has arrived
+//    into the buffer. If none of it has it waits for the query to write
+//    more or to finish. Returning a short read right away means a reader
+//    gets the first rows as soon as the server sends them - the handles
+//    of streams are opened with direct_io, so the kernel passes short
+//    reads on as they are.
+//
+// Returns:
+//    The number of bytes copied, 0 at or beyond the end of the output,
+//    and -errno at the end of the output of a query which failed.
+//
+ssize_t
+ResultStream::Read(
+    char* buffer,
+    size_t size,
+    off_t offset)
+{
+    shared_ptr<const ResultSnapshot> snapshot;
+
+    if (offset < 0 || size == 0)
+    {
+        return 0;
+    }
+
+    unique_lock<mutex> lock(m_lock);
+
+    while (!m_finished && m_content.size() <= (size_t)offset)
+    {
+        m_wakeAt = min(m_wakeAt, (size_t)offset + 1);
+        m_changed.wait(lock);
+    }
+
+    if (m_snapshot)
+    {
+        snapshot = m_snapshot;
+        lock.unlock();
+
+        return snapshot->Read(buffer, size, offset);
+    }
+
+    if ((size_t)offset >= m_content.size())
+    {
+        return m_error;
+    }
+
+    size = min(size, m_content.size() - (size_t)offset);
+    memcpy(buffer, m_content.data() + offset, size);
+
+    return size;
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetSnapshot
+//
+// Description:
+//    This method returns the snapshot of the output of the query.
+//
+// Returns:
+//    The snapshot or NULL if the query is still running or failed.
+//
+shared_ptr<const ResultSnapshot>
+ResultStream::GetSnapshot() const
+{
+    lock_guard<mutex> lock(m_lock);
+
+    return m_snapshot;
+}
+
+// ---------------------------------------------------------------------------
+// Method: StreamRowSink Constructor
+//
+// Description:
+//    The stream and the outputs of the other result sets are owned by the
+//    caller.
+//
+// Returns:
+//    none
+//
+StreamRowSink::StreamRowSink(
+    ResultStream& stream,
+    vector<string>& otherOutputs) :
+    m_stream(stream),
+    m_otherOutputs(otherOutputs)
+{
+    m_otherOutputs.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Method: StreamRowSink::NextResultSet
+//
+// Description:
+//    Starts the output of another result set. Only the first one goes to
+//    the stream.
+//
+// Returns:
+//    true
+//
+bool
+StreamRowSink::NextResultSet()
+{
+    Flush();
+    m_otherOutputs.emplace_back();
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: StreamRowSink::EndRow
+//
+// Description:
+//    Passes the row just written on to the stream, so that it can be read
+//    right away. The stream is locked once per row rather than for every
+//    value.
+//
+// Returns:
+//    VOID
+//
+void
+StreamRowSink::EndRow()
+{
+    if (m_otherOutputs.empty())
+    {
+        Flush();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: StreamRowSink::WriteOut
+//
+// Description:
+//    Appends the data to the stream, or to the output of the current
+//    result set after the first.
+//
+// Returns:
+//    0
+//
+int
+StreamRowSink::WriteOut(
+    const char* data,
+    size_t length)
+{
+    if (m_otherOutputs.empty())
+    {
+        m_stream.Append(data, length);
+    }
+    else
+    {
+        m_otherOutputs.back().append(data, length);
+    }
+    return 0;
+}
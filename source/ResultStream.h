@@ -0,0 +1,104 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: ResultStream.h
+//
+// Purpose:
+//   This file contains the declarations of the streams that the output of
+//   a query still running is read from as it arrives.
+//
+#pragma once
+
+//--------------------------------------------------------------------
+// Class: ResultStream
+//
+// Description:
+//  The output of a query while it is being fetched. The query appends to
+//  it and any number of open handles read from it at the same time; a
+//  read waits only until some output past its offset has arrived. Once
+//  the query is done the output becomes a ResultSnapshot and the readers
+//  are served from that.
+//
+// Dev notes:
+//  Readers waiting for more output record the size the output must
+//  reach in m_wakeAt, so the query doesn't wake them up when nobody is
+//  waiting.
+//
+class ResultStream
+{
+public:
+    // Constructor
+    //
+    ResultStream();
+
+    ResultStream(const ResultStream&) = delete;
+    ResultStream& operator=(const ResultStream&) = delete;
+
+    // Appends output of the query.
+    //
+    void Append(
+        const char* data,
+        size_t length);
+
+    // Marks the end of the output, 0 if the query succeeded and -errno
+    // otherwise. Wakes up all the readers.
+    //
+    void Finish(
+        int error);
+
+    // Copies up to size bytes starting at offset into the buffer, waiting
+    // until there is output past the offset or the query is done. Returns
+    // the number of bytes copied - possibly fewer than there will be - 0
+    // at or beyond the end of the output and -errno at the end of the
+    // output of a query which failed.
+    //
+    ssize_t Read(
+        char* buffer,
+        size_t size,
+        off_t offset);
+
+    // Returns the snapshot of the output once the query succeeded, NULL
+    // before that or if it failed.
+    //
+    shared_ptr<const ResultSnapshot> GetSnapshot() const;
+
+private:
+    mutable mutex                       m_lock;     // Guards the members below.
+    condition_variable                  m_changed;
+    string                              m_content;  // Moved to m_snapshot at the end.
+    shared_ptr<const ResultSnapshot>    m_snapshot;
+    size_t                              m_wakeAt;
+    bool                                m_finished;
+    int                                 m_error;
+};
+
+//--------------------------------------------------------------------
+// Class: StreamRowSink
+//
+// Description:
+//  Appends the output of the first result set of the query to a stream
+//  and collects the output of the others like ResultSetRowSink. The
+//  output is buffered and passed on a row at a time, so that every row
+//  can be read as soon as it has arrived.
+//
+class StreamRowSink : public RowSink
+{
+public:
+    StreamRowSink(
+        ResultStream& stream,
+        vector<string>& otherOutputs);
+
+    bool NextResultSet() override;
+
+    void EndRow() override;
+
+protected:
+    int WriteOut(
+        const char* data,
+        size_t length) override;
+
+private:
+    ResultStream&   m_stream;
+    vector<string>& m_otherOutputs;
+};
@@ -0,0 +1,321 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: RowSink.cpp
+//
+// Purpose:
+//   This file contains the definitions of the sinks that query results
+//   are written into while the rows are being fetched from the server.
+//
+#include "UtilsPrivate.h"
+
+// ---------------------------------------------------------------------------
+// Method: RowSink Constructor
+//
+// Description:
+//    Allocates the staging buffer. A buffer size of 0 makes every write
+//    go straight to the target.
+//
+// Returns:
+//    none
+//
+RowSink::RowSink(
+    size_t bufferSize) :
+    m_buffer(bufferSize ? new char[bufferSize] : nullptr),
+    m_bufferSize(bufferSize),
+    m_used(0),
+    m_bytesFlushed(0),
+    m_error(0)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: RowSink Destructor
+//
+// Description:
+//    Nothing to do - derived classes are expected to have been flushed
+//    by the owner, which is the one that can act on an error.
+//
+RowSink::~RowSink()
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: Write
+//
+// Description:
+//    Appends data to the sink. Small pieces are collected in the buffer.
+//    A piece that does not fit causes the buffer to be flushed and, if it
+//    is at least as large as the buffer, it is passed on directly without
+//    being copied.
+//
+// Returns:
+//    0 on success and -errno on error.
+//
+int
+RowSink::Write(
+    const char* data,
+    size_t length)
+{
+    if (m_error)
+    {
+        return m_error;
+    }
+
+    if (m_used + length <= m_bufferSize)
+    {
+        memcpy(m_buffer.get() + m_used, data, length);
+        m_used += length;
+    }
+    else if (Flush() == 0)
+    {
+        if (length < m_bufferSize)
+        {
+            memcpy(m_buffer.get(), data, length);
+            m_used = length;
+        }
+        else
+        {
+            m_error = WriteOut(data, length);
+            if (!m_error)
+            {
+                m_bytesFlushed += length;
+            }
+        }
+    }
+
+    return m_error;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Flush
+//
+// Description:
+//    Passes the buffered data on to the target.
+//
+// Returns:
+//    0 on success and -errno on error.
+//
+int
+RowSink::Flush()
+{
+    if (!m_error && m_used)
+    {
+        m_error = WriteOut(m_buffer.get(), m_used);
+        if (!m_error)
+        {
+            m_bytesFlushed += m_used;
+        }
+        m_used = 0;
+    }
+
+    return m_error;
+}
+
+// ---------------------------------------------------------------------------
+// Method: FileRowSink Constructor
+//
+// Description:
+//    The file descriptor is owned by the caller.
+//
+// Returns:
+//    none
+//
+FileRowSink::FileRowSink(
+    int fd,
+    off_t offset) :
+    m_fd(fd),
+    m_offset(offset)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: FileRowSink::WriteOut
+//
+// Description:
+//    Writes the data at the current offset of the sink.
+//
+// Returns:
+//    0 on success and -errno on error.
+//
+int
+FileRowSink::WriteOut(
+    const char* data,
+    size_t length)
+{
+    ssize_t written;
+
+    while (length)
+    {
+        written = pwrite(m_fd, data, length, m_offset);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return ReturnErrnoAndPrintError(__FUNCTION__, "pwrite failed");
+        }
+
+        data += written;
+        length -= written;
+        m_offset += written;
+    }
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: MemoryRowSink Constructor
+//
+// Description:
+//    The output string is owned by the caller and is appended to.
+//
+// Returns:
+//    none
+//
+MemoryRowSink::MemoryRowSink(
+    string& output) :
+    RowSink(0),
+    m_output(output)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: MemoryRowSink::WriteOut
+//
+// Description:
+//    Appends the data to the output string.
+//
+// Returns:
+//    0
+//
+int
+MemoryRowSink::WriteOut(
+    const char* data,
+    size_t length)
+{
+    m_output.append(data, length);
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ResultSetRowSink Constructor
+//
+// Description:
+//    Starts the output of the first result set.
+//
+// Returns:
+//    none
+//
+ResultSetRowSink::ResultSetRowSink(
+    vector<string>& outputs) :
+    RowSink(0),
+    m_outputs(outputs)
+{
+    m_outputs.assign(1, string());
+}
+
+// ---------------------------------------------------------------------------
+// Method: ResultSetRowSink::NextResultSet
+//
+// Description:
+//    Starts the output of another result set.
+//
+// Returns:
+//    true
+//
+bool
+ResultSetRowSink::NextResultSet()
+{
+    m_outputs.emplace_back();
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ResultSetRowSink::WriteOut
+//
+// Description:
+//    Appends the data to the output of the current result set.
+//
+// Returns:
+//    0
+//
+int
+ResultSetRowSink::WriteOut(
+    const char* data,
+    size_t length)
+{
+    m_outputs.back().append(data, length);
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: PipeRowSink Constructor
+//
+// Description:
+//    The file descriptor is owned by the caller.
+//
+// Returns:
+//    none
+//
+PipeRowSink::PipeRowSink(
+    int fd) :
+    m_fd(fd)
+{
+}
+
+// ---------------------------------------------------------------------------
+// Method: PipeRowSink::EndRow
+//
+// Description:
+//    Passes the row just written on to the reader.
+//
+// Returns:
+//    VOID
+//
+void
+PipeRowSink::EndRow()
+{
+    Flush();
+}
+
+// ---------------------------------------------------------------------------
+// Method: PipeRowSink::WriteOut
+//
+// Description:
+//    Writes the data to the pipe. A pipe accepts at most its capacity
+//    in one write so this loops until everything is written.
+//
+// Returns:
+//    0 on success and -errno on error.
+//
+int
+PipeRowSink::WriteOut(
+    const char* data,
+    size_t length)
+{
+    ssize_t written;
+
+    while (length)
+    {
+        written = write(m_fd, data, length);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return ReturnErrnoAndPrintError(__FUNCTION__, "write failed");
+        }
+
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
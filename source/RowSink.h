@@ -0,0 +1,202 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: RowSink.h
+//
+// Purpose:
+//   This file contains the declarations of the sinks that query results
+//   are written into while the rows are being fetched from the server.
+//
+#pragma once
+
+// Number of bytes a sink collects before handing them to its target.
+//
+#define SQLFS_ROW_SINK_BUFFER_SIZE      (64 * 1024)
+
+//--------------------------------------------------------------------
+// Class: RowSink
+//
+// Description:
+//  Base class of the destinations of query output. Row data is appended
+//  piece by piece as it is read from the server. The sink keeps a fixed
+//  size buffer and passes it on to WriteOut() whenever it fills up, so
+//  memory use does not depend on the size of the result.
+//
+// Dev notes:
+//  The first error returned by WriteOut() sticks. All the later writes
+//  are dropped and GetError() / Flush() report it.
+//
+class RowSink
+{
+public:
+    // Constructor
+    //
+    RowSink(
+        size_t bufferSize = SQLFS_ROW_SINK_BUFFER_SIZE);
+
+    // Destructor
+    //
+    virtual ~RowSink();
+
+    // Appends data to the sink.
+    //
+    int Write(
+        const char* data,
+        size_t length);
+
+    // Appends a single character (separator) to the sink.
+    //
+    int Write(
+        char c)
+    {
+        if (m_used < m_bufferSize)
+        {
+            m_buffer[m_used++] = c;
+            return 0;
+        }
+        return Write(&c, 1);
+    }
+
+    // Passes everything buffered on to the target.
+    //
+    int Flush();
+
+    // Called before the rows of another result set of the query are
+    // written. Returns false if the sink only takes the first result set,
+    // the others are then discarded.
+    //
+    virtual bool NextResultSet()
+    {
+        return false;
+    }
+
+    // Called after each row has been written, and after the column names.
+    // Sinks whose output is read while the query runs pass it on here.
+    //
+    virtual void EndRow()
+    {
+    }
+
+    // Returns the first error hit or 0.
+    //
+    int GetError() const
+    {
+        return m_error;
+    }
+
+    // Returns the number of bytes written to the sink so far.
+    //
+    size_t GetBytesWritten() const
+    {
+        return m_bytesFlushed + m_used;
+    }
+
+protected:
+    // Hands data to the target. Returns 0 on success and -errno on error.
+    //
+    virtual int WriteOut(
+        const char* data,
+        size_t length) = 0;
+
+private:
+    unique_ptr<char[]>  m_buffer;
+    size_t              m_bufferSize;
+    size_t              m_used;
+    size_t              m_bytesFlushed;
+    int                 m_error;
+};
+
+//--------------------------------------------------------------------
+// Class: FileRowSink
+//
+// Description:
+//  Writes the output to a regular file starting at the given offset.
+//
+class FileRowSink : public RowSink
+{
+public:
+    FileRowSink(
+        int fd,
+        off_t offset = 0);
+
+protected:
+    int WriteOut(
+        const char* data,
+        size_t length) override;
+
+    int     m_fd;
+    off_t   m_offset;
+};
+
+//--------------------------------------------------------------------
+// Class: MemoryRowSink
+//
+// Description:
+//  Appends the output to a string owned by the caller. There is no
+//  point staging the data in a second buffer, so this sink is unbuffered.
+//
+class MemoryRowSink : public RowSink
+{
+public:
+    MemoryRowSink(
+        string& output);
+
+protected:
+    int WriteOut(
+        const char* data,
+        size_t length) override;
+
+private:
+    string& m_output;
+};
+
+//--------------------------------------------------------------------
+// Class: ResultSetRowSink
+//
+// Description:
+//  Appends the output of every result set of the query to a string of
+//  its own. Unbuffered like MemoryRowSink.
+//
+class ResultSetRowSink : public RowSink
+{
+public:
+    ResultSetRowSink(
+        vector<string>& outputs);
+
+    bool NextResultSet() override;
+
+protected:
+    int WriteOut(
+        const char* data,
+        size_t length) override;
+
+private:
+    vector<string>& m_outputs;
+};
+
+//--------------------------------------------------------------------
+// Class: PipeRowSink
+//
+// Description:
+//  Writes the output to a pipe or socket. Every row is passed on as soon
+//  as it has been written, so the reader gets the first rows while the
+//  query is still running. Short writes are retried until all the data
+//  has been accepted by the reader.
+//
+class PipeRowSink : public RowSink
+{
+public:
+    PipeRowSink(
+        int fd);
+
+    void EndRow() override;
+
+protected:
+    int WriteOut(
+        const char* data,
+        size_t length) override;
+
+private:
+    int m_fd;
+};
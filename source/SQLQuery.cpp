@@ -10,188 +10,284 @@
 //
 #include "UtilsPrivate.h"
 
+// Error context used for errors that are reported before a connection
+// has its own context attached (e.g. a failed login).
+//
+static thread_local DBErrorContext s_UnattachedErrorContext;
+
+// Guards the one time initialization of DB-Library.
+//
+static std::once_flag s_DBLibraryInitFlag;
+static bool s_DBLibraryInitialized = false;
+
 // ---------------------------------------------------------------------------
-// Method: DBErrorHandler
+// Method: GetDBErrorContext
 //
 // Description:
-//    This method is invoked whenever DB-Library determines that an 
-//    error has occurred.
+//    This method returns the error context of the given connection. For
+//    connections without an attached context (or no connection at all)
+//    the context of the calling thread is returned.
 //
 // Returns:
-//    int
+//    Pointer to the error context.
 //
-int DBErrorHandler(
-    DBPROCESS* dbproc,
-    int severity,
-    int dberr,
-    int oserr,
-    char* dberrstr,
-    char* oserrstr)
+DBErrorContext*
+GetDBErrorContext(
+    DBPROCESS* dbproc)
 {
-    if ((dbproc == NULL) || (DBDEAD(dbproc)))
+    DBErrorContext* context = NULL;
+
+    if (dbproc)
     {
-        fprintf(stderr, "DB process structure failed to initialize.\n");
-        return(INT_CANCEL);
+        context = (DBErrorContext*)dbgetuserdata(dbproc);
     }
-    else
-    {
-        fprintf(stderr, "DB-Library error:\n\t%s\n", dberrstr);
 
-        if (oserr != DBNOERR)
-        {
-            fprintf(stderr, "Operating-system \error:\n\t%s\n", oserrstr);
-        }
+    return context ? context : &s_UnattachedErrorContext;
+}
 
-        return(INT_CANCEL);
-    }
+// ---------------------------------------------------------------------------
+// Method: ResetDBErrorContext
+//
+// Description:
+//    This method clears the error recorded for the given connection.
+//
+// Returns:
+//    none.
+//
+void
+ResetDBErrorContext(
+    DBPROCESS* dbproc)
+{
+    DBErrorContext* context = GetDBErrorContext(dbproc);
+
+    context->m_dbErr = 0;
+    context->m_msgNo = 0;
+    context->m_severity = 0;
+    context->m_message.clear();
 }
 
 // ---------------------------------------------------------------------------
-// Method: InstallDBHandlers
+// Method: AttachDBErrorContext
 //
 // Description:
-//    This method installs the error and message handlers.
+//    This method gives a newly opened connection its own error context.
 //
 // Returns:
 //    none.
 //
-void InstallDBHandlers()
+void
+AttachDBErrorContext(
+    DBPROCESS* dbproc)
 {
-    dberrhandle(DBErrorHandler);
+    dbsetuserdata(dbproc, (BYTE*)new DBErrorContext());
 }
 
 // ---------------------------------------------------------------------------
-// Method: UninstallDBHandlers
+// Method: DetachDBErrorContext
 //
 // Description:
-//    This method uninstalls the error and message handlers.
+//    This method frees the error context of a connection that is about
+//    to be closed.
 //
 // Returns:
 //    none.
 //
-void UninstallDBHandlers()
+void
+DetachDBErrorContext(
+    DBPROCESS* dbproc)
 {
-    dberrhandle(NULL);
+    DBErrorContext* context = (DBErrorContext*)dbgetuserdata(dbproc);
+
+    dbsetuserdata(dbproc, NULL);
+    delete context;
 }
 
 // ---------------------------------------------------------------------------
-// Method: CreateConnectionAndRunQuery
+// Method: DBErrorHandler
 //
 // Description:
-//    This method opens up a DB connection to the provided server
-//    and executes the query given.
+//    This method is invoked whenever DB-Library determines that an 
+//    error has occurred. The error is recorded in the error context
+//    of the connection it happened on so that the thread running the
+//    query can report it.
 //
 // Returns:
-//    Query repsonse connection pointer (DBPROCESS *) on success
-//    NULL on error.
+//    int
 //
-static RETCODE
-CreateConnectionAndRunQuery(
-    const string& query,
-    const string& dbServer,
-    const string& username,
-    const string& password,
-    DBPROCESS*& dbConn)
+static int
+DBErrorHandler(
+    DBPROCESS* dbproc,
+    int severity,
+    int dberr,
+    int oserr,
+    char* dberrstr,
+    char* oserrstr)
 {
-    LOGINREC*   login;
-    RETCODE     status = SUCCEED;
-    char        hostname[MAXHOSTNAMELEN];
-    int         maxLen = MAXHOSTNAMELEN;
-    dbConn = NULL;
+    DBErrorContext* context = GetDBErrorContext(dbproc);
 
-    // Init the DB library.
-    //
-    if (dbinit() == FAIL)
+    context->m_dbErr = dberr;
+    context->m_severity = severity;
+    context->m_message = dberrstr ? dberrstr : "";
+
+    if (oserr != DBNOERR && oserrstr)
     {
-        PrintMsg("Could not init db.\n");
-        status = FAIL;
+        context->m_message += StringFormat(" (Operating-system error: %s)", oserrstr);
     }
 
-    // Install error-handler and message-handlers.
-    //
-    InstallDBHandlers();
+    PrintMsg("DB-Library error %d: %s\n", dberr, context->m_message.c_str());
 
-    // Set the login timeout.
-    //
-    if (status == SUCCEED)
-    {
-        status = dbsetlogintime(SQLFS_MAX_LOGIN_TIMEOUT_SEC);
-        if (status == FAIL)
-        {
-            PrintMsg("Could not set the login timeout.\n");
-        }
-    }
+    return(INT_CANCEL);
+}
 
-    // Allocate a login params structure.
-    //
-    if (status == SUCCEED)
+// ---------------------------------------------------------------------------
+// Method: DBMessageHandler
+//
+// Description:
+//    This method is invoked whenever the server sends a message. Only the
+//    messages which indicate an error are recorded in the error context
+//    of the connection - the rest are informational (e.g. changed database
+//    context).
+//
+// Returns:
+//    0
+//
+static int
+DBMessageHandler(
+    DBPROCESS* dbproc,
+    DBINT msgno,
+    int msgstate,
+    int severity,
+    char* msgtext,
+    char* srvname,
+    char* procname,
+    int line)
+{
+    DBErrorContext* context;
+
+    (void)msgstate;
+    (void)srvname;
+    (void)procname;
+    (void)line;
+
+    if (severity > 10)
     {
-        login = dblogin();
-        if (!login)
-        {
-            PrintMsg("Could not initialize dblogin() structure.\n");
-            status = FAIL;
-        }
+        context = GetDBErrorContext(dbproc);
+        context->m_msgNo = msgno;
+        context->m_severity = severity;
+        context->m_message = msgtext ? msgtext : "";
+
+        PrintMsg("SQL Server message %d: %s\n", msgno, context->m_message.c_str());
     }
 
-    // Initialize the login params in the structure.
-    //
-    if (status == SUCCEED)
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: InitializeDBLibraryOnce
+//
+// Description:
+//    This method initializes DB-Library, installs the error and message
+//    handlers and sets the timeouts. All of these are process wide.
+//
+// Returns:
+//    none.
+//
+static void
+InitializeDBLibraryOnce()
+{
+    if (dbinit() == FAIL)
     {
-        DBSETLUSER(login, username.c_str());
-        DBSETLPWD(login, password.c_str());
-        DBSETLAPP(login, progName);
-        if (gethostname(hostname, maxLen) == 0)
-        {
-            DBSETLHOST(login, hostname);
-        }
+        PrintMsg("Could not init db.\n");
+        return;
+    }
 
-        dbConn = dbopen(login, dbServer.c_str());
-        if (!dbConn)
-        {
-            PrintMsg("Could not connect to DB Server: %s\n", dbServer.c_str());
-            status = FAIL;
-        }
+    dberrhandle(DBErrorHandler);
+    dbmsghandle(DBMessageHandler);
 
-        // login structure no longer needed after logging in.
-        //
-        dbloginfree(login);
+    if (dbsetlogintime(SQLFS_MAX_LOGIN_TIMEOUT_SEC) == FAIL)
+    {
+        PrintMsg("Could not set the login timeout.\n");
     }
-    
-    if (status == SUCCEED)
+
+    if (dbsettime(SQLFS_MAX_RESPONSE_WAIT_SEC) == FAIL)
     {
-        status = dbuse(dbConn, dbName);
-        if (status == FAIL)
-        {
-            PrintMsg("Could not switch to database %s on DB Server %s\n",
-                dbName, dbServer.c_str());
-        }
+        PrintMsg("Could not set the timeout for sql server response\n");
     }
 
-    // Set the timeout to get response for SQL command.
-    //
-    if (status == SUCCEED)
+    s_DBLibraryInitialized = true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: InitializeDBLibrary
+//
+// Description:
+//    This method initializes DB-Library for the whole process. It is called
+//    once at startup before any server is contacted. Calling it again is
+//    harmless.
+//
+// Returns:
+//    true on success.
+//
+bool
+InitializeDBLibrary()
+{
+    std::call_once(s_DBLibraryInitFlag, InitializeDBLibraryOnce);
+
+    return s_DBLibraryInitialized;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ShutdownDBLibrary
+//
+// Description:
+//    This method uninstalls the handlers and releases DB-Library. All the
+//    connections must have been closed before this is called.
+//
+// Returns:
+//    none.
+//
+void
+ShutdownDBLibrary()
+{
+    if (s_DBLibraryInitialized)
     {
-        status = dbsettime(SQLFS_MAX_RESPONSE_WAIT_SEC);
-        if (status == FAIL)
-        {
-            PrintMsg("Could not set the timeout for sql server response\n");
-        }
+        dberrhandle(NULL);
+        dbmsghandle(NULL);
+        dbexit();
+        s_DBLibraryInitialized = false;
     }
+}
+
+// ---------------------------------------------------------------------------
+// Method: RunQuery
+//
+// Description:
+//    This method executes the query given on an already open connection
+//    and moves to the first result set.
+//
+// Returns:
+//    SUCCEED on success and FAIL on error.
+//
+static RETCODE
+RunQuery(
+    DBPROCESS* dbConn,
+    const string& query)
+{
+    RETCODE status;
+
+    ResetDBErrorContext(dbConn);
 
     // Now prepare a SQL statement.
     //
-    if (status == SUCCEED)
-    {
-        dbcmd(dbConn, query.c_str());
+    dbcmd(dbConn, query.c_str());
 
-        // Now execute the SQL statement.
-        //
-        status = dbsqlexec(dbConn);
-        if (status == FAIL)
-        {
-            PrintMsg("Could not execute the sql statement\n");
-        }
+    // Now execute the SQL statement.
+    //
+    status = dbsqlexec(dbConn);
+    if (status == FAIL)
+    {
+        PrintMsg("Could not execute the sql statement: %s\n",
+                 GetDBErrorContext(dbConn)->m_message.c_str());
     }
 
     if (status == SUCCEED)
@@ -203,55 +299,53 @@ CreateConnectionAndRunQuery(
 }
 
 // ---------------------------------------------------------------------------
-// Method: BindStringVector
+// Method: AcquireConnectionAndRunQuery
 //
 // Description:
-//    This method resizes the vector to hold the required number of
-//    entries (equal to number of columns). Also resizes each string
-//    taking into account the maximum size of entry in the column.
+//    This method borrows a connection to the provided server from its pool
+//    and executes the query given. A pooled connection can turn out to be
+//    dead only when it is used (e.g. the server restarted) - in that case
+//    it is thrown away and the query is retried once on a new connection.
 //
 // Returns:
-//    VOID
+//    SUCCEED on success and FAIL on error. On success dbConn holds the
+//    connection with the results and needs to be given back to pool.
 //
-static void
-    BindStringVector(
-    DBPROCESS* dbConn,
-    int numColumns,
-    vector<string>& stringVector)
+static RETCODE
+AcquireConnectionAndRunQuery(
+    const string& query,
+    SQLConnectionPool* pool,
+    DBPROCESS*& dbConn)
 {
-    int     maxColumnEntryLen;
-    int     columnLen;
-    char*   stringPtr;
+    RETCODE     status = FAIL;
+    int         attempt;
 
-    // Extend vector to hold appropriate number of strings.
-    //
-    stringVector.resize(numColumns);
-
-    for (int i = 0; i < numColumns; i++)
+    for (attempt = 0; attempt < 2 && status == FAIL; attempt++)
     {
-        maxColumnEntryLen = MAX_COLUMN_ENTRY_LEN;
-        columnLen = 0;
-
-        // Calculate column entry length.
-        //
-        if ((columnLen = dbcollen(dbConn, i + 1)) > maxColumnEntryLen)
+        dbConn = pool->Acquire();
+        if (!dbConn)
         {
-            maxColumnEntryLen = columnLen;
+            break;
         }
 
-        // Resize string.
-        //
-        stringVector[i].resize(maxColumnEntryLen);
+        status = RunQuery(dbConn, query);
+        if (status == FAIL)
+        {
+            bool dead = DBDEAD(dbConn);
 
-        // Now bind the returned columns to the variables
-        // Column numbers start from 1
-        // The fourth argument is to specify the maximum size(bytes)
-        // that can be copied into the buffer. This avoids memory corruption.
-        //
-        stringPtr = (char*)stringVector[i].c_str();
-        dbbind(dbConn, i + 1, NTBSTRINGBIND, maxColumnEntryLen,
-            (BYTE*)stringPtr);
+            pool->Release(dbConn, true);
+            dbConn = NULL;
+
+            // Only a broken connection is worth another try.
+            //
+            if (!dead)
+            {
+                break;
+            }
+        }
     }
+
+    return status;
 }
 
 // ---------------------------------------------------------------------------
@@ -259,7 +353,7 @@ static void
 //
 // Description:
 //    This methods copies the names of columns (tab seperated) into the 
-//    given string. 
+//    given sink. 
 //
 // Returns:
 //    VOID
@@ -268,8 +362,9 @@ static void
     CopyColumnNames(
     DBPROCESS* dbConn,
     int numColumns,
-    ostringstream& stream)
+    RowSink& sink)
 {
+    const char* name;
 
     // Copy name of columns.
     //
@@ -280,15 +375,17 @@ static void
         //
         if (i != 0)
         {
-            stream << '\t';
+            sink.Write('\t');
         }
 
-        // Copy columnn name into output string
+        // Copy columnn name into output sink
         // Column numbering starts from 1 (hence i+1).
         //
-        stream << dbcolname(dbConn, i + 1);
+        name = dbcolname(dbConn, i + 1);
+        sink.Write(name, strlen(name));
     }
-    stream << '\n';
+    sink.Write('\n');
+    sink.EndRow();
 }
 
 // ---------------------------------------------------------------------------
@@ -296,118 +393,334 @@ static void
 //
 // Description:
 //    This methods copies the contents from all the rows into the 
-//    given string. This is done for all the columns.
+//    given sink as they are fetched. This is done for all the columns.
+//    Stops early if the sink fails.
+//
+//    FOR JSON output is a single value that the server splits over
+//    several rows, so for JSON the rows are written back to back.
 //
 // Returns:
-//    VOID
+//    SUCCEED if all the rows were read (or the sink failed) and FAIL if
+//    reading a row failed, leaving the output cut short.
 //
-static void
+static RETCODE
     CopyAllRowData(
     DBPROCESS* dbConn,
-    int numColumns,
-    ostringstream& stream,
-    vector<string>& stringVector)
+    RowSink& sink,
+    const vector<ResultColumn>& columns,
+    const FileFormat type)
 {
-    size_t dataLen;
-    const char* data;
+    int rowCode;
 
     // Loop thru the result set.
     //
-    while (dbnextrow(dbConn) != NO_MORE_ROWS)
+    while ((rowCode = dbnextrow(dbConn)) != NO_MORE_ROWS)
     {
+        if (rowCode == FAIL)
+        {
+            PrintMsg("Could not read a row: %s\n",
+                     GetDBErrorContext(dbConn)->m_message.c_str());
+            return FAIL;
+        }
+
+        if (sink.GetError())
+        {
+            break;
+        }
+
         // copy out the data for each row.
         //
-        for (int i = 0; i < numColumns; i++)
+        for (size_t i = 0; i < columns.size(); i++)
         {
             // Insert a tab between two column names
             // This is not needed for the first entry.
             //
             if (i != 0)
             {
-                stream << '\t';
+                sink.Write('\t');
             }
 
-            data = stringVector[i].c_str();
+            columns[i].WriteValue(sink);
+        }
 
-            // Calculate length of data for this row.
-            //
-            dataLen = strlen(data);
+        if (type != TYPE_JSON)
+        {
+            sink.Write('\n');
+        }
 
-            // Copy columnn name into output string.
-            //
-            stream.write(data, dataLen);
+        sink.EndRow();
+    }
+
+    if (type == TYPE_JSON)
+    {
+        sink.Write('\n');
+    }
+
+    return SUCCEED;
+}
+
+// ---------------------------------------------------------------------------
+// Method: DiscardPendingResults
+//
+// Description:
+//    This method throws away the rows and result sets of the current
+//    command which were not read so that the connection can run another
+//    query.
+//
+// Returns:
+//    SUCCEED if the connection is ready for reuse and FAIL otherwise.
+//
+static RETCODE
+DiscardPendingResults(
+    DBPROCESS* dbConn)
+{
+    RETCODE status;
+
+    status = dbcanquery(dbConn);
+    while (status == SUCCEED)
+    {
+        status = dbresults(dbConn);
+        if (status == NO_MORE_RESULTS)
+        {
+            break;
+        }
+        else if (status == SUCCEED)
+        {
+            status = dbcanquery(dbConn);
         }
-        stream << '\n';
     }
+
+    return (status == NO_MORE_RESULTS) ? SUCCEED : FAIL;
 }
 
 // ---------------------------------------------------------------------------
-// Method: ExecuteQuery
+// Method: CopyResultSet
 //
 // Description:
-//    This method executes the provided SQL query on the given server.
+//    This method streams the current result set of a connection into the
+//    provided sink as rows arrive.
 //    If JSON is requested, the function does not copy the column name into
-//    provided buffer because that is not a part of the JSON object.
+//    provided sink because that is not a part of the JSON object.
 //
 // Returns:
-//    0 on success and -1 on error.
+//    SUCCEED on success and FAIL if reading a row failed.
+//
+static RETCODE
+CopyResultSet(
+    DBPROCESS* dbConn,
+    RowSink& sink,
+    const FileFormat type)
+{
+    int                 numColumns;
+    vector<ResultColumn> columns;
+
+    // Getting number of columns to allocate memory accordingly.
+    //
+    numColumns = dbnumcols(dbConn);
+
+    BindResultColumns(dbConn, numColumns, columns);
+
+    // In JSON there is just one row and the row name is a weird
+    // string - basically not the JSON object.
+    //
+    if (type != TYPE_JSON)
+    {
+        CopyColumnNames(dbConn, numColumns, sink);
+    }
+
+    // Copy row data.
+    //
+    return CopyAllRowData(dbConn, sink, columns, type);
+}
+
+// ---------------------------------------------------------------------------
+// Method: CopyQueryResults
+//
+// Description:
+//    This method streams the result sets of a connection into the provided
+//    sink, starting with the current one. The sink decides if it takes the
+//    result sets after the first - whatever it doesn't take is discarded,
+//    along with the rows not read because the sink failed.
+//
+//    Statements of a batch which don't return rows (SET, INSERT, ...) have
+//    a result without columns. These are skipped.
+//
+// Returns:
+//    SUCCEED if the connection can be reused and FAIL otherwise. FAIL
+//    also means the output is incomplete - reading the results failed -
+//    and must not be used.
+//
+RETCODE
+CopyQueryResults(
+    DBPROCESS* dbConn,
+    RowSink& sink,
+    const FileFormat type)
+{
+    RETCODE status = SUCCEED;
+    bool    first = true;
+
+    // RunQuery() has already moved to the first result.
+    //
+    do
+    {
+        if (dbnumcols(dbConn) == 0)
+        {
+            continue;
+        }
+
+        if (!first && !sink.NextResultSet())
+        {
+            break;
+        }
+        first = false;
+
+        if (CopyResultSet(dbConn, sink, type) == FAIL)
+        {
+            return FAIL;
+        }
+
+        if (sink.GetError() || dbcanquery(dbConn) == FAIL)
+        {
+            break;
+        }
+    }
+    while ((status = dbresults(dbConn)) == SUCCEED);
+
+    if (status == NO_MORE_RESULTS)
+    {
+        return SUCCEED;
+    }
+    else if (status == FAIL)
+    {
+        return FAIL;
+    }
+
+    return DiscardPendingResults(dbConn);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ExecuteQuery
+//
+// Description:
+//    This method executes the provided SQL query on the given server
+//    and streams the result into the provided sink as rows arrive.
+//
+//    Once the query engine is running the wait for the server is left to
+//    it. Until then (e.g. while the configuration is being verified) the
+//    query is run synchronously on the calling thread.
+//
+//    A pooled connection can turn out to be dead only when it is used
+//    (e.g. the server restarted) - in that case it is thrown away and the
+//    query is retried once on a new connection.
+//
+//    Output cut short because reading the rows failed is an error, so that
+//    it is never taken for the complete result.
+//
+// Returns:
+//    0 on success,
+//    -errno if writing to the sink failed,
+//    -1 on other errors.
 //
 int
 ExecuteQuery(
     const string& query,
-    string& output,
+    RowSink& sink,
     const string& dbServer,
     const string& username,
     const string& password,
     const FileFormat type)
 {
-    DBPROCESS*      dbConn;
-    RETCODE         status = FAIL;
-    int             numColumns;
-    vector<string>  stringVector;
-    int             result = -1;
-    ostringstream   stream;
+    DBPROCESS*          dbConn;
+    RETCODE             status = FAIL;
+    bool                discard = true;
+    int                 attempt;
+    int                 result = -1;
+    SQLConnectionPool*  pool;
+    QueryEngine*        engine = GetQueryEngine();
 
-    status = CreateConnectionAndRunQuery(query, dbServer, username, password, dbConn);
+    pool = GetConnectionPool(dbServer, username, password);
 
-    if (status == SUCCEED)
+    for (attempt = 0; attempt < 2 && status == FAIL; attempt++)
     {
-        // Getting number of columns to allocate memory accordingly.
-        //
-        numColumns = dbnumcols(dbConn);
-
-        BindStringVector(dbConn, numColumns, stringVector);
+        dbConn = pool->Acquire();
+        if (!dbConn)
+        {
+            break;
+        }
 
-        // In JSON there is just one row and the row name is a weird
-        // string - basically not the JSON object.
-        //
-        if (type != TYPE_JSON)
+        if (engine->IsRunning())
         {
-            CopyColumnNames(dbConn, numColumns, stream);
+            status = engine->Execute(dbConn, query, sink, type, discard);
+        }
+        else
+        {
+            status = RunQuery(dbConn, query);
+            if (status == SUCCEED)
+            {
+                status = CopyQueryResults(dbConn, sink, type);
+                discard = (status == FAIL);
+            }
         }
 
-        // Copy row data.
-        //
-        CopyAllRowData(dbConn, numColumns, stream, stringVector);
+        if (status == FAIL)
+        {
+            bool dead = DBDEAD(dbConn);
 
-        // Clean up.
-        //
-        dbfreebuf(dbConn);
-        dbclose(dbConn);
-        dbexit();
+            pool->Release(dbConn, true);
 
-        result = 0;
+            // Only a broken connection is worth another try, and only if
+            // none of the output has been written yet.
+            //
+            if (!dead || sink.GetBytesWritten() != 0)
+            {
+                break;
+            }
+        }
+        else
+        {
+            pool->Release(dbConn, discard);
+        }
     }
 
-    // Uninstall error-handler and message-handlers.
-    //
-    UninstallDBHandlers();
-
-    output = stream.str();
+    if (status == SUCCEED)
+    {
+        result = sink.Flush();
+        if (result)
+        {
+            PrintMsg("Writing the query output failed. error = %d\n", result);
+        }
+    }
 
     return result;
 }
 
+// ---------------------------------------------------------------------------
+// Method: ExecuteQuery
+//
+// Description:
+//    This method executes the provided SQL query on the given server
+//    and returns the whole result in a string. Only meant for results
+//    that are known to be small.
+//
+// Returns:
+//    0 on success and -1 on error.
+//
+int
+ExecuteQuery(
+    const string& query,
+    string& output,
+    const string& dbServer,
+    const string& username,
+    const string& password,
+    const FileFormat type)
+{
+    MemoryRowSink sink(output);
+
+    output.clear();
+
+    return ExecuteQuery(query, sink, dbServer, username, password, type);
+}
+
 // ---------------------------------------------------------------------------
 // Method: VerifyServerInfo
 //
@@ -416,6 +729,9 @@ ExecuteQuery(
 //    credentials of the given IP address. Also implicitly checks if the IP
 //    address is reachable.
 //
+//    The query it checks with asks for @@version, whose output (as TSV) is
+//    returned so that the caller doesn't have to ask again.
+//
 // Returns:
 //    bool.
 //
@@ -423,41 +739,42 @@ bool
 VerifyServerInfo(
     string hostname,
     string username,
-    string password)
+    string password,
+    string& version)
 {
-    DBPROCESS* dbConn;
-    RETCODE result = FAIL;
-    string  query;
-    bool status = true;
+    DBPROCESS*          dbConn;
+    RETCODE             result = FAIL;
+    string              query;
+    bool                status = true;
+    SQLConnectionPool*  pool;
 
     // Just a basic query to test connection with server.
     //
     query = "SELECT @@version";
 
-    result = CreateConnectionAndRunQuery(query, 
-                                        hostname,
-                                        username, 
-                                        password, 
-                                        dbConn);
+    pool = GetConnectionPool(hostname, username, password);
+
+    result = AcquireConnectionAndRunQuery(query, pool, dbConn);
 
     if (result == SUCCEED)
     {
-        // Clean up.
+        MemoryRowSink sink(version);
+
+        version.clear();
+        result = CopyQueryResults(dbConn, sink, TYPE_TSV);
+
+        // Keep the connection in the pool - it is going to be used to
+        // populate the DMV files.
         //
-        dbfreebuf(dbConn);
-        dbclose(dbConn);
-        dbexit();
+        pool->Release(dbConn, result == FAIL);
     }
-    else
+
+    if (result != SUCCEED)
     {
         PrintMsg("Provided combination of hostname, username and password don't work. "
                  "This section would be ignored.\n");
         status = false;
     }
 
-    // Un-install error-handler and message-handlers.
-    //
-    UninstallDBHandlers();
-
     return status;
 }
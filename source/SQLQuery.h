@@ -12,7 +12,6 @@
 
 #define progName                        "sqlserverFS"
 #define dbName                          "master"
-#define MAX_COLUMN_ENTRY_LEN            32
 #define SQLFS_MAX_LOGIN_TIMEOUT_SEC     3
 #define SQLFS_MAX_RESPONSE_WAIT_SEC     5
 
@@ -25,7 +24,60 @@ enum FileFormat
     TYPE_JSON
 };
 
-// This method executes the provided SQL query on the given server.
+// Details of the last error reported by DB-Library or the server on a
+// connection. Every pooled connection has its own context so that
+// concurrent queries don't see each others errors.
+//
+struct DBErrorContext
+{
+    int     m_dbErr;        // DB-Library error number, 0 if none.
+    DBINT   m_msgNo;        // Server message number, 0 if none.
+    int     m_severity;
+    string  m_message;
+
+    DBErrorContext() : m_dbErr(0), m_msgNo(0), m_severity(0) {}
+};
+
+// This method initializes DB-Library for the whole process and installs
+// the error and message handlers.
+//
+bool InitializeDBLibrary();
+
+// This method releases DB-Library. All connections must be closed.
+//
+void ShutdownDBLibrary();
+
+// These methods manage the error context of a connection.
+//
+void AttachDBErrorContext(DBPROCESS* dbproc);
+
+void DetachDBErrorContext(DBPROCESS* dbproc);
+
+DBErrorContext* GetDBErrorContext(DBPROCESS* dbproc);
+
+void ResetDBErrorContext(DBPROCESS* dbproc);
+
+// This method streams the result sets of a connection into the sink and
+// gets the connection ready for the next query.
+//
+RETCODE CopyQueryResults(
+    DBPROCESS* dbConn,
+    RowSink& sink,
+    const FileFormat type);
+
+// This method executes the provided SQL query on the given server and
+// writes the result into the sink as the rows arrive.
+//
+int ExecuteQuery(
+    const string& query,
+    RowSink& sink,
+    const string& dbServer,
+    const string& username,
+    const string& password,
+    const FileFormat type);
+
+// This method executes the provided SQL query on the given server and
+// returns the result in a string.
 //
 int ExecuteQuery(
     const string& query,
@@ -36,11 +88,12 @@ int ExecuteQuery(
     const FileFormat type);
 
 // This method checks if DB-Lib is able to connect with the given 
-// credentials of the given IP address.
+// credentials of the given IP address, and returns @@version of the server.
 //
 bool
 VerifyServerInfo(
     string hostname,
     string username,
-    string password);
+    string password,
+    string& version);
 
@@ -0,0 +1,86 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: SingleFlight.h
+//
+// Purpose:
+//   This file contains a helper that lets concurrent callers doing the
+//   same piece of work share a single execution of it.
+//
+#pragma once
+
+//--------------------------------------------------------------------
+// Class: SingleFlight
+//
+// Description:
+//  Coalesces concurrent calls with the same key. The first caller runs
+//  the work, the callers arriving while it is running wait for it and get
+//  the same result. A call made after the work has finished runs it again.
+//
+template <typename Result>
+class SingleFlight
+{
+public:
+    // Runs the work for the key unless it is already running, in which
+    // case the result of the running one is returned.
+    //
+    Result Do(
+        const string& key,
+        function<Result()> work)
+    {
+        std::promise<Result>        promise;
+        std::shared_future<Result>  result;
+        bool                        leader = false;
+
+        {
+            lock_guard<mutex> lock(m_lock);
+
+            auto itr = m_inFlight.find(key);
+            if (itr != m_inFlight.end())
+            {
+                result = itr->second;
+            }
+            else
+            {
+                result = promise.get_future().share();
+                m_inFlight.emplace(key, result);
+                leader = true;
+            }
+        }
+
+        if (!leader)
+        {
+            return result.get();
+        }
+
+        try
+        {
+            Result value = work();
+
+            Forget(key);
+            promise.set_value(value);
+
+            return value;
+        }
+        catch (...)
+        {
+            Forget(key);
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+    }
+
+private:
+    // Removes the key so that the next call runs the work again.
+    //
+    void Forget(
+        const string& key)
+    {
+        lock_guard<mutex> lock(m_lock);
+        m_inFlight.erase(key);
+    }
+
+    mutex                                               m_lock;
+    unordered_map<string, std::shared_future<Result>>   m_inFlight;
+};
@@ -300,6 +300,123 @@ IsPrefix(string prefix, string value)
     }
 }
 
+// ---------------------------------------------------------------------------
+// Table of all the two digit numbers used to format two digits at a time.
+//
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// ---------------------------------------------------------------------------
+// Function: FormatUInt64
+//
+// Description:
+//    Function that writes the decimal text of an unsigned number into the
+//    buffer. Digits are produced two at a time from the end of a scratch
+//    buffer and then copied to the front of the output.
+//
+// Returns:
+//    Number of characters written.
+//
+size_t
+FormatUInt64(
+    uint64_t value,  // Number to format
+    char*    buffer) // Output, at least MAX_INT64_TEXT_LEN characters
+{
+    char    scratch[MAX_INT64_TEXT_LEN];
+    char*   end = scratch + sizeof(scratch);
+    char*   pos = end;
+    size_t  pair;
+
+    while (value >= 100)
+    {
+        pair = (value % 100) * 2;
+        value /= 100;
+        *--pos = DIGIT_PAIRS[pair + 1];
+        *--pos = DIGIT_PAIRS[pair];
+    }
+
+    if (value >= 10)
+    {
+        pair = value * 2;
+        *--pos = DIGIT_PAIRS[pair + 1];
+        *--pos = DIGIT_PAIRS[pair];
+    }
+    else
+    {
+        *--pos = (char)('0' + value);
+    }
+
+    memcpy(buffer, pos, end - pos);
+
+    return end - pos;
+}
+
+// ---------------------------------------------------------------------------
+// Function: FormatInt64
+//
+// Description:
+//    Function that writes the decimal text of a signed number into the
+//    buffer.
+//
+// Returns:
+//    Number of characters written.
+//
+size_t
+FormatInt64(
+    int64_t value,  // Number to format
+    char*   buffer) // Output, at least MAX_INT64_TEXT_LEN characters
+{
+    if (value < 0)
+    {
+        // Negate in unsigned arithmetic so that INT64_MIN works too.
+        //
+        *buffer = '-';
+        return 1 + FormatUInt64(0 - (uint64_t)value, buffer + 1);
+    }
+
+    return FormatUInt64((uint64_t)value, buffer);
+}
+
+// ---------------------------------------------------------------------------
+// Method: convertToInt
+//
+// Description:
+//    This method interprets the integer value of the provided string.
+//
+// Returns:
+//    bool
+//
+bool
+convertToInt(
+    string str,
+    int& intVal)
+{
+    bool status = true;
+
+    try
+    {
+        intVal = stoi(str);
+    }
+    // stoi may throw std::invalid_argument or std::out_of_range
+    //
+    catch (exception& e)
+    {
+        PrintMsg("Unable to convert string to int. Exception: %s\n", e.what());
+        status = false;
+    }
+
+    return status;
+}
+
 // ---------------------------------------------------------------------------
 // Function: ConvertU8ToU16
 //
@@ -65,12 +65,30 @@ int IsPrefix(string prefix, string value);
 // ----------------------------------------------------------------------------
 // String conversion functions
 //
+// Interprets the integer value of the string. Returns false if it isn't one.
+//
+bool convertToInt(string str, int& intVal);
+
 // These functions provide conversion between 8 bit and 16 bit string values.
 //
 u16string ConvertU8ToU16(const string& inputValue);
 
 string ConvertU16ToU8(const u16string& inputValue);
 
+// ----------------------------------------------------------------------------
+// Number formatting functions
+//
+// These write the decimal text of a number into the given buffer without
+// allocating or null terminating it, in the spirit of C++17 to_chars.
+// They return the number of characters written. The buffer must be able
+// to hold MAX_INT64_TEXT_LEN characters.
+//
+#define MAX_INT64_TEXT_LEN      20
+
+size_t FormatUInt64(uint64_t value, char* buffer);
+
+size_t FormatInt64(int64_t value, char* buffer);
+
 // ----------------------------------------------------------------------------
 // Character conversion to upper or lower case
 //
@@ -22,6 +22,8 @@
 #include <deque>
 #include <exception>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <list>
 #include <locale>
@@ -29,6 +31,7 @@
 #include <memory>
 #include <mutex>
 #include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <stack>
 #include <string>
@@ -81,6 +84,12 @@ using std::ostringstream;
 using std::to_string;
 using std::ios;
 using std::cin;
+using std::deque;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::condition_variable;
+using std::function;
 
 // ---------------------------------------------------------------------------
 // C Runtime Headers
@@ -109,9 +118,13 @@ using std::cin;
 #include <stdlib.h>
 #include <string.h>
 #include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/uio.h>
 #include <sys/epoll.h>
 #include <sys/mman.h>
+#ifndef MFD_CLOEXEC
+#include <linux/memfd.h>
+#endif
 #include <sys/prctl.h>
 #include <sys/resource.h>
 #include <sys/signalfd.h>
@@ -124,7 +137,12 @@ using std::cin;
 #include <ucontext.h>
 #include <netdb.h>
 #include <linux/aio_abi.h>
+#ifdef DBFS_USE_FUSE3_LOWLEVEL
+#define FUSE_USE_VERSION 32
+#include <fuse_lowlevel.h>
+#else
 #include <fuse.h>
+#endif
 #include <attr/xattr.h>
 #include <dirent.h>
 #include <ctype.h>
@@ -142,11 +160,25 @@ using std::cin;
 //
 #include "StringUtils.h"
 #include "sqlfs.h"
+#include "RowSink.h"
+#include "ResultColumn.h"
 #include "SQLQuery.h"
+#include "ResultSnapshot.h"
+#include "ResultStream.h"
+#include "ConnectionPool.h"
+#include "QueryEngine.h"
+#include "QueryWorkerPool.h"
+#include "ResultCache.h"
+#include "CatalogCache.h"
+#include "PathRouter.h"
+#include "VirtualTree.h"
+#include "DbfsService.h"
+#include "FuseLowLevel.h"
 #include "helper.h"
 #include "INIFile.h"
 #include "ParseException.h"
 #include "CustomQuery.h"
+#include "CustomQueryWatcher.h"
 
 // Common symbols needed by all files.
 //
@@ -155,4 +187,7 @@ extern bool g_InVerbose;
 extern unordered_map<string, class ServerInfo*> g_ServerInfoMap;
 extern bool g_UseLogFile;
 extern bool g_RunInForeground;
-extern char g_LocallyGeneratedFiles[];
+extern bool g_UsePageCache;
+extern bool g_LazyMount;
+extern bool g_StreamResults;
+extern int g_NumThreads;
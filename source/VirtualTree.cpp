@@ -0,0 +1,725 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: VirtualTree.cpp
+//
+// Purpose:
+//   This file contains the definitions of the in-memory directory tree
+//   holding the server directories and the dbfs files.
+//
+#include "UtilsPrivate.h"
+
+// The process wide tree.
+//
+static VirtualTree s_VirtualTree;
+
+// ---------------------------------------------------------------------------
+// Method: VirtualNode Constructor
+//
+// Description:
+//    Creates a node owned by the user running dbfs and stamped with the
+//    current time. For JSON DMV files the name of the DMV, and for the
+//    calls of a custom query the query file, is taken from the route of
+//    the path.
+//
+// Returns:
+//    none
+//
+VirtualNode::VirtualNode(
+    VirtualNodeType type,
+    const string& servername,
+    const string& path,
+    const string& name) :
+    m_type(type),
+    m_servername(servername),
+    m_path(path),
+    m_name(name),
+    m_format(TYPE_TSV),
+    m_resultIndex(0),
+    m_lastUsed(0)
+{
+    Route route;
+
+    memset(&m_stat, 0, sizeof(m_stat));
+
+    m_stat.st_mode = (type == NODE_DIRECTORY) ? VIRTUAL_DIRECTORY_MODE :
+                     (type == NODE_CUSTOM_QUERY_TEMPLATE) ? VIRTUAL_TEMPLATE_MODE :
+                     VIRTUAL_FILE_MODE;
+    m_stat.st_nlink = IsDirectory() ? 2 : 1;
+    m_stat.st_uid = getuid();
+    m_stat.st_gid = getgid();
+    m_stat.st_atime = m_stat.st_mtime = m_stat.st_ctime = time(NULL);
+
+    if (type == NODE_DMV_FILE)
+    {
+        m_dmvName = name;
+    }
+    else if (type == NODE_DMV_JSON_FILE)
+    {
+        ParseRoute(path.c_str(), route);
+        assert(route.m_type == ROUTE_SERVER_FILE && route.m_format == TYPE_JSON);
+
+        m_dmvName = route.m_stem.ToString();
+        m_format = TYPE_JSON;
+    }
+    else if (type == NODE_CUSTOM_QUERY_CALL_FILE)
+    {
+        ParseRoute(path.c_str(), route);
+        assert(route.m_type == ROUTE_CUSTOM_QUERY_CALL);
+
+        m_queryName = route.m_query.ToString();
+        MarkUsed();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: VirtualTree Constructor
+//
+// Description:
+//    Creates a tree with just the root directory.
+//
+// Returns:
+//    none
+//
+VirtualTree::VirtualTree() :
+    m_root(make_shared<VirtualNode>(NODE_DIRECTORY, "", "/", "")),
+    m_nextInode(VIRTUAL_ROOT_INODE + 1)
+{
+    m_root->m_stat.st_ino = VIRTUAL_ROOT_INODE;
+    m_index.emplace(m_root->m_path, m_root);
+}
+
+// ---------------------------------------------------------------------------
+// Method: Lookup
+//
+// Description:
+//    This method finds the node at the path in the index.
+//
+// Returns:
+//    The node or NULL if there is no virtual node at the path.
+//
+shared_ptr<VirtualNode>
+VirtualTree::Lookup(
+    const char* path) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+
+    auto itr = m_index.find(path);
+    if (itr == m_index.end())
+    {
+        return nullptr;
+    }
+
+    return itr->second;
+}
+
+// ---------------------------------------------------------------------------
+// Method: Contains
+//
+// Description:
+//    This method checks if there is a node at the path.
+//
+// Returns:
+//    bool
+//
+bool
+VirtualTree::Contains(
+    const char* path) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+
+    return m_index.find(path) != m_index.end();
+}
+
+// ---------------------------------------------------------------------------
+// Method: LookupChild
+//
+// Description:
+//    This method finds the entry of the directory with the given name.
+//
+// Returns:
+//    The node or NULL if the directory has no such entry.
+//
+shared_ptr<VirtualNode>
+VirtualTree::LookupChild(
+    const shared_ptr<VirtualNode>& directory,
+    const char* name) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+
+    auto itr = directory->m_children.find(name);
+    if (itr == directory->m_children.end())
+    {
+        return nullptr;
+    }
+
+    return itr->second;
+}
+
+// ---------------------------------------------------------------------------
+// Method: CreateNodeLocked
+//
+// Description:
+//    This method creates a node in the directory and records it in the
+//    index. Must be called with the lock held exclusively.
+//
+// Returns:
+//    The new node.
+//
+shared_ptr<VirtualNode>
+VirtualTree::CreateNodeLocked(
+    const shared_ptr<VirtualNode>& directory,
+    const string& name,
+    VirtualNodeType type)
+{
+    shared_ptr<VirtualNode> node;
+    string                  path;
+
+    path = (directory == m_root) ? "/" + name : directory->m_path + "/" + name;
+
+    node = make_shared<VirtualNode>(type,
+                                    directory->m_servername.empty() ? name : directory->m_servername,
+                                    path,
+                                    name);
+    node->m_stat.st_ino = m_nextInode++;
+
+    directory->m_children[name] = node;
+    m_index[path] = node;
+
+    if (node->IsDirectory())
+    {
+        directory->m_stat.st_nlink++;
+    }
+
+    return node;
+}
+
+// ---------------------------------------------------------------------------
+// Method: RemoveNodeLocked
+//
+// Description:
+//    This method removes the entry with the name from the directory and
+//    the index. The result files of a custom query go with it, and so do
+//    the calls of a parameterized query. Must be called with the lock held
+//    exclusively.
+//
+// Returns:
+//    VOID
+//
+void
+VirtualTree::RemoveNodeLocked(
+    const shared_ptr<VirtualNode>& directory,
+    const string& name)
+{
+    shared_ptr<VirtualNode> node;
+    vector<string>          resultNames;
+
+    auto itr = directory->m_children.find(name);
+    if (itr == directory->m_children.end() || itr->second->m_type == NODE_DIRECTORY)
+    {
+        return;
+    }
+
+    node = itr->second;
+    m_index.erase(node->m_path);
+    directory->m_children.erase(itr);
+
+    if (node->IsDirectory())
+    {
+        directory->m_stat.st_nlink--;
+
+        while (!node->m_children.empty())
+        {
+            RemoveNodeLocked(node, node->m_children.begin()->first);
+        }
+    }
+
+    if (node->m_type == NODE_CUSTOM_QUERY_FILE || node->m_type == NODE_CUSTOM_QUERY_CALL_FILE)
+    {
+        for (auto&& child : directory->m_children)
+        {
+            if (child.second->m_type == NODE_CUSTOM_QUERY_RESULT_FILE &&
+                child.second->m_queryNode.lock() == node)
+            {
+                resultNames.push_back(child.first);
+            }
+        }
+
+        for (auto&& resultName : resultNames)
+        {
+            RemoveNodeLocked(directory, resultName);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: AddNode
+//
+// Description:
+//    This method adds a node of the given type to the directory.
+//
+// Returns:
+//    The node with the name, which is the existing one if there is one.
+//
+shared_ptr<VirtualNode>
+VirtualTree::AddNode(
+    const shared_ptr<VirtualNode>& directory,
+    const string& name,
+    VirtualNodeType type)
+{
+    std::unique_lock<std::shared_timed_mutex> lock(m_lock);
+
+    auto itr = directory->m_children.find(name);
+    if (itr != directory->m_children.end())
+    {
+        return itr->second;
+    }
+
+    return CreateNodeLocked(directory, name, type);
+}
+
+// ---------------------------------------------------------------------------
+// Method: SetNode
+//
+// Description:
+//    This method adds a node of the given type to the directory. A node
+//    with the name of another type is replaced, so that a query file
+//    which gains or loses its parameters turns into a directory or back,
+//    and a new query file replaces a result file with its name.
+//
+// Returns:
+//    The node with the name.
+//
+shared_ptr<VirtualNode>
+VirtualTree::SetNode(
+    const shared_ptr<VirtualNode>& directory,
+    const string& name,
+    VirtualNodeType type)
+{
+    std::unique_lock<std::shared_timed_mutex> lock(m_lock);
+
+    auto itr = directory->m_children.find(name);
+    if (itr != directory->m_children.end())
+    {
+        if (itr->second->m_type == type)
+        {
+            return itr->second;
+        }
+        RemoveNodeLocked(directory, name);
+    }
+
+    return CreateNodeLocked(directory, name, type);
+}
+
+// ---------------------------------------------------------------------------
+// Method: AddCall
+//
+// Description:
+//    This method adds the call of a parameterized custom query to the
+//    directory of the query. Any name giving values to the parameters is a
+//    call, so the calls would pile up without bound. Once there are
+//    maxCalls of them, the ones looked up the longest ago are removed
+//    along with their result files - unless something still holds on to
+//    them (an open handle, or the kernel in the low level API), besides
+//    the directory and the index.
+//
+// Returns:
+//    The node of the call, which is the existing one if there is one.
+//
+shared_ptr<VirtualNode>
+VirtualTree::AddCall(
+    const shared_ptr<VirtualNode>& templateDir,
+    const string& name,
+    size_t maxCalls)
+{
+    vector<shared_ptr<VirtualNode>>             unused;
+    size_t                                      numCalls = 0;
+    std::unique_lock<std::shared_timed_mutex>   lock(m_lock);
+
+    auto itr = templateDir->m_children.find(name);
+    if (itr != templateDir->m_children.end())
+    {
+        itr->second->MarkUsed();
+        return itr->second;
+    }
+
+    for (auto&& child : templateDir->m_children)
+    {
+        if (child.second->m_type == NODE_CUSTOM_QUERY_CALL_FILE)
+        {
+            numCalls++;
+
+            if (child.second.use_count() == 2)
+            {
+                unused.push_back(child.second);
+            }
+        }
+    }
+
+    if (numCalls >= maxCalls)
+    {
+        std::sort(unused.begin(), unused.end(),
+            [](const shared_ptr<VirtualNode>& a, const shared_ptr<VirtualNode>& b)
+            {
+                return a->m_lastUsed < b->m_lastUsed;
+            });
+
+        for (size_t i = 0; i < unused.size() && numCalls >= maxCalls; i++, numCalls--)
+        {
+            RemoveNodeLocked(templateDir, unused[i]->m_name);
+        }
+    }
+
+    return CreateNodeLocked(templateDir, name, NODE_CUSTOM_QUERY_CALL_FILE);
+}
+
+// ---------------------------------------------------------------------------
+// Method: RemoveNode
+//
+// Description:
+//    This method removes the entry with the name from the directory. A
+//    server or custom query directory with the name is left alone.
+//
+// Returns:
+//    VOID
+//
+void
+VirtualTree::RemoveNode(
+    const shared_ptr<VirtualNode>& directory,
+    const char* name)
+{
+    std::unique_lock<std::shared_timed_mutex> lock(m_lock);
+
+    RemoveNodeLocked(directory, name);
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReplaceFiles
+//
+// Description:
+//    This method makes the files of the given type in the directory match
+//    the list of names. Files which are still listed keep their node.
+//
+// Returns:
+//    VOID
+//
+void
+VirtualTree::ReplaceFiles(
+    const shared_ptr<VirtualNode>& directory,
+    const vector<string>& names,
+    VirtualNodeType type)
+{
+    set<string>                                 wanted(names.begin(), names.end());
+    vector<string>                              unwanted;
+    std::unique_lock<std::shared_timed_mutex>   lock(m_lock);
+
+    for (auto&& child : directory->m_children)
+    {
+        if (child.second->m_type == type && !wanted.count(child.first))
+        {
+            unwanted.push_back(child.first);
+        }
+    }
+
+    for (auto&& name : unwanted)
+    {
+        RemoveNodeLocked(directory, name);
+    }
+
+    for (auto&& name : wanted)
+    {
+        if (!directory->m_children.count(name))
+        {
+            CreateNodeLocked(directory, name, type);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: ReplaceCustomQueries
+//
+// Description:
+//    This method makes the custom query directory match the query files.
+//    A query file is a file, or a directory of its calls if it has
+//    parameters. Entries which keep their type keep their node, and with
+//    it the calls made so far. A query file replaces a result file of
+//    another query with the same name.
+//
+// Returns:
+//    VOID
+//
+void
+VirtualTree::ReplaceCustomQueries(
+    const shared_ptr<VirtualNode>& directory,
+    const map<string, VirtualNodeType>& queries)
+{
+    vector<string>                              unwanted;
+    std::unique_lock<std::shared_timed_mutex>   lock(m_lock);
+
+    for (auto&& child : directory->m_children)
+    {
+        if (child.second->m_type == NODE_CUSTOM_QUERY_RESULT_FILE &&
+            queries.count(child.first))
+        {
+            unwanted.push_back(child.first);
+            continue;
+        }
+
+        if (child.second->m_type != NODE_CUSTOM_QUERY_FILE &&
+            child.second->m_type != NODE_CUSTOM_QUERY_TEMPLATE)
+        {
+            continue;
+        }
+
+        auto itr = queries.find(child.first);
+        if (itr == queries.end() || itr->second != child.second->m_type)
+        {
+            unwanted.push_back(child.first);
+        }
+    }
+
+    for (auto&& name : unwanted)
+    {
+        RemoveNodeLocked(directory, name);
+    }
+
+    for (auto&& query : queries)
+    {
+        if (!directory->m_children.count(query.first))
+        {
+            CreateNodeLocked(directory, query.first, query.second);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: SetResultSets
+//
+// Description:
+//    This method keeps the result sets after the first of the latest run
+//    of the custom query. Result set n (counting from 0) is the file
+//    <query file>.<n> next to the query file. Result files the run didn't
+//    produce are removed. A query file which happens to have the name of
+//    a result file wins: the result file isn't created, and a query file
+//    showing up later replaces it (ReplaceCustomQueries() and SetNode()).
+//
+// Returns:
+//    VOID
+//
+void
+VirtualTree::SetResultSets(
+    const shared_ptr<VirtualNode>& queryNode,
+    const vector<shared_ptr<const ResultSnapshot>>& resultSets)
+{
+    shared_ptr<VirtualNode>                     directory;
+    shared_ptr<VirtualNode>                     node;
+    vector<string>                              unwanted;
+    string                                      name;
+    std::unique_lock<std::shared_timed_mutex>   lock(m_lock);
+
+    // The query file may have been removed while the query was running.
+    //
+    auto dirItr = m_index.find(queryNode->m_path.substr(0, queryNode->m_path.rfind('/')));
+    if (dirItr == m_index.end())
+    {
+        return;
+    }
+    directory = dirItr->second;
+
+    auto queryItr = directory->m_children.find(queryNode->m_name);
+    if (queryItr == directory->m_children.end() || queryItr->second != queryNode)
+    {
+        return;
+    }
+
+    queryNode->m_resultSets = resultSets;
+
+    for (auto&& child : directory->m_children)
+    {
+        if (child.second->m_type == NODE_CUSTOM_QUERY_RESULT_FILE &&
+            child.second->m_queryNode.lock() == queryNode &&
+            child.second->m_resultIndex > resultSets.size())
+        {
+            unwanted.push_back(child.first);
+        }
+    }
+
+    for (auto&& unwantedName : unwanted)
+    {
+        RemoveNodeLocked(directory, unwantedName);
+    }
+
+    for (size_t i = 1; i <= resultSets.size(); i++)
+    {
+        name = queryNode->m_name + CUSTOM_QUERY_RESULT_SEPARATOR + to_string(i);
+        if (directory->m_children.count(name))
+        {
+            continue;
+        }
+
+        node = CreateNodeLocked(directory, name, NODE_CUSTOM_QUERY_RESULT_FILE);
+        node->m_queryNode = queryNode;
+        node->m_resultIndex = i;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetResultSet
+//
+// Description:
+//    This method finds the result set of the result file in the latest run
+//    of its custom query.
+//
+// Returns:
+//    The result set or NULL if the query file is gone or its latest run
+//    had fewer result sets.
+//
+shared_ptr<const ResultSnapshot>
+VirtualTree::GetResultSet(
+    const shared_ptr<VirtualNode>& resultNode) const
+{
+    shared_ptr<VirtualNode>                     queryNode;
+    std::shared_lock<std::shared_timed_mutex>   lock(m_lock);
+
+    queryNode = resultNode->m_queryNode.lock();
+    if (!queryNode ||
+        resultNode->m_resultIndex == 0 ||
+        resultNode->m_resultIndex > queryNode->m_resultSets.size())
+    {
+        return nullptr;
+    }
+
+    return queryNode->m_resultSets[resultNode->m_resultIndex - 1];
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetAttributes
+//
+// Description:
+//    This method copies the attributes of the node. The size and times of
+//    the files change as their content is refreshed, so they are read
+//    under the lock.
+//
+// Returns:
+//    VOID
+//
+void
+VirtualTree::GetAttributes(
+    const shared_ptr<VirtualNode>& node,
+    struct stat& stbuf) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+
+    stbuf = node->m_stat;
+}
+
+// ---------------------------------------------------------------------------
+// Method: UpdateContent
+//
+// Description:
+//    This method makes the content just taken of the file the current one.
+//    If it differs from the previous content the size and the modification
+//    time of the file are updated, so that anyone caching the file can tell
+//    it has changed.
+//
+//    The contents are compared without holding the lock - the snapshots
+//    are immutable.
+//
+// Returns:
+//    true if the content is unchanged.
+//
+bool
+VirtualTree::UpdateContent(
+    const shared_ptr<VirtualNode>& node,
+    const shared_ptr<const ResultSnapshot>& content)
+{
+    shared_ptr<const ResultSnapshot>    previous;
+    bool                                unchanged;
+
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+        previous = node->m_content;
+    }
+
+    unchanged = previous &&
+                (previous == content || previous->HasSameContent(*content));
+
+    std::unique_lock<std::shared_timed_mutex> lock(m_lock);
+
+    node->m_content = content;
+
+    if (!unchanged)
+    {
+        node->m_stat.st_size = content->GetSize();
+        node->m_stat.st_mtime = node->m_stat.st_ctime = time(NULL);
+    }
+
+    return unchanged;
+}
+
+// ---------------------------------------------------------------------------
+// Method: ListChildren
+//
+// Description:
+//    This method copies the entries of the directory so that they can be
+//    passed on to FUSE without holding the lock.
+//
+// Returns:
+//    VOID
+//
+void
+VirtualTree::ListChildren(
+    const shared_ptr<VirtualNode>& directory,
+    vector<pair<string, struct stat>>& entries) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+
+    entries.clear();
+    entries.reserve(directory->m_children.size());
+
+    for (auto&& child : directory->m_children)
+    {
+        entries.emplace_back(child.first, child.second->m_stat);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: ListChildNodes
+//
+// Description:
+//    This method copies the nodes of the entries of the directory.
+//
+// Returns:
+//    VOID
+//
+void
+VirtualTree::ListChildNodes(
+    const shared_ptr<VirtualNode>& directory,
+    vector<shared_ptr<VirtualNode>>& nodes) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(m_lock);
+
+    nodes.clear();
+    nodes.reserve(directory->m_children.size());
+
+    for (auto&& child : directory->m_children)
+    {
+        nodes.push_back(child.second);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetVirtualTree
+//
+// Description:
+//    This method returns the process wide virtual tree.
+//
+// Returns:
+//    Pointer to the tree.
+//
+VirtualTree*
+GetVirtualTree()
+{
+    return &s_VirtualTree;
+}
@@ -0,0 +1,306 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: VirtualTree.h
+//
+// Purpose:
+//   This file contains the declarations of the in-memory directory tree
+//   holding the server directories and the dbfs files.
+//
+#pragma once
+
+// Permissions of the virtual directories and files. The directories are
+// writable so that users can keep scratch files next to the DMVs.
+//
+#define VIRTUAL_DIRECTORY_MODE      (S_IFDIR | 0755)
+#define VIRTUAL_FILE_MODE           (S_IFREG | 0444)
+
+// Permissions of the directories of the parameterized custom queries. Their
+// entries are the calls of the query, so nothing else can be put there.
+//
+#define VIRTUAL_TEMPLATE_MODE       (S_IFDIR | 0555)
+
+// Inode number of the root directory. The other nodes are numbered in the
+// order they are created, numbers are never reused.
+//
+#define VIRTUAL_ROOT_INODE          1
+
+// Kinds of nodes in the virtual tree.
+//
+// Paths which are not in the tree are user scratch files.
+//
+enum VirtualNodeType
+{
+    NODE_DIRECTORY,             // The root, server and custom query directories.
+    NODE_DMV_FILE,              // <server>/<dmv>
+    NODE_DMV_JSON_FILE,         // <server>/<dmv>.json
+    NODE_CUSTOM_QUERY_FILE,     // <server>/customQueries/<query file>
+    NODE_CUSTOM_QUERY_RESULT_FILE,  // <server>/customQueries/<query file>.<n>
+    NODE_CUSTOM_QUERY_TEMPLATE, // <server>/customQueries/<query file with parameters>
+    NODE_CUSTOM_QUERY_CALL_FILE,    // <server>/customQueries/<query file>/<arguments>
+    NODE_ERROR_FILE             // <server>/SERVER_ERROR_FILE_NAME
+};
+
+//--------------------------------------------------------------------
+// Class: VirtualNode
+//
+// Description:
+//  A directory or dbfs file that only exists in memory. Its attributes
+//  are answered from m_stat without touching the disk. Everything that
+//  can be derived from the path is worked out once when the node is
+//  created.
+//
+class VirtualNode
+{
+public:
+    // Constructor
+    //
+    VirtualNode(
+        VirtualNodeType type,
+        const string& servername,
+        const string& path,
+        const string& name);
+
+    // Returns true for directories, including the directories of the
+    // parameterized custom queries.
+    //
+    bool IsDirectory() const
+    {
+        return m_type == NODE_DIRECTORY || m_type == NODE_CUSTOM_QUERY_TEMPLATE;
+    }
+
+    // Returns true for dbfs files.
+    //
+    bool IsFile() const
+    {
+        return !IsDirectory();
+    }
+
+    // Returns true for the directory of a server.
+    //
+    bool IsServerDirectory() const
+    {
+        return m_type == NODE_DIRECTORY && !m_servername.empty() &&
+               m_path.size() == m_servername.size() + 1;
+    }
+
+    // Returns true for the files with the content of a DMV.
+    //
+    bool IsDmvFile() const
+    {
+        return m_type == NODE_DMV_FILE || m_type == NODE_DMV_JSON_FILE;
+    }
+
+    // Records that the call of a custom query is being used.
+    //
+    void MarkUsed()
+    {
+        m_lastUsed = std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+
+    VirtualNodeType                         m_type;
+    string                                  m_servername;   // Empty for the root.
+    string                                  m_path;         // Relative to the mount directory.
+    string                                  m_name;         // Last component of the path.
+    string                                  m_dmvName;      // DMV files only - name without extension.
+    FileFormat                              m_format;       // DMV files only.
+    string                                  m_queryName;    // Custom query calls only - the query file.
+    struct stat                             m_stat;
+
+    // Latest content taken of a dbfs file. Its size is the size reported
+    // for the file. Guarded by the lock of the tree.
+    //
+    shared_ptr<const ResultSnapshot>        m_content;
+
+    // Entries of a directory, sorted by name. Guarded by the lock of the
+    // tree.
+    //
+    map<string, shared_ptr<VirtualNode>, std::less<>>   m_children;
+
+    // Custom query files and calls only - the result sets after the first
+    // of the latest run of the query. Guarded by the lock of the tree.
+    //
+    vector<shared_ptr<const ResultSnapshot>>    m_resultSets;
+
+    // Custom query result files only - the query file or call and the
+    // index of the result set in its latest run.
+    //
+    weak_ptr<VirtualNode>                       m_queryNode;
+    size_t                                      m_resultIndex;
+
+    // Custom query calls only - when the call was last looked up, for
+    // dropping the calls unused the longest. Set without the lock of the
+    // tree.
+    //
+    std::atomic<std::chrono::steady_clock::rep> m_lastUsed;
+};
+
+//--------------------------------------------------------------------
+// Class: VirtualTree
+//
+// Description:
+//  The namespace of the mount directory made of the virtual nodes. Paths
+//  which are not in the tree are user scratch files and live in the dump
+//  directory.
+//
+// Dev notes:
+//  Besides the directory entries every node is kept in a flat index
+//  keyed by its full path. FUSE passes full paths, so a lookup is a single
+//  search of the index which compares the path in place without building
+//  any strings.
+//
+//  The tree is built in the FUSE init callback. After that only the
+//  entries of the custom query directories (and the calls of the
+//  parameterized queries in them, of which only a bounded number is kept)
+//  change, and with --lazy the
+//  DMV files of a server directory when it is first used, so lookups take
+//  the lock shared. Nodes are handed out as shared pointers so that a node
+//  removed from the tree stays valid for the callers still using it.
+//
+class VirtualTree
+{
+public:
+    // Constructor - creates the root directory.
+    //
+    VirtualTree();
+
+    // Returns the node at the path (relative to the mount directory) or
+    // NULL if the path is not virtual.
+    //
+    shared_ptr<VirtualNode> Lookup(
+        const char* path) const;
+
+    // Returns true if there is a node at the path.
+    //
+    bool Contains(
+        const char* path) const;
+
+    // Returns the entry of the directory with the name or NULL.
+    //
+    shared_ptr<VirtualNode> LookupChild(
+        const shared_ptr<VirtualNode>& directory,
+        const char* name) const;
+
+    // Adds a node to the directory. An existing node of the same name is
+    // kept.
+    //
+    shared_ptr<VirtualNode> AddNode(
+        const shared_ptr<VirtualNode>& directory,
+        const string& name,
+        VirtualNodeType type);
+
+    // Adds a node to the directory. An existing node of the same name is
+    // kept if it is of the same type and replaced otherwise.
+    //
+    shared_ptr<VirtualNode> SetNode(
+        const shared_ptr<VirtualNode>& directory,
+        const string& name,
+        VirtualNodeType type);
+
+    // Adds the call of a parameterized custom query to the directory of
+    // the query unless it is there. The least recently used calls beyond
+    // maxCalls which nobody holds on to are removed to make room.
+    //
+    shared_ptr<VirtualNode> AddCall(
+        const shared_ptr<VirtualNode>& templateDir,
+        const string& name,
+        size_t maxCalls);
+
+    // Removes the entry of the directory with the name, if there is one,
+    // along with everything under it. Server directories and the custom
+    // query directories are left alone.
+    //
+    void RemoveNode(
+        const shared_ptr<VirtualNode>& directory,
+        const char* name);
+
+    // Replaces the files of the directory with the given ones.
+    //
+    void ReplaceFiles(
+        const shared_ptr<VirtualNode>& directory,
+        const vector<string>& names,
+        VirtualNodeType type);
+
+    // Makes the custom query directory match the query files, given with
+    // the type of node each one gets.
+    //
+    void ReplaceCustomQueries(
+        const shared_ptr<VirtualNode>& directory,
+        const map<string, VirtualNodeType>& queries);
+
+    // Records the result sets after the first of the latest run of the
+    // custom query and makes its result files match them.
+    //
+    void SetResultSets(
+        const shared_ptr<VirtualNode>& queryNode,
+        const vector<shared_ptr<const ResultSnapshot>>& resultSets);
+
+    // Returns the result set of the latest run of the custom query the
+    // result file belongs to, or NULL if there is none.
+    //
+    shared_ptr<const ResultSnapshot> GetResultSet(
+        const shared_ptr<VirtualNode>& resultNode) const;
+
+    // Copies the attributes of the node.
+    //
+    void GetAttributes(
+        const shared_ptr<VirtualNode>& node,
+        struct stat& stbuf) const;
+
+    // Records the content just taken of the file. Returns true if it is
+    // the same as the previous content.
+    //
+    bool UpdateContent(
+        const shared_ptr<VirtualNode>& node,
+        const shared_ptr<const ResultSnapshot>& content);
+
+    // Copies the names and attributes of the entries of the directory.
+    //
+    void ListChildren(
+        const shared_ptr<VirtualNode>& directory,
+        vector<pair<string, struct stat>>& entries) const;
+
+    // Copies the nodes of the entries of the directory.
+    //
+    void ListChildNodes(
+        const shared_ptr<VirtualNode>& directory,
+        vector<shared_ptr<VirtualNode>>& nodes) const;
+
+    // Returns the root directory.
+    //
+    const shared_ptr<VirtualNode>& GetRoot() const
+    {
+        return m_root;
+    }
+
+private:
+    // Index of all the nodes. The transparent comparator lets it be
+    // searched with a plain C string.
+    //
+    typedef map<string, shared_ptr<VirtualNode>, std::less<>> PathIndex;
+
+    // Creates a node in the directory and adds it to the index.
+    //
+    shared_ptr<VirtualNode> CreateNodeLocked(
+        const shared_ptr<VirtualNode>& directory,
+        const string& name,
+        VirtualNodeType type);
+
+    // Removes the entry from the directory and the index, along with the
+    // result files of a custom query and the calls of a parameterized one.
+    //
+    void RemoveNodeLocked(
+        const shared_ptr<VirtualNode>& directory,
+        const string& name);
+
+    mutable std::shared_timed_mutex m_lock;
+    shared_ptr<VirtualNode>         m_root;
+    PathIndex                       m_index;
+    ino_t                           m_nextInode;
+};
+
+// Returns the process wide virtual tree.
+//
+VirtualTree*
+GetVirtualTree();
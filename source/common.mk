@@ -42,8 +42,20 @@ IGNORED_WARNINGS = -Wno-nested-anon-types \
 				   -Wno-reserved-id-macro \
 				   -Wignored-attributes
 
+# The file system is served through the high-level libfuse 2 API by default.
+# Building with FUSE3_LOWLEVEL=1 uses the low-level libfuse 3 backend
+# (FuseLowLevel.cpp) instead.
+#
+ifeq ($(FUSE3_LOWLEVEL),1)
+	FUSE_PACKAGE = fuse3
+	FUSE_DEFINES = -DDBFS_USE_FUSE3_LOWLEVEL
+else
+	FUSE_PACKAGE = fuse
+	FUSE_DEFINES =
+endif
+
 INCLUDES=-I.
-CFLAGS=-Wall $(IGNORED_WARNINGS) $(INCLUDES) $(shell pkg-config fuse --cflags) -std=c++14
+CFLAGS=-Wall $(IGNORED_WARNINGS) $(INCLUDES) $(shell pkg-config $(FUSE_PACKAGE) --cflags) $(FUSE_DEFINES) -std=c++14
 
 # Dynamic libraries:
 #   - libpthread is needed for pthreads support.
@@ -51,7 +63,7 @@ CFLAGS=-Wall $(IGNORED_WARNINGS) $(INCLUDES) $(shell pkg-config fuse --cflags) -
 #   - libdl is needed for dynamic linking.
 #   - lsysdb is needed for using the sybase API's
 #
-LDLIBS += -lpthread -lrt -ldl $(shell pkg-config fuse --libs) -lsybdb
+LDLIBS += -lpthread -lrt -ldl $(shell pkg-config $(FUSE_PACKAGE) --libs) -lsybdb
 
 ifeq ($(PLATFORM),$(filter $(PLATFORM),rhel suse))
 	LDLIBS += -lc++abi
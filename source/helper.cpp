@@ -11,6 +11,11 @@
 
 #include "UtilsPrivate.h"
 
+// Serializes the messages of the FUSE and query threads so that they don't
+// interleave in the log.
+//
+static mutex s_LogLock;
+
 // ---------------------------------------------------------------------------
 // Method: CalculateDumpPath
 //
@@ -54,6 +59,8 @@ ReturnErrnoAndPrintError(
     
     if (g_InVerbose)
     {
+        lock_guard<mutex> lock(s_LogLock);
+
         outFile = stderr;
         status = SUCCESS;
 
@@ -69,7 +76,7 @@ ReturnErrnoAndPrintError(
         if (status == SUCCESS)
         {
             fprintf(outFile, "SQLFS Error in %s :: Reason - %s, Details - %s\n",
-                func, error_str.c_str(), strerror(errno));
+                func, error_str.c_str(), strerror(-result));
 
             if (outFile != stderr)
             {
@@ -103,6 +110,8 @@ PrintMsg(const char* format, ...)
 
     if (g_InVerbose)
     {
+        lock_guard<mutex> lock(s_LogLock);
+
         outFile = stderr;
         status = SUCCESS;
 
@@ -168,138 +177,224 @@ GetServerDetails(
 
 
 // ---------------------------------------------------------------------------
-// Method: CreateFile
+// Method: IsDbfsFile
 //
 // Description:
-//    This method creates a file with write permissions. Or truncates to zero
-//    if one already exists.
-//
-//    Note - Absolute path need to be provided to the function.
+//  This checks if the file pointed to by the provided path is a
+//  dbfs file (created by this tool). These only exist in the virtual tree.
 //
 // Returns:
-//    VOID
+//    true if file is a dmv - otherwise false.
 //
-void
-CreateFile(
+bool
+IsDbfsFile(
     const char* path)
 {
-    FILE*   fp;
+    shared_ptr<VirtualNode> node = GetVirtualTree()->Lookup(path);
 
-    fp = fopen(path, "w+");
-    if (!fp)
-    {
-        PrintMsg("Error creating file %s %s\n", path, strerror(errno));
-        KillSelf();
-    }
-    else
-    {
-        fclose(fp);
-    }
+    return node && node->IsFile();
+}
 
-    // Add the extended attribute indicating this is a locally created DMV
-    // file.
+// ---------------------------------------------------------------------------
+// Method: CreateCustomQueriesDir
+//
+// Description:
+//    Create a custom query directory and populate the directory with
+// custom query output files. The files are empty until they are opened.
+// When a file is opened, the content will be populated.
+//
+// Returns:
+//    VOID
+//
+static void
+CreateCustomQueriesDir(
+    const shared_ptr<VirtualNode>& serverDir,
+    const string& servername)
+{
+    shared_ptr<VirtualNode> customQueryDir;
+
+    // Create the custom query folder for each server.
     //
-    // Keep size as 0 as we do not want to store a value for the attribute
-    // - just want to create the attribute so pass in size as 0.
+    customQueryDir = GetVirtualTree()->AddNode(serverDir, CUSTOM_QUERY_FOLDER_NAME,
+                                               NODE_DIRECTORY);
+
+    // Create custom query output files.
     //
-    int status = setxattr(path,
-                          g_LocallyGeneratedFiles, // name
-                          "1",  // value
-                          0,    // size
-                          0);   // default value.
-    if (status)
-    {
-        PrintMsg("Error setting extended attributes for file %s : %s\n", path, strerror(errno));
-        KillSelf();
-    }
+    RefreshCustomQueryFiles(servername, customQueryDir);
 }
 
 // ---------------------------------------------------------------------------
-// Method: IsDbfsFile
+// Method: HashServerVersion
 //
 // Description:
-//  This checks if the file pointed to by the provided path is a
-//  dbfs file (created by this tool).
+//    This method hashes the output of @@version (FNV-1a), so that a DMV
+//    list kept from an earlier run can be checked cheaply. The DMVs only
+//    change when the server is upgraded or patched, which changes
+//    @@version.
 //
 // Returns:
-//    true if file is a dmv - otherwise false.
+//    The hash as 16 hex digits.
 //
-bool
-IsDbfsFile(
-    const char* path)
+string
+HashServerVersion(
+    const string& version)
 {
-    string fpath;
-    bool result = false;
+    uint64_t    hash = 14695981039346656037ULL;
+    char        hashString[17];
 
-    fpath = CalculateDumpPath(path);
+    for (unsigned char c : version)
+    {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
 
-    // Check if this is a DMV file by checking for the
-    // custom attribute.
-    //
-    int length = getxattr(fpath.c_str(),
-                          g_LocallyGeneratedFiles,
-                          NULL,
-                          0);
+    snprintf(hashString, sizeof(hashString), "%016llx", (unsigned long long)hash);
 
-    // We expect the length to be 0.
-    // -1 would mean that the value doesn't exist.
-    //
-    if (length >= 0)
+    return hashString;
+}
+
+// ---------------------------------------------------------------------------
+// Method: FetchServerVersion
+//
+// Description:
+//    This method asks the server for @@version and hashes it.
+//
+// Returns:
+//    0 on success and -1 on error.
+//
+int
+FetchServerVersion(
+    const string& hostname,
+    const string& username,
+    const string& password,
+    string& versionHash)
+{
+    string responseString;
+
+    if (ExecuteQuery("SELECT @@version", responseString, hostname,
+                     username, password, TYPE_TSV))
     {
-        result = true;
+        return -1;
     }
 
-    return result;
+    versionHash = HashServerVersion(responseString);
+
+    return 0;
 }
 
 // ---------------------------------------------------------------------------
-// Method: CreateCustomQueriesDir
+// Method: ParseDmvNames
 //
 // Description:
-//    Create a custom query directory and populate the directory with
-// custom query output file. The file is empty until it is opened. When
-// the file is opened, the content will be populated.
+//    This method takes the DMV names out of the output of
+//    SQLFS_DMV_NAMES_QUERY.
 //
 // Returns:
 //    VOID
 //
 static void
-CreateCustomQueriesDir(
-    const string& dumpDir,
-    const string& servername)
+ParseDmvNames(
+    const string& responseString,
+    vector<string>& dmvNames)
 {
-    int error;
+    // Tokenising response to extract DMV names.
+    //
+    dmvNames = Split(responseString, '\n');
 
-    // Create the custom query folder for each server.
+    // On success, it will have at least two entries.
+    //
+    assert(dmvNames.size() > 1);
+
+    // We need to skip the first name because the result of the SQL Query
+    // includes the name of the column as well in the output.
     //
-    string customQueryFolderPath = dumpDir + LINUX_PATH_DELIM + CUSTOM_QUERY_FOLDER_NAME;
-    error = mkdir(customQueryFolderPath.c_str(), DEFAULT_PERMISSIONS);
-    if (error == 0)
+    dmvNames.erase(dmvNames.begin());
+}
+
+// ---------------------------------------------------------------------------
+// Method: FetchDmvNames
+//
+// Description:
+//    This method asks the server for the names of the DMVs to create files
+//    for. It runs on a pooled connection, so right after the server was
+//    verified it reuses the connection the verification logged in with.
+//
+// Returns:
+//    0 on success and -1 on error.
+//
+int
+FetchDmvNames(
+    const string& hostname,
+    const string& username,
+    const string& password,
+    vector<string>& dmvNames)
+{
+    string  responseString;
+    int     error;
+
+    dmvNames.clear();
+
+    error = ExecuteQuery(SQLFS_DMV_NAMES_QUERY, responseString, hostname,
+        username, password, TYPE_TSV);
+    if (error)
     {
-        // Create custom query output files.
-        //
-        CreateCustomQueriesOutputFiles(
-            servername,
-            customQueryFolderPath);
+        return -1;
     }
-    else
+
+    ParseDmvNames(responseString, dmvNames);
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Method: FetchServerCatalog
+//
+// Description:
+//    This method asks the server for its version and the names of its
+//    DMVs in a single batch, for a server that hasn't been contacted yet.
+//    The version is hashed like FetchServerVersion() does.
+//
+// Returns:
+//    0 on success and -1 on error.
+//
+int
+FetchServerCatalog(
+    const string& hostname,
+    const string& username,
+    const string& password,
+    string& versionHash,
+    vector<string>& dmvNames)
+{
+    vector<string>      outputs;
+    ResultSetRowSink    sink(outputs);
+
+    dmvNames.clear();
+
+    if (ExecuteQuery("SELECT @@version; " SQLFS_DMV_NAMES_QUERY, sink, hostname,
+                     username, password, TYPE_TSV) ||
+        outputs.size() != 2)
     {
-        PrintMsg("mkdir failed for %s- %s\n", customQueryFolderPath.c_str(),
-                 strerror(errno));
+        return -1;
     }
+
+    versionHash = HashServerVersion(outputs[0]);
+    ParseDmvNames(outputs[1], dmvNames);
+
+    return 0;
 }
 
 // ---------------------------------------------------------------------------
 // Method: CreateDMVFiles
 //
 // Description:
-//    This method creates the empty DMV files for a given server.
+//    This method creates the DMV files for a given server.
 //    The location of the files (as seen) is <MOUNT DIR>/<SERVER NAME>/. 
-//    Of course the files are actually getting created in the dump directory.
+//    The files only exist in the virtual tree.
 //
-//    The method requests the server for the list of DMV's and based on the
-//    version of the server - may or may not create the .json files. 
-//    Only for SQL Server 2016 (version 16) does the method create the .json.
+//    The DMVs were listed when the server was verified at startup, or read
+//    from the catalog cache. Based
+//    on the version of the server - the method may or may not create the
+//    .json files. Only for SQL Server 2016 (version 16) does the method
+//    create the .json.
 //
 //    This only happens at startup so no issue with synchronization.
 //
@@ -308,65 +403,22 @@ CreateCustomQueriesDir(
 //
 static void
 CreateDMVFiles(
-    const string& dumpDir,
-    const string& servername,
-    const string& hostname,
-    const string& username,
-    const string& password,
-    const int version)
+    const shared_ptr<VirtualNode>& serverDir,
+    const ServerInfo* serverInfo)
 {
-    string          dmvQuery;
-    string          filepath;
-    string          responseString;
-    int             error;
-    vector<string>  filenames;
-    int             numEntries;
-
-    // Query SQL server for all the DMV files to be created.
-    //
-    // ** Note **
-    // schema_id = 4 selects DMV's (leaves out INFORMATION_SCHEMA).
-    //
-    dmvQuery = "SELECT name from sys.system_views where schema_id = 4";
-    error = ExecuteQuery(dmvQuery, responseString, hostname,
-        username, password, TYPE_TSV);
-    if (error)
-    {
-        PrintMsg("Failed to query DMV list\n");
-    }
-    else
+    VirtualTree*    tree = GetVirtualTree();
+
+    for (const string& dmvName : serverInfo->m_dmvNames)
     {
-        // Tokenising response to extract DMV names.
+        // Create the regular file - TSV.
         //
-        filenames = Split(responseString, '\n');
+        tree->AddNode(serverDir, dmvName, NODE_DMV_FILE);
 
-        // On success, it will have at least two entries.
-        numEntries = filenames.size();
-        assert(numEntries > 1);
-
-        // We need to skip the first name because the result of the SQL Query
-        // includes the name of the column as well in the output.
-        // We do not want to create a file corresponding to the column name.
-        //
-        for (int i = 0; i < numEntries; i++)
+        if (serverInfo->m_version >= 16)
         {
-            if (i == 0)
-            {
-                continue;
-            }
-
-            // Create the regular file - TSV.
+            // Creating the json file.
             //
-            filepath = StringFormat("%s/%s", dumpDir.c_str(), filenames[i].c_str());
-            CreateFile(filepath.c_str());
-
-            if (version >= 16)
-            {
-                // Creating the json file.
-                //
-                filepath = StringFormat("%s.json", filepath.c_str());
-                CreateFile(filepath.c_str());
-            }
+            tree->AddNode(serverDir, dmvName + JSON_FILE_EXTENSION, NODE_DMV_JSON_FILE);
         }
     }
 }
@@ -375,10 +427,11 @@ CreateDMVFiles(
 // Method: CreateDbfsFiles
 //
 // Description:
-//    This method creates the empty DMV files and custom query files
-//    for a given server. The location of the files (as seen) is
-//    <MOUNT DIR>/<SERVER NAME>/. Of course the files are actually getting
-//    created in the dump directory.
+//    This method creates the DMV files and custom query files for a given
+//    server. The location of the files (as seen) is <MOUNT DIR>/<SERVER NAME>/.
+//    They are nodes of the virtual tree - no files are created on disk. 
+//    Only the server folder is created in the dump directory, to hold the
+//    scratch files users create next to the DMVs.
 //
 // Returns:
 //    VOID
@@ -386,24 +439,25 @@ CreateDMVFiles(
 void
 CreateDbfsFiles(
     const string& servername,
-    const string& hostname,
-    const string& username,
-    const string& password,
-    const int version)
+    const ServerInfo* serverInfo)
 {
-    string          fpath;
-    int             error;
+    string                  fpath;
+    int                     error;
+    shared_ptr<VirtualNode> serverDir;
 
     fpath = CalculateDumpPath(servername);
 
-    // Creating folder for this server's data.
+    // Creating folder for this server's scratch files.
     //
     error = mkdir(fpath.c_str(), DEFAULT_PERMISSIONS);
-    if (error == 0)
+    if (error == 0 || errno == EEXIST)
     {
-        CreateCustomQueriesDir(fpath, servername);
+        serverDir = GetVirtualTree()->AddNode(GetVirtualTree()->GetRoot(),
+                                              servername, NODE_DIRECTORY);
+
+        CreateCustomQueriesDir(serverDir, servername);
 
-        CreateDMVFiles(fpath, servername, hostname, username, password, version);
+        CreateDMVFiles(serverDir, serverInfo);
     }
     else
     {
@@ -47,13 +47,6 @@ GetServerDetails(
     string& username,
     string& password);
 
-// This method creates a file with write permissions. Or truncates to zero
-// if one already exists.
-//
-void
-CreateFile(
-    const char* path);
-
 // This checks if the file pointed to by the provided path is a
 // dbfs file (created by this tool).
 //
@@ -61,16 +54,55 @@ bool
 IsDbfsFile(
     const char* path);
 
-// This method creates the empty DMV files and custom query files for a given server.
+// This method creates the DMV files and custom query files for a given server.
 // The virtual location of the files (as seen) is <MOUNT DIR>/<SERVER NAME>/.
 //
 void
 CreateDbfsFiles(
     const string& servername,
+    const ServerInfo* serverInfo);
+
+// This method hashes the output of @@version of a server.
+//
+string
+HashServerVersion(
+    const string& version);
+
+// This method asks the server for its version, as a hash of @@version.
+//
+int
+FetchServerVersion(
+    const string& hostname,
+    const string& username,
+    const string& password,
+    string& versionHash);
+
+// Query listing the DMVs to create files for.
+//
+//  ** Note **
+//  schema_id = 4 selects DMV's (leaves out INFORMATION_SCHEMA).
+//
+#define SQLFS_DMV_NAMES_QUERY   "SELECT name from sys.system_views where schema_id = 4"
+
+// This method asks the server for the names of its DMVs.
+//
+int
+FetchDmvNames(
+    const string& hostname,
+    const string& username,
+    const string& password,
+    vector<string>& dmvNames);
+
+// This method asks the server for its version hash and the names of its
+// DMVs at once.
+//
+int
+FetchServerCatalog(
     const string& hostname,
     const string& username,
     const string& password,
-    const int version);
+    string& versionHash,
+    vector<string>& dmvNames);
 
 // This method exits the program and in doing so the function DestroySQLFs
 // is called.
@@ -11,6 +11,14 @@
 
 #include "UtilsPrivate.h"
 
+// Maximum number of servers verified at the same time at startup.
+//
+#define SQLFS_STARTUP_VERIFY_THREADS    16
+
+// TDS protocol version of all the connections to the servers.
+//
+#define SQLFS_TDS_VERSION               "8.0"
+
 // Global variable used to track entries of various paths and 
 //configuration file
 //
@@ -20,7 +28,9 @@ struct SQLFsPaths g_UserPaths;
 //
 bool g_InVerbose;
 
-// Global map used to track information for all the servers
+// Global map used to track information for all the servers. It is filled
+// in before FUSE starts and only read afterwards, so the FUSE and query
+// threads read it without locking.
 //
 std::unordered_map<std::string, class ServerInfo*> g_ServerInfoMap;
 
@@ -32,15 +42,31 @@ bool g_UseLogFile;
 //
 bool g_RunInForeground;
 
-// Value of extended attribute that specifies is this is a DMV file
-// created by the tool.
+// Global variable used to track if the kernel may cache the content of
+// the dbfs files.
 //
-// This will help decide if this is a DMV whose content
-// needs to be queried from the server.
+bool g_UsePageCache;
+
+// Global variable used to track if the servers are only contacted when
+// their directories are first used.
+//
+bool g_LazyMount;
+
+// Global variable used to track if the output of custom queries can be
+// read while they are still running.
+//
+bool g_StreamResults;
+
+// Global variable used to track the number of threads serving requests.
+// 1 runs FUSE single threaded, otherwise it is also the number of query
+// workers.
 //
-// This will just be an empty attribute set.
+int g_NumThreads = SQLFS_DEFAULT_QUERY_WORKERS;
+
+// Number of seconds DMV results are cached for servers which don't set
+// their own TTL.
 //
-char g_LocallyGeneratedFiles[] = "user.isCreatedByTool";
+static int s_DefaultCacheTTLSec = SQLFS_DEFAULT_CACHE_TTL_SEC;
 
 // ---------------------------------------------------------------------------
 // Method: PrintUsageAndExit
@@ -64,6 +90,11 @@ PrintUsageAndExit(
         "   -d/--dump-path      :  The dump directory used. Default = \"/tmp/sqlserver\" [OPTIONAL]\n"
         "   -v/--verbose        :  Start in verbose mode [OPTIONAL]\n"
         "   -l/--log-file       :  Path to the log file (only used if in verbose mode) [OPTIONAL]\n"
+        "   -t/--cache-ttl      :  Seconds DMV results are served from memory. Default = 0 (off) [OPTIONAL]\n"
+        "   -k/--page-cache     :  Let the kernel cache unchanged DMV content [OPTIONAL]\n"
+        "   -j/--threads        :  Threads serving requests, 1 = single threaded. Default = 4 [OPTIONAL]\n"
+        "   -z/--lazy           :  Mount without contacting the servers, list their DMVs on first use [OPTIONAL]\n"
+        "   -s/--stream         :  Let custom query output be read while the query is running [OPTIONAL]\n"
         "   -f                  :  Run DBFS in foreground [OPTIONAL]\n"
         "   -h                  :  Print usage"
         "\n", command);
@@ -80,6 +111,11 @@ static struct option long_options[] =
     { "dump-path",          required_argument,          0,  'd' },
     { "verbose",            required_argument,          0,  'v' },
     { "log-file",           required_argument,          0,  'l' },
+    { "cache-ttl",          required_argument,          0,  't' },
+    { "page-cache",         no_argument,                0,  'k' },
+    { "threads",            required_argument,          0,  'j' },
+    { "lazy",               no_argument,                0,  'z' },
+    { "stream",             no_argument,                0,  's' },
     { 0,                    0,                          0,   0 }
 };
 
@@ -166,7 +202,7 @@ ParseArguments(
     while (status)
     {
         idx = 0;
-        option = getopt_long(argc, argv, "m:c:d:hvfl:", long_options, &idx);
+        option = getopt_long(argc, argv, "m:c:d:hvfl:t:kj:zs", long_options, &idx);
 
         if (option == -1)
         {
@@ -218,6 +254,28 @@ ParseArguments(
             g_RunInForeground = true;
             break;
 
+        case 'k':
+            g_UsePageCache = true;
+            break;
+
+        case 'j':
+            g_NumThreads = atoi(optarg);
+            if (g_NumThreads < 1 || g_NumThreads > SQLFS_MAX_QUERY_WORKERS)
+            {
+                fprintf(stderr, "ERROR - Number of threads must be between 1 and %d\n",
+                    SQLFS_MAX_QUERY_WORKERS);
+                status = false;
+            }
+            break;
+
+        case 'z':
+            g_LazyMount = true;
+            break;
+
+        case 's':
+            g_StreamResults = true;
+            break;
+
         case 'l':
             tempPtr = realpath(optarg, NULL);
             if (tempPtr)
@@ -228,6 +286,14 @@ ParseArguments(
             }
             break;
 
+        case 't':
+            if (!convertToInt(optarg, s_DefaultCacheTTLSec) || s_DefaultCacheTTLSec < 0)
+            {
+                fprintf(stderr, "ERROR - Cache TTL must be a number of seconds, 0 or more\n");
+                status = false;
+            }
+            break;
+
         default:
             fprintf(stderr, "ERROR - Unknown argument passed - %c\n", option);
             status = false;
@@ -422,37 +488,6 @@ ParseSectionEntry(
     return status;
 }
 
-// ---------------------------------------------------------------------------
-// Method: convertToInt
-//
-// Description:
-//    This method interprets the integer value of the provided string.
-//
-// Returns:
-//    bool
-//
-static bool
-convertToInt(
-    string str,
-    int& intVal)
-{
-    bool status = true;
-
-    try
-    {
-        intVal = stoi(str);
-    }
-    // stoi may throw std::invalid_argument or std::out_of_range
-    //
-    catch (exception& e)
-    {
-        PrintMsg("Unable to convert string to int. Exception: %s\n", e.what());
-        status = false;
-    }
-
-    return status;
-}
-
 // ---------------------------------------------------------------------------
 // Method: QueryUserForPassword
 //
@@ -507,6 +542,98 @@ QueryUserForPassword(
     return status;
 }
 
+// A configuration file section waiting to be verified.
+//
+struct PendingServer
+{
+    string      m_serverName;
+    ServerInfo* m_serverInfo;
+    bool        m_verified;
+};
+
+// ---------------------------------------------------------------------------
+// Method: VerifyServers
+//
+// Description:
+//    This method logs in to the servers and lists their DMVs. Each login
+//    can take up to the login timeout, so the servers are handled by a
+//    bounded number of threads at the same time. The DMVs are listed on
+//    the connection the verification left in the pool, and the list is
+//    cached under the version the verification query returned.
+//
+//    Every server is logged in to, so that bad credentials are caught
+//    whether or not its DMV list is cached. The catalog cache only saves
+//    listing the DMVs again, when the list was stored under the version
+//    the server has now.
+//
+//    The threads are done before FUSE starts (and daemonizes).
+//
+// Returns:
+//    VOID
+//
+static void
+VerifyServers(
+    vector<PendingServer>& servers)
+{
+    std::atomic<size_t> next(0);
+    vector<thread>      threads;
+    size_t              numThreads;
+
+    auto verify = [&servers, &next]()
+    {
+        size_t idx;
+        string version;
+        string cachedVersion;
+
+        while ((idx = next++) < servers.size())
+        {
+            ServerInfo* serverInfo = servers[idx].m_serverInfo;
+
+            servers[idx].m_verified = VerifyServerInfo(serverInfo->m_hostname,
+                serverInfo->m_username, serverInfo->m_password, version);
+
+            if (servers[idx].m_verified)
+            {
+                serverInfo->m_catalogVersion = HashServerVersion(version);
+
+                if (LoadCachedCatalog(*serverInfo, cachedVersion, serverInfo->m_dmvNames) &&
+                    cachedVersion == serverInfo->m_catalogVersion)
+                {
+                    continue;
+                }
+
+                if (FetchDmvNames(serverInfo->m_hostname, serverInfo->m_username,
+                                  serverInfo->m_password, serverInfo->m_dmvNames))
+                {
+                    PrintMsg("Failed to query DMV list of server %s\n",
+                        servers[idx].m_serverName.c_str());
+                }
+                else
+                {
+                    StoreCachedCatalog(*serverInfo, serverInfo->m_catalogVersion,
+                                       serverInfo->m_dmvNames);
+                }
+            }
+        }
+    };
+
+    numThreads = min(servers.size(), (size_t)SQLFS_STARTUP_VERIFY_THREADS);
+
+    for (size_t i = 1; i < numThreads; i++)
+    {
+        threads.emplace_back(verify);
+    }
+
+    // The calling thread takes its share too.
+    //
+    verify();
+
+    for (thread& verifyThread : threads)
+    {
+        verifyThread.join();
+    }
+}
+
 // ---------------------------------------------------------------------------
 // Method: ParseConfigFile
 //
@@ -520,6 +647,11 @@ QueryUserForPassword(
 //    username=<>
 //    password=<>
 //    version=<>
+//    customQueriesPath=<>        (optional)
+//    connectionPoolSize=<>       (optional)
+//    connectionIdleTimeout=<>    (optional, in seconds)
+//    cacheTTL=<>                 (optional, in seconds)
+//    dmvCacheTTL=<dmv>:<>,...    (optional, in seconds)
 //
 //    All entries must be under a [server] block
 //
@@ -548,9 +680,18 @@ ParseConfigFile(void)
     string          password;    
     string          version;
     string          customQueriesPath;
+    string          poolSize;
+    string          poolIdleTimeout;
+    string          cacheTTL;
+    string          dmvCacheTTL;
     int             versionInt;
+    int             poolSizeInt;
+    int             poolIdleTimeoutInt;
+    int             cacheTTLInt;
+    unordered_map<string, int> dmvCacheTTLs;
     int             itrNum = 0;
     map<std::string, SectionNameValuePair>::iterator sectionItr;
+    vector<PendingServer> pendingServers;
     bool status;
 
     ini.LoadFile(g_UserPaths.m_confPath);
@@ -621,33 +762,63 @@ ParseConfigFile(void)
                 }
             }
 
-            // Check if the credentials and/or IP are correct
-            //
             if (status)
             {
-                status = VerifyServerInfo(hostname, username, password);
+                poolSizeInt = SQLFS_DEFAULT_POOL_SIZE;
+                status = ParseSectionEntry(sectionItr, "connectionPoolSize", poolSize, true);
+                if (status && !poolSize.empty())
+                {
+                    status = convertToInt(poolSize, poolSizeInt) && poolSizeInt > 0;
+                }
+            }
+            if (status)
+            {
+                poolIdleTimeoutInt = SQLFS_DEFAULT_POOL_IDLE_TIMEOUT_SEC;
+                status = ParseSectionEntry(sectionItr, "connectionIdleTimeout", poolIdleTimeout, true);
+                if (status && !poolIdleTimeout.empty())
+                {
+                    status = convertToInt(poolIdleTimeout, poolIdleTimeoutInt) && poolIdleTimeoutInt >= 0;
+                }
+            }
+
+            if (status)
+            {
+                cacheTTLInt = s_DefaultCacheTTLSec;
+                status = ParseSectionEntry(sectionItr, "cacheTTL", cacheTTL, true);
+                if (status && !cacheTTL.empty())
+                {
+                    status = convertToInt(cacheTTL, cacheTTLInt) && cacheTTLInt >= 0;
+                }
+            }
+            if (status)
+            {
+                dmvCacheTTLs.clear();
+                status = ParseSectionEntry(sectionItr, "dmvCacheTTL", dmvCacheTTL, true);
+                if (status && !dmvCacheTTL.empty())
+                {
+                    status = ParseDmvCacheTTLs(dmvCacheTTL, dmvCacheTTLs);
+                }
             }
 
-            // Record this entry
+            // Keep this entry until the credentials and/or IP are verified
             //
             if (status)
             {
+                ConfigureConnectionPool(hostname, username, password,
+                                        poolSizeInt, poolIdleTimeoutInt);
+
                 serverInfoEntry = new ServerInfo();
                 assert(serverInfoEntry);
 
-                PrintMsg("SUCCESSFULLY added entry for server %s.\n", serverName.c_str());
+                pendingServers.push_back({ serverName, serverInfoEntry, false });
 
-                // Adding entry to the global server information map
-                //
-                g_ServerInfoMap.insert(make_pair(serverName, serverInfoEntry));
-
-                // Fill in the global map with server information.
-                //
                 serverInfoEntry->m_hostname = hostname;
                 serverInfoEntry->m_username = username;
                 serverInfoEntry->m_password = password;
                 serverInfoEntry->m_version = versionInt;
                 serverInfoEntry->m_customQueriesPath = customQueriesPath;
+                serverInfoEntry->m_cacheTTLSec = cacheTTLInt;
+                serverInfoEntry->m_dmvCacheTTLSec = dmvCacheTTLs;
             }
             else
             {
@@ -656,6 +827,41 @@ ParseConfigFile(void)
         }
     }
 
+    // Check if the credentials and/or IP are correct. With --lazy the
+    // servers are only contacted when their directories are first used.
+    //
+    if (g_LazyMount)
+    {
+        for (PendingServer& pending : pendingServers)
+        {
+            pending.m_verified = true;
+        }
+    }
+    else
+    {
+        VerifyServers(pendingServers);
+    }
+
+    // Record the verified entries
+    //
+    for (PendingServer& pending : pendingServers)
+    {
+        if (pending.m_verified)
+        {
+            PrintMsg("SUCCESSFULLY added entry for server %s.\n", pending.m_serverName.c_str());
+
+            // Adding entry to the global server information map
+            //
+            g_ServerInfoMap.insert(make_pair(pending.m_serverName, pending.m_serverInfo));
+        }
+        else
+        {
+            PrintMsg("FAILED to add entry for server %s. Ignoring it.\n", pending.m_serverName.c_str());
+
+            delete pending.m_serverInfo;
+        }
+    }
+
     // Return false only if there were no entries added to the global server information map
     //
     if (g_ServerInfoMap.size())
@@ -778,6 +984,23 @@ main(
         }
     }
 
+    // DB-Library is initialized once for the whole process, before
+    // any server is contacted. The TDS version is set first - the
+    // connections made to verify the servers are kept in the pools and
+    // used for the queries later on.
+    //
+    if (!result)
+    {
+        result = setenv("TDSVER", SQLFS_TDS_VERSION, 1);
+        assert(!result);
+
+        if (!InitializeDBLibrary())
+        {
+            fprintf(stderr, "Unable to initialize DB-Library.\n");
+            result = -1;
+        }
+    }
+
     if (!result)
     {
         status = ParseConfigFile();
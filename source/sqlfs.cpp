@@ -8,16 +8,107 @@
 //   This file contains definitions of functions used by the FUSE
 //   module for various filesystem operations. 
 //
+//   This is the backend on the high-level libfuse 2 API. Building with
+//   DBFS_USE_FUSE3_LOWLEVEL replaces it with the one in FuseLowLevel.cpp.
 //
+#ifndef DBFS_USE_FUSE3_LOWLEVEL
+
 #define FUSE_USE_VERSION 26
 
 #include "UtilsPrivate.h"
 
+// ---------------------------------------------------------------------------
+// Method: GetFileHandle
+//
+// Description:
+//    This method returns the state of an open file.
+//
+// Returns:
+//    Pointer to the FileHandle stored by OpenLocalImpl.
+//
+static inline FileHandle*
+GetFileHandle(
+    struct fuse_file_info* fi)
+{
+    return (FileHandle*)(uintptr_t)fi->fh;
+}
+
+// ---------------------------------------------------------------------------
+// Method: IsVirtualPath
+//
+// Description:
+//    This method checks if the path is a node of the virtual tree rather
+//    than a file in the dump directory.
+//
+// Returns:
+//    bool
+//
+static bool
+IsVirtualPath(
+    const char* path)
+{
+    return GetVirtualTree()->Contains(path);
+}
+
+// ---------------------------------------------------------------------------
+// Method: LookupVirtualNode
+//
+// Description:
+//    This method finds the node of the virtual tree at the path. A call of
+//    a parameterized custom query is looked up through the query, which
+//    creates it if it isn't there - the first time, after it was dropped
+//    to make room for other calls, or when its arguments are not given the
+//    way the call is listed.
+//
+// Returns:
+//    The node or NULL if the path is not virtual.
+//
+static shared_ptr<VirtualNode>
+LookupVirtualNode(
+    const char* path)
+{
+    shared_ptr<VirtualNode> node;
+    Route                   route;
+
+    node = GetVirtualTree()->Lookup(path);
+    if (node)
+    {
+        return node;
+    }
+
+    ParseRoute(path, route);
+    if (route.m_type == ROUTE_CUSTOM_QUERY_CALL)
+    {
+        node = GetVirtualTree()->Lookup(string(path, route.m_name.m_data - 1 - path).c_str());
+        node = node ? LookupCustomQueryCall(node, route.m_name.ToString().c_str()) : nullptr;
+    }
+
+    return node;
+}
+
+// ---------------------------------------------------------------------------
+// Method: GetDirHandle
+//
+// Description:
+//    This method returns the state of an open directory.
+//
+// Returns:
+//    Pointer to the DirHandle stored by OpendirLocalImpl.
+//
+static inline DirHandle*
+GetDirHandle(
+    struct fuse_file_info* fi)
+{
+    return (DirHandle*)(uintptr_t)fi->fh;
+}
+
 // ---------------------------------------------------------------------------
 // Method: GetattrLocalImpl
 //
 // Description:
-//    This method redirects the getattr system call to the dump directory.
+//    This method answers the getattr system call from memory for the
+//    virtual nodes and redirects it to the dump directory for all other
+//    files.
 //
 // Returns:
 //    0 on success and -errno on error.
@@ -27,8 +118,27 @@ GetattrLocalImpl(
     const char* path,
     struct stat* stbuf)
 {
-    int     result;
-    string  fpath;
+    int                     result;
+    string                  fpath;
+    shared_ptr<VirtualNode> node;
+    Route                   route;
+
+    ParseRoute(path, route);
+
+    // With --lazy, looking up a file of a server lists its DMVs first.
+    // The custom queries don't need them.
+    //
+    if (g_LazyMount && route.m_type == ROUTE_SERVER_FILE)
+    {
+        LoadServerCatalog(route.m_server.ToString());
+    }
+
+    node = LookupVirtualNode(path);
+    if (node)
+    {
+        GetVirtualTree()->GetAttributes(node, *stbuf);
+        return 0;
+    }
 
     fpath = CalculateDumpPath(path);
     result = lstat(fpath.c_str(), stbuf);
@@ -43,6 +153,50 @@ GetattrLocalImpl(
     return result;
 }
 
+// ---------------------------------------------------------------------------
+// Method: FgetattrLocalImpl
+//
+// Description:
+//    This method redirects the fgetattr system call to the open file in the
+//    dump directory. The attributes of a dbfs file come from its node and
+//    its size is the size of its snapshot.
+//
+// Returns:
+//    0 on success and -errno on error.
+//
+static int
+FgetattrLocalImpl(
+    const char* path,
+    struct stat* stbuf,
+    struct fuse_file_info* fi)
+{
+    int         result;
+    FileHandle* handle = GetFileHandle(fi);
+
+    // dbfs files have no descriptor - their attributes are in the node.
+    //
+    if (handle->m_node)
+    {
+        GetVirtualTree()->GetAttributes(handle->m_node, *stbuf);
+        result = 0;
+    }
+    else
+    {
+        result = fstat(handle->m_fd, stbuf);
+        if (result == -1)
+        {
+            return ReturnErrnoAndPrintError(__FUNCTION__, "fstat failed");
+        }
+    }
+
+    if (handle->m_snapshot)
+    {
+        stbuf->st_size = handle->m_snapshot->GetSize();
+    }
+
+    return result;
+}
+
 // ---------------------------------------------------------------------------
 // Method: AccessLocalImpl
 //
@@ -57,8 +211,17 @@ AccessLocalImpl(
     const char* path,
     int mask)
 {
-    int     result;
-    string  fpath;
+    int                     result;
+    string                  fpath;
+    shared_ptr<VirtualNode> node;
+
+    // Virtual files are read only, virtual directories are open to all.
+    //
+    node = LookupVirtualNode(path);
+    if (node)
+    {
+        return ((mask & W_OK) && node->IsFile()) ? -EACCES : 0;
+    }
 
     fpath = CalculateDumpPath(path);
     result = access(fpath.c_str(), mask);
@@ -87,6 +250,13 @@ ReadlinkLocalImpl(
     int     result;
     string  fpath;
 
+    // None of the virtual nodes is a link.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EINVAL;
+    }
+
     fpath = CalculateDumpPath(path);
     result = readlink(fpath.c_str(), buf, size - 1);
     if (result == -1)
@@ -101,16 +271,15 @@ ReadlinkLocalImpl(
 }
 
 // ---------------------------------------------------------------------------
-// Method: ReaddirLocalImpl
+// Method: OpendirLocalImpl
 //
 // Description:
 //    This method redirects the opendir system call to the dump directory.
-//    If this is opening a custom query directory, it will 
-//    1. Delete all the previous files in custom query dump directory. 
-//       To ensure that if there is a query file is removed or added, 
-//       it will be reflected properly.
-//    2. Iterate the user custom query directory and create output files
-//       with the same name as the query file at custom query dump directory. 
+//    A virtual directory is listed from memory, merged with the scratch
+//    files users have put into its counterpart in the dump directory.
+//    If this is opening a custom query directory which the watcher doesn't
+//    keep up to date, it will refresh its files so that a query file which
+//    is added or removed is reflected properly.
 //
 // Returns:
 //    0 on success and -errno on error.
@@ -121,53 +290,53 @@ OpendirLocalImpl(
     struct fuse_file_info* fi)
 {
     int             failed = 0;
-    DIR*            dp;
+    DirHandle*      handle;
     string          fpath;
-    vector<string>  tokens;
-    string          servername;
-    string          userQueriesPath;
-    string          filepath;
+    Route           route;
     
-    fpath = CalculateDumpPath(path);
-    dp = opendir(fpath.c_str());
-    if (dp != NULL)
+    handle = new DirHandle();
+    handle->m_node = GetVirtualTree()->Lookup(path);
+
+    if (handle->m_node && handle->m_node->IsFile())
     {
-        // Save file handle for use in readdir and releasedir
-        //
-        fi->fh = (uint64_t)(dp);
+        delete handle;
+        fi->fh = 0;
+        return -ENOTDIR;
+    }
 
-        // If this is a custom query dir, populate dump path with custom query 
-        // output files so that readdir can list the files.
-        //
-        if (strstr(path, CUSTOM_QUERY_FOLDER_NAME))
-        {
-            RemoveCustomQueriesOutputFiles(dp, fpath);            
-
-            // Need to rewind the directory point to the begining for readdir.
-            //
-            rewinddir(dp);
-
-            // Tokenising the path.
-            //
-            tokens = Split(path, '/');
-        
-            // Path is of the form <servername>/<filename>
-            // On success, there will be more than 1 token.
-            //
-            assert(tokens.size() > 1);
-        
-            servername = tokens[0];
-            assert(strcmp(tokens[1].c_str(), CUSTOM_QUERY_FOLDER_NAME) == 0);
-
-            CreateCustomQueriesOutputFiles(servername, fpath);            
-        }
+    // If this is a custom query dir which is not watched, update its files
+    // so that readdir lists the current query files.
+    //
+    ParseRoute(path, route);
+    if (handle->m_node && route.m_type == ROUTE_CUSTOM_QUERY_DIR &&
+        !IsCustomQueryDirWatched(handle->m_node->m_servername))
+    {
+        RefreshCustomQueryFiles(handle->m_node->m_servername, handle->m_node);
     }
-    else
+
+    // With --lazy, the DMVs of a server are listed when its directory is
+    // first listed.
+    //
+    if (g_LazyMount && handle->m_node && route.m_type == ROUTE_SERVER)
+    {
+        LoadServerCatalog(handle->m_node->m_servername);
+    }
+
+    // A virtual directory doesn't need a counterpart in the dump directory.
+    //
+    fpath = CalculateDumpPath(path);
+    handle->m_dp = opendir(fpath.c_str());
+    if (!handle->m_dp && !handle->m_node)
     {
         failed = ReturnErrnoAndPrintError(__FUNCTION__, "opendir failed");
-        fi->fh = 0;
+        delete handle;
+        handle = NULL;
     }
 
+    // Save the handle for use in readdir and releasedir
+    //
+    fi->fh = (uintptr_t)handle;
+
     return failed;
 }
 
@@ -175,7 +344,9 @@ OpendirLocalImpl(
 // Method: ReaddirLocalImpl
 //
 // Description:
-//    This method redirects the readdir system call to the dump directory.
+//    This method lists the entries of a virtual directory followed by the
+//    files in the dump directory. Files in the dump directory with the name
+//    of a virtual entry are hidden by it.
 //
 // Returns:
 //    0 on success and -errno on error.
@@ -188,25 +359,58 @@ ReaddirLocalImpl(
     off_t offset,
     struct fuse_file_info* fi)
 {
-    DIR*            dp;
+    DirHandle*      handle;
     struct dirent*  de;
-    string          fpath;
     struct stat     st;
+    struct stat     dirStat;
     int             result = 0;
+    vector<pair<string, struct stat>> entries;
+    set<string>     virtualNames;
 
+    (void)path;
     (void)offset;
-    (void)fi;
 
-    dp = (DIR*)fi->fh;
-    if (dp == NULL)
+    handle = GetDirHandle(fi);
+    if (handle == NULL)
+    {
+        return -EBADF;
+    }
+
+    if (handle->m_node)
     {
-        result = ReturnErrnoAndPrintError(__FUNCTION__, "opendir failed");
+        // The attributes of the directory change along with its entries,
+        // so they are only read under the lock of the tree.
+        //
+        GetVirtualTree()->GetAttributes(handle->m_node, dirStat);
+        GetVirtualTree()->ListChildren(handle->m_node, entries);
+
+        if (filler(buf, ".", &dirStat, 0) ||
+            filler(buf, "..", NULL, 0))
+        {
+            return result;
+        }
+
+        for (auto&& entry : entries)
+        {
+            if (filler(buf, entry.first.c_str(), &entry.second, 0))
+            {
+                return result;
+            }
+            virtualNames.insert(entry.first);
+        }
     }
 
-    if (!result)
+    if (handle->m_dp)
     {
-        while ((de = readdir(dp)) != NULL)
+        while ((de = readdir(handle->m_dp)) != NULL)
         {
+            if (handle->m_node &&
+                (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+                 virtualNames.count(de->d_name)))
+            {
+                continue;
+            }
+
             memset(&st, 0, sizeof(st));
             st.st_ino = de->d_ino;
             st.st_mode = de->d_type << 12;
@@ -221,7 +425,8 @@ ReaddirLocalImpl(
 // Method: ReleasedirLocalImpl
 //
 // Description:
-//    This method redirects the readdir system call to the dump directory.
+//    This method closes the directory in the dump directory, if one was
+//    opened, and frees the handle.
 //
 // Returns:
 //    0 on success and -errno on error.
@@ -232,12 +437,16 @@ ReleasedirLocalImpl(
     struct fuse_file_info* fi)
 {
     int             error = 0;
-    DIR*            dp;
+    DirHandle*      handle;
 
-    dp = (DIR*)fi->fh;
-    if (dp != NULL)
+    handle = GetDirHandle(fi);
+    if (handle != NULL)
     {
-        error = closedir(dp);
+        if (handle->m_dp)
+        {
+            error = closedir(handle->m_dp);
+        }
+        delete handle;
     }
 
     return error;
@@ -261,6 +470,11 @@ MknodLocalImpl(
     int     result;
     string  fpath;
 
+    if (IsVirtualPath(path))
+    {
+        return -EEXIST;
+    }
+
     fpath = CalculateDumpPath(path);
     if (S_ISREG(mode))
     {
@@ -314,6 +528,11 @@ MkdirLocalImpl(
     int     result;
     string  fpath;
 
+    if (IsVirtualPath(path))
+    {
+        return -EEXIST;
+    }
+
     fpath = CalculateDumpPath(path);
     result = mkdir(fpath.c_str(), mode);
     if (result == -1)
@@ -339,6 +558,13 @@ UnlinkLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes can't be changed.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EPERM;
+    }
+
     fpath = CalculateDumpPath(path);
     result = unlink(fpath.c_str());
     if (result == -1)
@@ -364,6 +590,13 @@ RmdirLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes can't be changed.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EPERM;
+    }
+
     fpath = CalculateDumpPath(path);
     result = rmdir(fpath.c_str());
     if (result == -1)
@@ -391,6 +624,11 @@ SymlinkLocalImpl(
     string  fpath;
     string  tpath;
 
+    if (IsVirtualPath(to))
+    {
+        return -EEXIST;
+    }
+
     fpath = CalculateDumpPath(from);
     tpath = CalculateDumpPath(to);
     result = symlink(fpath.c_str(), tpath.c_str());
@@ -419,6 +657,13 @@ RenameLocalImpl(
     string  fpath;
     string  tpath;
 
+    // The virtual nodes can't be moved or replaced.
+    //
+    if (IsVirtualPath(from) || IsVirtualPath(to))
+    {
+        return -EPERM;
+    }
+
     fpath = CalculateDumpPath(from);
     tpath = CalculateDumpPath(to);
     result = rename(fpath.c_str(), tpath.c_str());
@@ -447,6 +692,17 @@ LinkLocalImpl(
     string  fpath;
     string  tpath;
 
+    // Virtual files have no inode to link to.
+    //
+    if (IsVirtualPath(from))
+    {
+        return -EPERM;
+    }
+    if (IsVirtualPath(to))
+    {
+        return -EEXIST;
+    }
+
     fpath = CalculateDumpPath(from);
     tpath = CalculateDumpPath(to);
     result = link(fpath.c_str(), tpath.c_str());
@@ -474,6 +730,13 @@ ChmodLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes can't be changed.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EPERM;
+    }
+
     fpath = CalculateDumpPath(path);
     result = chmod(fpath.c_str(), mode);
     if (result == -1)
@@ -501,6 +764,13 @@ ChownLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes can't be changed.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EPERM;
+    }
+
     fpath = CalculateDumpPath(path);
     result = lchown(fpath.c_str(), username, gid);
     if (result == -1)
@@ -527,6 +797,13 @@ TruncateLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes can't be changed.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EPERM;
+    }
+
     fpath = CalculateDumpPath(path);
     result = truncate(fpath.c_str(), size);
     if (result == -1)
@@ -553,6 +830,13 @@ UtimensLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes can't be changed.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EPERM;
+    }
+
     fpath = CalculateDumpPath(path);
     // Not using utime/utimes since they follow symlinks.
     //
@@ -597,7 +881,7 @@ GetFileDescriptorForPath(
     }
     else
     {
-        fd = fi->fh;
+        fd = GetFileHandle(fi)->m_fd;
     }
 }
 
@@ -628,18 +912,23 @@ CloseFileDesciptorIfOpened(
 }
 
 // ---------------------------------------------------------------------------
-// Method: GetDmvFileContent
+// Method: OpenLocalImpl
 //
 // Description:
-//    This function is responsible for filling the file(DMV) being opened 
-//    with the content of that DMV from the appropriate server and form. 
-//
-//    The path contains the name of the server and the DMV (along with
-//    the extension. This information is extracted from the  path and an 
-//    appropriate SQL query is sent to the required server. The response of 
-//    the SQL Query is saved into the file.
+//    This method implements the open system call in the following manner:
+//    1. It will redirect the open system call to the dump directory (unless
+//       this is a dbfs file, which only exists in memory) and save a
+//       FileHandle with the file descriptor in the fuse_file_info pointer
+//       passed in.
+//    2. If this is a DMV - it will also query the server for the content.
+//    3. If this is a custom query file, it will run the query. With
+//       --stream it only starts it and the handle reads the output as it
+//       arrives, sharing it with the other opens while the query runs.
+//    The output of the queries is kept in a snapshot owned by the handle,
+//    so every open handle reads its own, unchanging content.
 //
-//    path - relative path from the mount directory
+//    The kind of file is taken from its node, which is looked up once
+//    and kept in the handle for the later calls on it.
 //
 // Returns:
 //    0 on success, 
@@ -647,243 +936,272 @@ CloseFileDesciptorIfOpened(
 //    -1 on internal error.
 //
 static int
-GetDmvFileContent(
-    string path)
+OpenLocalImpl(
+    const char* path,
+    struct fuse_file_info* fi)
 {
-    int                 error = 0;
-    vector<string>      tokens;
-    string              filename;
-    string              query;
-    string              servername;
-    string              hostname;
-    string              username;
-    string              password;
-    enum FileFormat     type;
-    string              responseString;
-    string              tempString1;
-    string              tempString2;
-    string              dumpPath;
-    int                 fd;
-
-    dumpPath = CalculateDumpPath(path);
-
-    // Open the file.
-    //
-    fd = open(dumpPath.c_str(), O_WRONLY);
-    if (fd != -1)
+    int                     error = 0;
+    int                     fd = -1;
+    string                  fpath;
+    FileHandle*             handle = NULL;
+    shared_ptr<VirtualNode> node;
+    bool                    unchanged;
+
+    node = LookupVirtualNode(path);
+    if (node && !node->IsFile())
     {
-        // Extract SQL server name, DMV name and type
-        // Tokenising the path.
-        //
-        tokens = Split(path, '/');
-
-        // path is of the form <servername>/<filename>
-        // On success, there will be more than 1 token.
-        //
-        assert(tokens.size() > 1);
-
-        servername = tokens[0];
-        filename = tokens[1];
-
-        // Now we have the filename - check if it's a JSON
-        // We can also check from version but need to extract the
-        // the file name in any case.
-        //
-        size_t found = filename.find(".json");
+        return -EISDIR;
+    }
 
-        if (found != string::npos)
+    // dbfs files only exist in memory and are read only.
+    //
+    if (node)
+    {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
         {
-            // Removing the .json from the filename.
-            //
-            filename = filename.substr(0, found);
-            type = TYPE_JSON;
-            tempString1 = "SELECT * FROM [master].[sys].[";
-            tempString2 = "] FOR JSON AUTO, ROOT('info')";
+            error = -EACCES;
         }
-        else
+    }
+    else
+    {
+        // Open the file.
+        //
+        fpath = CalculateDumpPath(path);
+        fd = open(fpath.c_str(), fi->flags);
+        if (fd == -1)
         {
-            type = TYPE_TSV;
-            tempString1 = "SELECT * FROM [master].[sys].[";
-            tempString2 = "]";
+            error = ReturnErrnoAndPrintError(__FUNCTION__, "open failed");
         }
+    }
 
-        query = tempString1 + filename + tempString2;
-
-        // Fetch the details for the server.
+    if (!error)
+    {
+        // Save fd for later use.
         //
-        GetServerDetails(servername, hostname, username, password);
+        handle = new FileHandle();
+        handle->m_fd = fd;
+        handle->m_node = node;
+        fi->fh = (uintptr_t)handle;
+    }
 
-        error = ExecuteQuery(query, responseString, hostname,
-                                username, password, type);
+    // For dbfs file, fetch the content. With --stream the query of a
+    // custom query file only has to have started.
+    //
+    if (!error && node &&
+        (g_StreamResults ?
+         StreamDbfsFileContent(node, handle->m_snapshot, handle->m_stream) :
+         FetchDbfsFileContent(node, handle->m_snapshot)))
+    {
+        error = -EIO;
+    }
 
-        if (!error)
-        {
-            // File was already opened and it's file descriptor saved for use.
-            //
-            if (pwrite(fd, responseString.c_str(), responseString.length(), 0) == -1)
-            {
-                error = ReturnErrnoAndPrintError(__FUNCTION__, "pwrite failed");
-            }
-        }
-        else
+    // The size of the output of a query still running isn't known, so the
+    // kernel must pass on reads past the size reported for the file.
+    //
+    if (!error && handle->m_stream)
+    {
+        fi->direct_io = 1;
+    }
+
+    // The size reported for the file is the size of its latest content.
+    // In page cache mode the kernel keeps the pages it has cached as long
+    // as the content hasn't changed - otherwise it drops them on open.
+    //
+    if (!error && handle->m_snapshot)
+    {
+        unchanged = GetVirtualTree()->UpdateContent(node, handle->m_snapshot);
+        if (g_UsePageCache)
         {
-            PrintMsg("Querying the SQL failed. error = %d\n", error);
+            fi->keep_cache = unchanged;
         }
-        
-        close(fd);
     }
-    else
+
+    if (error && handle)
     {
-        error = ReturnErrnoAndPrintError(__FUNCTION__, "open failed");
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        delete handle;
+        fi->fh = 0;
     }
 
-
     return error;
 }
 
 // ---------------------------------------------------------------------------
-// Method: OpenLocalImpl
+// Method: ReadLocalImpl
 //
 // Description:
-//    This method implements the open system call in the following manner:
-//    1. It will redirect the open system call to the dump directory and save
-//       file description in the fuse_file_info pointer passed in.
-//    2. If this is a DMV - it will also query the server for the content.
-//    3. If this is a custom query file, it will run the query and save
-//       the result to the output file in the dump directory
+//    This method serves the read system call from the snapshot of a dbfs
+//    file and redirects it to the dump directory for all other files.
 //
 // Returns:
-//    0 on success, 
-//    -errno if a system call failed,
-//    -1 on internal error.
+//    0 on success and -errno on error.
 //
 static int
-OpenLocalImpl(
+ReadLocalImpl(
     const char* path,
+    char* buf,
+    size_t size,
+    off_t offset,
     struct fuse_file_info* fi)
 {
-    int error = 0;
-    int fd;
-    string fpath;
-    vector<string>      tokens;
-    string servername;
-    string filename;
-    string userQueriesPath;
-    string queryFilePath;
-    ServerInfo* serverInfo;
+    int fd = 0;
+    int result = -1;
 
-    fpath = CalculateDumpPath(path);
-    // Open the file.
+    // The content of dbfs files is in memory.
     //
-    fd = open(fpath.c_str(), fi->flags);
-    if (fd == -1)
+    if (fi && GetFileHandle(fi)->m_snapshot)
     {
-        error = ReturnErrnoAndPrintError(__FUNCTION__, "open failed");
+        return GetFileHandle(fi)->m_snapshot->Read(buf, size, offset);
     }
-    else
+
+    // The output of a query still running is waited for.
+    //
+    if (fi && GetFileHandle(fi)->m_stream)
     {
-        // Save fd for later use.
-        //
-        fi->fh = fd;
+        return GetFileHandle(fi)->m_stream->Read(buf, size, offset);
     }
 
-    if (!error)
+    // A dbfs file whose query failed is empty.
+    //
+    if (fi && GetFileHandle(fi)->m_fd == -1)
     {
-        // For dbfs file, fetch the content.
-        //
-        if (IsDbfsFile(path))
-        {
-            if (strstr(path, CUSTOM_QUERY_FOLDER_NAME))
-            {
-                // Tokenising the path.
-                //
-                tokens = Split(path, '/');
-                
-                // Path is of the form <servername>/<customQueries>/<filename>
-                // On success, there will be more than 1 token.
-                //
-                assert(tokens.size() > 1);
-            
-                servername = tokens[0];
-                filename = tokens[2];
-                assert(strcmp(tokens[1].c_str(), CUSTOM_QUERY_FOLDER_NAME) == 0);
-
-                // Get the path to the custom query directory user specified.
-                //
-                serverInfo = GetServerInfo(servername);
-                if (serverInfo)
-                {
-                    userQueriesPath = serverInfo->m_customQueriesPath;
-
-                    if (!userQueriesPath.empty())
-                    {
-                        // Construct the full path name to the query file
-                        //
-                        queryFilePath = StringFormat("%s/%s", userQueriesPath.c_str(), filename.c_str());
-
-                        // Execute the custom query and put the output to the output file
-                        // in the dump directory.
-                        //
-                        ExecuteCustomQuery(
-                            queryFilePath,
-                            fpath,
-                            serverInfo->m_hostname, 
-                            serverInfo->m_username,
-                            serverInfo->m_password);
-                    }
-                }
-            }
-            else
-            {
-                error = GetDmvFileContent(path);
-            }
-        }
+        return 0;
     }
 
-    if (error && fd != -1)
+    // Get file descriptor
+    //
+    GetFileDescriptorForPath(path, fi, fd);
+
+    if (fd != -1)
     {
-        close(fd);
-        fi->fh = -1;
-    }
+        result = pread(fd, buf, size, offset);
+        if (result == -1)
+        {
+            result = ReturnErrnoAndPrintError(__FUNCTION__, "pread failed");
+        }
 
-    return error;
+        CloseFileDesciptorIfOpened(fi, fd);
+    }
+    return result;
 }
 
 // ---------------------------------------------------------------------------
-// Method: ReadLocalImpl
+// Method: ReadBufLocalImpl
 //
 // Description:
-//    This method redirects the read system call to the dump directory.
+//    This method serves the read system call without copying the data in
+//    user space where possible. Reads of scratch files and of snapshots
+//    kept in a memory file are returned as a file descriptor and position,
+//    which libfuse splices into the reply. Snapshots kept only in memory
+//    are copied as in ReadLocalImpl - libfuse frees the memory of the
+//    buffers it is given, so it can't point into the snapshot. So is the
+//    output of a query still running, once it has arrived.
 //
 // Returns:
 //    0 on success and -errno on error.
 //
 static int
-ReadLocalImpl(
+ReadBufLocalImpl(
     const char* path,
-    char* buf,
+    struct fuse_bufvec** bufp,
     size_t size,
     off_t offset,
     struct fuse_file_info* fi)
 {
-    int fd = 0;
-    int result = -1;
+    FileHandle*                         handle = GetFileHandle(fi);
+    shared_ptr<const ResultSnapshot>    snapshot = handle->m_snapshot;
+    struct fuse_bufvec*                 bufvec;
+    ssize_t                             copied = 0;
 
-    // Get file descriptor
+    (void)path;
+
+    // Once the query of a stream is done it is read like a snapshot.
     //
-    GetFileDescriptorForPath(path, fi, fd);
+    if (!snapshot && handle->m_stream)
+    {
+        snapshot = handle->m_stream->GetSnapshot();
+    }
 
-    if (fd != -1)
+    bufvec = (struct fuse_bufvec*)malloc(sizeof(struct fuse_bufvec));
+    if (!bufvec)
     {
-        result = pread(fd, buf, size, offset);
-        if (result == -1)
+        return -ENOMEM;
+    }
+
+    memset(bufvec, 0, sizeof(*bufvec));
+    bufvec->count = 1;
+    bufvec->buf[0].fd = -1;
+
+    if (snapshot)
+    {
+        // Nothing is returned at or beyond the end.
+        //
+        if (offset >= 0 && (size_t)offset < snapshot->GetSize())
         {
-            result = ReturnErrnoAndPrintError(__FUNCTION__, "pread failed");
+            size = min(size, snapshot->GetSize() - (size_t)offset);
+        }
+        else
+        {
+            size = 0;
         }
 
-        CloseFileDesciptorIfOpened(fi, fd);
+        if (snapshot->GetDescriptor() != -1)
+        {
+            bufvec->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            bufvec->buf[0].fd = snapshot->GetDescriptor();
+            bufvec->buf[0].pos = offset;
+        }
+        else if (size)
+        {
+            bufvec->buf[0].mem = malloc(size);
+            if (!bufvec->buf[0].mem)
+            {
+                free(bufvec);
+                return -ENOMEM;
+            }
+            snapshot->Read((char*)bufvec->buf[0].mem, size, offset);
+        }
     }
-    return result;
+    else if (handle->m_stream)
+    {
+        // The query is still running - wait for the output.
+        //
+        bufvec->buf[0].mem = malloc(size ? size : 1);
+        if (!bufvec->buf[0].mem)
+        {
+            free(bufvec);
+            return -ENOMEM;
+        }
+
+        copied = handle->m_stream->Read((char*)bufvec->buf[0].mem, size, offset);
+        if (copied < 0)
+        {
+            free(bufvec->buf[0].mem);
+            free(bufvec);
+            return copied;
+        }
+        size = copied;
+    }
+    else if (handle->m_fd == -1)
+    {
+        // A dbfs file whose query failed is empty.
+        //
+        size = 0;
+    }
+    else
+    {
+        bufvec->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        bufvec->buf[0].fd = handle->m_fd;
+        bufvec->buf[0].pos = offset;
+    }
+
+    bufvec->buf[0].size = size;
+    *bufp = bufvec;
+
+    return 0;
 }
 
 // ---------------------------------------------------------------------------
@@ -906,8 +1224,13 @@ WriteLocalImpl(
     int     fd;
     string  fpath;
     int     result = 0;
+    bool    isDbfsFile;
+
+    // Open files carry their node - no need to look the path up again.
+    //
+    isDbfsFile = fi ? GetFileHandle(fi)->m_node != nullptr : IsDbfsFile(path);
 
-    if (!IsDbfsFile(path))
+    if (!isDbfsFile)
     {
         GetFileDescriptorForPath(path, fi, fd);
 
@@ -950,6 +1273,14 @@ StatfsLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes take no space - report the file system of the
+    // dump directory for them.
+    //
+    if (IsVirtualPath(path))
+    {
+        path = "/";
+    }
+
     fpath = CalculateDumpPath(path);
     result = statvfs(fpath.c_str(), stbuf);
     if (result == -1)
@@ -963,11 +1294,8 @@ StatfsLocalImpl(
 // Method: ReleaseLocalImpl
 //
 // Description:
-//    If the file is a DMV file - this method truncates an open DMV file 
-//    back to size 0. This effectively removes all the data that was 
-//    fetched from the server on open().
-//
-//    In all cases - close the file descriptor.
+//    This method closes the file descriptor (if any) and frees the handle. The
+//    snapshot of a dbfs file goes away with its last user.
 //
 // Returns:
 //    0 on success and -errno on error.
@@ -977,26 +1305,21 @@ ReleaseLocalImpl(
     const char* path,
     struct fuse_file_info* fi)
 {
-    int result = 0;
+    int         result;
+    FileHandle* handle = GetFileHandle(fi);
 
-    if (IsDbfsFile(path))
-    {
-        // Reset the DMV file.
-        //
-        result = TruncateLocalImpl(path, 0);
-        if (result == -1)
-        {
-            result = ReturnErrnoAndPrintError(__FUNCTION__,
-                                              "TruncateLocalImpl failed");
-        }
-    }
+    (void)path;
 
-    result = close(fi->fh);
+    result = (handle->m_fd != -1) ? close(handle->m_fd) : 0;
     if (result == -1)
     {
         result = ReturnErrnoAndPrintError(__FUNCTION__,
                                           "close failed");
     }
+
+    delete handle;
+    fi->fh = 0;
+
     return result;
 }
 
@@ -1044,6 +1367,13 @@ FallocateLocalImpl(
     string  fpath;
     int     result = 0;
 
+    // The virtual nodes can't be changed.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EPERM;
+    }
+
     GetFileDescriptorForPath(path, fi, fd);
 
     if (fd != -1)
@@ -1082,6 +1412,13 @@ SetxattrLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes can't be changed.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EPERM;
+    }
+
     fpath = CalculateDumpPath(path);
     result = lsetxattr(fpath.c_str(), name, value, size, flags);
     if (result == -1)
@@ -1110,6 +1447,13 @@ GetxattrLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes have no extended attributes.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -ENODATA;
+    }
+
     fpath = CalculateDumpPath(path);
     result = lgetxattr(fpath.c_str(), name, value, size);
     if (result == -1)
@@ -1137,6 +1481,11 @@ ListxattrLocalImpl(
     int     result;
     string  fpath;
 
+    if (IsVirtualPath(path))
+    {
+        return 0;
+    }
+
     fpath = CalculateDumpPath(path);
     result = llistxattr(fpath.c_str(), list, size);
     if (result == -1)
@@ -1163,6 +1512,13 @@ RemovexattrLocalImpl(
     int     result;
     string  fpath;
 
+    // The virtual nodes can't be changed.
+    //
+    if (IsVirtualPath(path))
+    {
+        return -EPERM;
+    }
+
     fpath = CalculateDumpPath(path);
     result = lremovexattr(fpath.c_str(), name);
     if (result == -1)
@@ -1176,9 +1532,8 @@ RemovexattrLocalImpl(
 // Method: InitializeSQLFs
 //
 // Description:
-//    This method gets invoked as the first step in FUSE setup.
-//    It mainly creates the dump directory (if one is not already present) 
-//    and creates the DMV's for all the servers. 
+//    This method gets invoked as the first step in FUSE setup, after
+//    fuse_main() has daemonized.
 //
 // Returns:
 //    NULL
@@ -1187,32 +1542,11 @@ void*
 InitializeSQLFs(
     fuse_conn_info* conn)
 {
-    int                 result;
-    class ServerInfo*   entry;
-
-    (void)conn;
-
-    // Creating the dump dir.
+    // Let libfuse splice the replies of read_buf into the device.
     //
-    result = mkdir(g_UserPaths.m_dumpPath.c_str(), DEFAULT_PERMISSIONS);
-    if (result == -1)
-    {
-        PrintMsg("Mkdir failed for %s - %s\n", 
-            g_UserPaths.m_dumpPath.c_str(), strerror(errno));
-        KillSelf();
-    }
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
 
-    // Create local DMV entries for all the servers.
-    //
-    for (auto&& itr : g_ServerInfoMap)
-    {
-        entry = itr.second;
-        CreateDbfsFiles(itr.first,
-            entry->m_hostname, 
-            entry->m_username,
-            entry->m_password, 
-            entry->m_version);
-    }
+    StartSQLFs();
 
     return nullptr;
 }
@@ -1222,7 +1556,6 @@ InitializeSQLFs(
 //
 // Description:
 //    This method gets invoked if and when FUSE instance is closing. 
-//    It deletes the dump directory and all the DMV's created in it.
 //
 // Returns:
 //    VOID
@@ -1230,7 +1563,7 @@ InitializeSQLFs(
 void
 DestroySQLFs(void* userdata)
 {
-    PrintMsg("Closing SQLFS\n");
+    StopSQLFs();
 }
 
 // ---------------------------------------------------------------------------
@@ -1275,7 +1608,7 @@ InitializeFuseOperations(
     sqlFsOperations->access = AccessLocalImpl;
     sqlFsOperations->create = NULL;
     sqlFsOperations->ftruncate = NULL;
-    sqlFsOperations->fgetattr = NULL;
+    sqlFsOperations->fgetattr = FgetattrLocalImpl;
     sqlFsOperations->lock = NULL;
     sqlFsOperations->utimens = UtimensLocalImpl;
     sqlFsOperations->bmap = NULL;
@@ -1286,7 +1619,7 @@ InitializeFuseOperations(
     sqlFsOperations->ioctl = NULL;
     sqlFsOperations->poll = NULL;
     sqlFsOperations->write_buf = NULL;
-    sqlFsOperations->read_buf = NULL;
+    sqlFsOperations->read_buf = ReadBufLocalImpl;
     sqlFsOperations->flock = NULL;
     sqlFsOperations->fallocate = FallocateLocalImpl;
 }
@@ -1300,9 +1633,17 @@ InitializeFuseOperations(
 //    fuse_main() expects.
 //
 //    Options -o and direct_io are passed because because before a read()
-//    kernel does a query to get the size of the file but that returns zero 
-//    because only at open do we put data in the file. So this doesn't work
-//    well when kernel is using its cache (direct_io option disables that).
+//    kernel does a query to get the size of the file but that may be the
+//    size of older content because only at open do we query the server. So
+//    this doesn't work well when kernel is using its cache (direct_io option
+//    disables that).
+//
+//    In page cache mode direct_io is left out. The cached pages are
+//    dropped on open when the content has changed (keep_cache), but that
+//    leaves the size the kernel cached, which it cuts reads short at.
+//    The attributes and names are therefore not cached at all, so that a
+//    read past the cached size makes the kernel ask for the size of the
+//    latest content.
 //
 // Returns:
 //    VOID
@@ -1316,18 +1657,9 @@ StartFuse(
     struct fuse_operations  sqlFsOperations;
     char*                   buffer;
     int                     result;
-    string                  tdsString;
-    char                    varArray[24];
     
     InitializeFuseOperations(&sqlFsOperations);
 
-    // Set the TDS version.
-    //
-    tdsString = "TDSVER=8.0";
-    strcpy(varArray, tdsString.c_str());
-    result = putenv(varArray);
-    assert(!result);
-    
     // Setup argc and argv for fuse.
     //
     memset(argv, 0, sizeof(argv));
@@ -1345,11 +1677,21 @@ StartFuse(
         argv[argc++] = buffer;
     }
 
+    // fuse_main() serves the requests on a pool of threads that grows with
+    // the load unless asked to use just one.
+    //
+    if (g_NumThreads == 1)
+    {
+        buffer = strdup("-s");
+        assert(buffer);
+        argv[argc++] = buffer;
+    }
+
     buffer = strdup("-o");
     assert(buffer);
     argv[argc++] = buffer;
 
-    buffer = strdup("direct_io");
+    buffer = strdup(g_UsePageCache ? "attr_timeout=0,entry_timeout=0" : "direct_io");
     assert(buffer);
     argv[argc++] = buffer;
 
@@ -1367,3 +1709,5 @@ StartFuse(
 
     return result;
 }
+
+#endif // !DBFS_USE_FUSE3_LOWLEVEL
@@ -12,6 +12,10 @@
 
 #define MAX_ARGS                8
 
+class ResultSnapshot;
+class ResultStream;
+class VirtualNode;
+
 // Structure to track entries of various paths and configuration file
 //
 struct SQLFsPaths 
@@ -41,6 +45,57 @@ public:
     // [16] is the minimum version required for JSON output.
     //
     int m_version;
+
+    // Number of seconds DMV results of this server are served from the
+    // result cache, and the exceptions to it for individual DMVs.
+    //
+    int m_cacheTTLSec;
+    unordered_map<string, int> m_dmvCacheTTLSec;
+
+    // Names of the DMVs of the server, listed when it was verified at
+    // startup or read from the catalog cache, and the hash of the version
+    // of the server they were listed on.
+    //
+    vector<string> m_dmvNames;
+    string m_catalogVersion;
+};
+
+// State of an open file. A pointer to it is kept in fuse_file_info::fh.
+//
+struct FileHandle
+{
+    // Descriptor of the file in the dump directory, -1 for dbfs files.
+    //
+    int m_fd;
+
+    // Content of a dbfs file taken on open. Reads are served from it and
+    // never touch the dump directory. NULL for all other files.
+    //
+    shared_ptr<const ResultSnapshot> m_snapshot;
+
+    // Output of the query of a dbfs file opened with --stream while the
+    // query was running. Reads wait for the output they ask for. NULL for
+    // all other files.
+    //
+    shared_ptr<ResultStream> m_stream;
+
+    // Node of a dbfs file, NULL for user scratch files.
+    //
+    shared_ptr<VirtualNode> m_node;
+};
+
+// State of an open directory. A pointer to it is kept in fuse_file_info::fh.
+//
+struct DirHandle
+{
+    // The virtual directory, NULL if the directory only exists in the
+    // dump directory.
+    //
+    shared_ptr<VirtualNode> m_node;
+
+    // The directory in the dump directory, NULL if there is none.
+    //
+    DIR* m_dp;
 };
 
 int StartFuse(char* ProgramName);
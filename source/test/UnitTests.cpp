@@ -0,0 +1,863 @@
+//****************************************************************************
+//      Copyright (c) Microsoft Corporation. All rights reserved.
+//      Licensed under the MIT license.
+//
+// File: UnitTests.cpp
+//
+// Purpose:
+//   This file contains the unit tests of the parts of dbfs which don't need
+//   a server or a mount: the parsers, the catalog cache and the pieces
+//   shared between threads. It is linked with all the objects of dbfs but
+//   main.o.
+//
+#include "UtilsPrivate.h"
+#include "SingleFlight.h"
+
+// The globals main.cpp defines for the rest of dbfs.
+//
+struct SQLFsPaths g_UserPaths;
+bool g_InVerbose;
+std::unordered_map<std::string, class ServerInfo*> g_ServerInfoMap;
+bool g_UseLogFile;
+bool g_RunInForeground;
+bool g_UsePageCache;
+bool g_LazyMount;
+bool g_StreamResults;
+int g_NumThreads = SQLFS_DEFAULT_QUERY_WORKERS;
+
+// Number of threads the concurrent tests run at the same time.
+//
+#define TEST_THREADS                    8
+
+// Seconds a concurrent test waits for the other threads before it takes
+// them to be stuck.
+//
+#define TEST_WAIT_SEC                   10
+
+// Number of checks which failed. The concurrent tests check from several
+// threads.
+//
+static std::atomic<int> s_Failures;
+
+// Reports the check if the condition doesn't hold, and carries on.
+//
+#define EXPECT(condition)                                                   \
+    do                                                                      \
+    {                                                                       \
+        if (!(condition))                                                   \
+        {                                                                   \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            s_Failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+// ---------------------------------------------------------------------------
+// Method: WaitUntil
+//
+// Description:
+//    Waits for the other threads of a test to make the condition true,
+//    for TEST_WAIT_SEC at most so that a broken test fails instead of
+//    hanging.
+//
+// Returns:
+//    true if the condition became true.
+//
+static bool
+WaitUntil(
+    function<bool()> condition)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(TEST_WAIT_SEC);
+
+    while (!condition())
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+        {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestParseRoute
+//
+// Description:
+//    Checks that every shape of path is told apart, including the ones
+//    which only differ by an extension or the depth.
+//
+static void
+TestParseRoute()
+{
+    Route route;
+
+    ParseRoute("/", route);
+    EXPECT(route.m_type == ROUTE_ROOT);
+
+    ParseRoute("//srv/", route);
+    EXPECT(route.m_type == ROUTE_SERVER);
+    EXPECT(route.m_server.Equals("srv"));
+
+    ParseRoute("/srv/dm_exec_requests", route);
+    EXPECT(route.m_type == ROUTE_SERVER_FILE);
+    EXPECT(route.m_stem.Equals("dm_exec_requests"));
+    EXPECT(route.m_format == TYPE_TSV);
+
+    ParseRoute("/srv/dm_exec_requests.json", route);
+    EXPECT(route.m_type == ROUTE_SERVER_FILE);
+    EXPECT(route.m_name.Equals("dm_exec_requests.json"));
+    EXPECT(route.m_stem.Equals("dm_exec_requests"));
+    EXPECT(route.m_format == TYPE_JSON);
+
+    ParseRoute("/srv/.json", route);
+    EXPECT(route.m_format == TYPE_TSV);
+
+    ParseRoute("/srv/a.json.txt", route);
+    EXPECT(route.m_format == TYPE_TSV);
+
+    ParseRoute("/srv/" CUSTOM_QUERY_FOLDER_NAME, route);
+    EXPECT(route.m_type == ROUTE_CUSTOM_QUERY_DIR);
+
+    ParseRoute("/srv/" CUSTOM_QUERY_FOLDER_NAME "/blocking", route);
+    EXPECT(route.m_type == ROUTE_CUSTOM_QUERY_FILE);
+    EXPECT(route.m_name.Equals("blocking"));
+
+    ParseRoute("/srv/" CUSTOM_QUERY_FOLDER_NAME "/blocking/@spid=73", route);
+    EXPECT(route.m_type == ROUTE_CUSTOM_QUERY_CALL);
+    EXPECT(route.m_query.Equals("blocking"));
+    EXPECT(route.m_name.Equals("@spid=73"));
+
+    ParseRoute("/srv/scratch/file", route);
+    EXPECT(route.m_type == ROUTE_NONE);
+
+    ParseRoute("/srv/" CUSTOM_QUERY_FOLDER_NAME "/blocking/@spid=73/x", route);
+    EXPECT(route.m_type == ROUTE_NONE);
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestParseCustomQueryDirectives
+//
+// Description:
+//    Checks that the directives are only taken from the comments at the
+//    top of the query and that bad ones are ignored.
+//
+static void
+TestParseCustomQueryDirectives()
+{
+    CustomQueryText query;
+
+    query.m_query = "-- dbfs:ttl=30\n"
+                    "--dbfs:params=@spid int, @amount decimal(10, 2)\n"
+                    "\n"
+                    "SELECT 1\n"
+                    "-- dbfs:ttl=5\n";
+    ParseCustomQueryDirectives(query);
+    EXPECT(query.m_ttlSec == 30);
+    EXPECT(query.m_parameters == "@spid int, @amount decimal(10, 2)");
+    EXPECT((query.m_parameterNames == vector<string>{ "@spid", "@amount" }));
+
+    query = CustomQueryText();
+    query.m_query = "-- dbfs:ttl=soon\n"
+                    "-- dbfs:params=spid int\n"
+                    "-- dbfs:colour=blue\n"
+                    "SELECT 1\n";
+    ParseCustomQueryDirectives(query);
+    EXPECT(query.m_ttlSec == -1);
+    EXPECT(query.m_parameters.empty());
+    EXPECT(query.m_parameterNames.empty());
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestParseCustomQueryArguments
+//
+// Description:
+//    Checks that the arguments in the name of a call are matched with the
+//    parameters whatever their order and case, that every parameter has
+//    to get exactly one value and that all the names of a call make the
+//    same name.
+//
+static void
+TestParseCustomQueryArguments()
+{
+    CustomQueryText query;
+    vector<string>  values;
+
+    query.m_parameterNames = { "@spid", "@db" };
+
+    EXPECT(ParseCustomQueryArguments(query, "db=master,@SPID=73", values) == 0);
+    EXPECT((values == vector<string>{ "73", "master" }));
+
+    EXPECT(ParseCustomQueryArguments(query, "@spid=1,@db=a=b", values) == 0);
+    EXPECT(values[1] == "a=b");
+
+    EXPECT(ParseCustomQueryArguments(query, "@spid=73", values) == -1);
+    EXPECT(ParseCustomQueryArguments(query, "@spid=73,@db=x,@other=1", values) == -1);
+    EXPECT(ParseCustomQueryArguments(query, "@spid=73,@spid=74", values) == -1);
+    EXPECT(ParseCustomQueryArguments(query, "ls", values) == -1);
+
+    EXPECT(ParseCustomQueryArguments(query, "DB=master,spid=73", values) == 0);
+    EXPECT(FormatCustomQueryArguments(query, values) == "@spid=73,@db=master");
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestBuildCustomQueryBatch
+//
+// Description:
+//    Checks that a query without parameters is sent as it is and that the
+//    query, its declaration and the values are quoted when it is run
+//    through sp_executesql.
+//
+static void
+TestBuildCustomQueryBatch()
+{
+    CustomQueryText query;
+
+    query.m_query = "SELECT 'a'";
+    EXPECT(BuildCustomQueryBatch(query, vector<string>()) == "SELECT 'a'");
+
+    query.m_query = "SELECT name FROM t WHERE name = @name";
+    query.m_parameters = "@name nvarchar(128)";
+    query.m_parameterNames = { "@name" };
+
+    EXPECT(BuildCustomQueryBatch(query, { "O'Brien'; DROP TABLE t --" }) ==
+           "EXEC sp_executesql N'SELECT name FROM t WHERE name = @name', "
+           "N'@name nvarchar(128)', @name = N'O''Brien''; DROP TABLE t --'");
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestParseDmvCacheTTLs
+//
+// Description:
+//    Checks the list of per DMV cache TTLs of a server section.
+//
+static void
+TestParseDmvCacheTTLs()
+{
+    unordered_map<string, int> ttls;
+
+    EXPECT(ParseDmvCacheTTLs("dm_os_wait_stats:1, dm_exec_requests :0", ttls));
+    EXPECT(ttls.size() == 2);
+    EXPECT(ttls["dm_os_wait_stats"] == 1);
+    EXPECT(ttls["dm_exec_requests"] == 0);
+
+    EXPECT(!ParseDmvCacheTTLs("dm_os_wait_stats", ttls));
+    EXPECT(!ParseDmvCacheTTLs("dm_os_wait_stats:-1", ttls));
+    EXPECT(!ParseDmvCacheTTLs("dm_os_wait_stats:often", ttls));
+}
+
+// ---------------------------------------------------------------------------
+// Method: RemoveDirectory
+//
+// Description:
+//    Removes a directory the tests made and the files in it - the tests
+//    don't make deeper trees.
+//
+// Returns:
+//    true on success.
+//
+static bool
+RemoveDirectory(
+    const string& path)
+{
+    DIR*            dir;
+    struct dirent*  entry;
+    bool            removed = true;
+
+    dir = opendir(path.c_str());
+    if (!dir)
+    {
+        return false;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+        {
+            removed = (unlink((path + LINUX_PATH_DELIM + entry->d_name).c_str()) == 0) &&
+                      removed;
+        }
+    }
+    closedir(dir);
+
+    return (rmdir(path.c_str()) == 0) && removed;
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestGetCustomQuery
+//
+// Description:
+//    Checks that a query file is read once while it doesn't change and
+//    read again once its query is forgotten.
+//
+static void
+TestGetCustomQuery()
+{
+    char                                directory[] = "/tmp/dbfs-test-XXXXXX";
+    string                              path;
+    shared_ptr<const CustomQueryText>   first;
+    shared_ptr<const CustomQueryText>   second;
+
+    if (!mkdtemp(directory))
+    {
+        EXPECT(!"mkdtemp failed");
+        return;
+    }
+    path = string(directory) + LINUX_PATH_DELIM + "sessions";
+
+    std::ofstream(path) << "SELECT 1";
+
+    EXPECT(GetCustomQuery(path, first) == 0);
+    EXPECT(GetCustomQuery(path, second) == 0);
+    EXPECT(first == second);
+    EXPECT(first->m_query == "SELECT 1");
+
+    ForgetCustomQuery(path);
+
+    EXPECT(GetCustomQuery(path, second) == 0);
+    EXPECT(first != second);
+
+    ForgetCustomQuery(path);
+    EXPECT(RemoveDirectory(directory));
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestPipeRowSink
+//
+// Description:
+//    Checks that a row reaches the other end of a pipe as soon as it ends,
+//    and that output larger than the pipe gets through whole while it is
+//    read.
+//
+static void
+TestPipeRowSink()
+{
+    int     fds[2];
+    char    buffer[4096];
+    string  expected;
+    string  output;
+    ssize_t length;
+
+    if (pipe(fds) == -1)
+    {
+        EXPECT(!"pipe failed");
+        return;
+    }
+
+    {
+        PipeRowSink sink(fds[1]);
+
+        sink.Write("name\tvalue", 10);
+        sink.Write('\n');
+        sink.EndRow();
+        EXPECT(read(fds[0], buffer, sizeof(buffer)) == 11);
+
+        thread reader([&]()
+        {
+            while ((length = read(fds[0], buffer, sizeof(buffer))) > 0)
+            {
+                output.append(buffer, length);
+            }
+        });
+
+        for (int row = 0; expected.size() < 4 * SQLFS_ROW_SINK_BUFFER_SIZE; row++)
+        {
+            string line = "row " + to_string(row) + "\n";
+
+            sink.Write(line.data(), line.size());
+            expected += line;
+        }
+        EXPECT(sink.Flush() == 0);
+
+        close(fds[1]);
+        reader.join();
+    }
+    close(fds[0]);
+
+    EXPECT(output == expected);
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestResultCache
+//
+// Description:
+//    Checks that results are served until they expire and stay valid for
+//    their readers after that, and that only SQLFS_MAX_CACHED_SNAPSHOT_FILES
+//    results in memory files are kept, dropping the one closest to
+//    expiring. Then has several threads store and look up results of the
+//    same keys at once.
+//
+static void
+TestResultCache()
+{
+    ResultCache                         cache;
+    shared_ptr<const ResultSnapshot>    result;
+    shared_ptr<const ResultSnapshot>    large;
+    vector<thread>                      threads;
+
+    result = make_shared<const ResultSnapshot>(string("rows"));
+    cache.Store("/srv/dm_a", result, 1);
+    cache.Store("/srv/dm_b", make_shared<const ResultSnapshot>(string("rows")), 0);
+
+    EXPECT(cache.Lookup("/srv/dm_a") == result);
+    EXPECT(!cache.Lookup("/srv/dm_b"));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    EXPECT(!cache.Lookup("/srv/dm_a"));
+    EXPECT(string(result->GetData(), result->GetSize()) == "rows");
+
+    // The first file stored expires first and makes room for the last.
+    //
+    large = make_shared<const ResultSnapshot>(string(SNAPSHOT_FILE_MIN_SIZE, 'x'));
+    if (large->GetDescriptor() != -1)
+    {
+        cache.Store("/srv/file0", large, 100);
+        for (int i = 1; i <= SQLFS_MAX_CACHED_SNAPSHOT_FILES; i++)
+        {
+            cache.Store("/srv/file" + to_string(i),
+                        make_shared<const ResultSnapshot>(string(SNAPSHOT_FILE_MIN_SIZE, 'x')),
+                        200 + i);
+        }
+
+        EXPECT(!cache.Lookup("/srv/file0"));
+        EXPECT(cache.Lookup("/srv/file1"));
+        EXPECT(cache.Lookup("/srv/file" + to_string(SQLFS_MAX_CACHED_SNAPSHOT_FILES)));
+        EXPECT(large->GetSize() == SNAPSHOT_FILE_MIN_SIZE && large->GetData()[0] == 'x');
+    }
+    cache.Clear();
+
+    // A result is always the one stored for its key.
+    //
+    for (int i = 0; i < TEST_THREADS; i++)
+    {
+        threads.emplace_back([&cache, i]()
+        {
+            shared_ptr<const ResultSnapshot> found;
+
+            for (int pass = 0; pass < 1000; pass++)
+            {
+                string key = "/srv/dm_" + to_string((i + pass) % 4);
+
+                cache.Store(key, make_shared<const ResultSnapshot>(string(key)), 60);
+
+                found = cache.Lookup(key);
+                EXPECT(found && string(found->GetData(), found->GetSize()) == key);
+            }
+        });
+    }
+    for (thread& worker : threads)
+    {
+        worker.join();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestCatalogCache
+//
+// Description:
+//    Checks that a stored DMV list reads back the same, in a cache
+//    directory of its own, and that it is kept per host and login.
+//
+static void
+TestCatalogCache()
+{
+    char            directory[] = "/tmp/dbfs-test-XXXXXX";
+    ServerInfo      server;
+    ServerInfo      other;
+    string          versionHash;
+    vector<string>  dmvNames;
+
+    if (!mkdtemp(directory))
+    {
+        EXPECT(!"mkdtemp failed");
+        return;
+    }
+    setenv("XDG_CACHE_HOME", directory, 1);
+
+    server.m_hostname = "host\\instance";
+    server.m_username = "sa";
+    other.m_hostname = server.m_hostname;
+    other.m_username = "reader";
+
+    EXPECT(!LoadCachedCatalog(server, versionHash, dmvNames));
+
+    StoreCachedCatalog(server, "0123456789abcdef", { "dm_exec_requests", "dm_os_wait_stats" });
+
+    EXPECT(LoadCachedCatalog(server, versionHash, dmvNames));
+    EXPECT(versionHash == "0123456789abcdef");
+    EXPECT((dmvNames == vector<string>{ "dm_exec_requests", "dm_os_wait_stats" }));
+
+    EXPECT(!LoadCachedCatalog(other, versionHash, dmvNames));
+
+    EXPECT(RemoveDirectory(string(directory) + LINUX_PATH_DELIM + "dbfs"));
+    EXPECT(rmdir(directory) == 0);
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestSingleFlight
+//
+// Description:
+//    Checks that callers arriving while the work for their key runs get
+//    its result or its exception without running it again, that the work
+//    runs again once it has finished and that different keys don't wait
+//    for each other.
+//
+static void
+TestSingleFlight()
+{
+    SingleFlight<int>   flight;
+    std::atomic<int>    arrived(0);
+    std::atomic<int>    runs(0);
+    std::atomic<int>    failures(0);
+    vector<int>         results(TEST_THREADS);
+    vector<thread>      threads;
+
+    // The work goes on until all the callers have arrived, and a little
+    // longer for the last ones to find it running.
+    //
+    auto slowWork = [&]() -> int
+    {
+        EXPECT(WaitUntil([&] { return arrived == TEST_THREADS; }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        return ++runs;
+    };
+
+    for (int i = 0; i < TEST_THREADS; i++)
+    {
+        threads.emplace_back([&, i]()
+        {
+            arrived++;
+            results[i] = flight.Do("dmv", slowWork);
+        });
+    }
+    for (thread& worker : threads)
+    {
+        worker.join();
+    }
+    threads.clear();
+
+    EXPECT(runs == 1);
+    EXPECT(std::count(results.begin(), results.end(), 1) == TEST_THREADS);
+
+    EXPECT(flight.Do("dmv", [&] { return ++runs; }) == 2);
+
+    arrived = 0;
+    for (int i = 0; i < TEST_THREADS; i++)
+    {
+        threads.emplace_back([&]()
+        {
+            arrived++;
+            try
+            {
+                flight.Do("dmv", [&]() -> int
+                {
+                    slowWork();
+                    throw runtime_error("query failed");
+                });
+            }
+            catch (const runtime_error&)
+            {
+                failures++;
+            }
+        });
+    }
+    for (thread& worker : threads)
+    {
+        worker.join();
+    }
+    threads.clear();
+
+    EXPECT(runs == 3);
+    EXPECT(failures == TEST_THREADS);
+
+    // Each of the two works only finishes once the other has started.
+    //
+    arrived = 0;
+    auto pairedWork = [&]() -> int
+    {
+        arrived++;
+        return WaitUntil([&] { return arrived == 2; }) ? 1 : 0;
+    };
+
+    thread other([&] { EXPECT(flight.Do("other", pairedWork) == 1); });
+    EXPECT(flight.Do("dmv", pairedWork) == 1);
+    other.join();
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestVirtualTree
+//
+// Description:
+//    Checks that nodes are found by path and by directory entry, that
+//    replacing the files of a directory keeps the nodes of the files which
+//    stay and that removing a parameterized query takes its calls along.
+//    Then checks that lookups and listings made while the files of a
+//    directory are being replaced always see a whole tree.
+//
+static void
+TestVirtualTree()
+{
+    VirtualTree                         tree;
+    shared_ptr<VirtualNode>             serverDir;
+    shared_ptr<VirtualNode>             queryDir;
+    shared_ptr<VirtualNode>             templateDir;
+    shared_ptr<VirtualNode>             node;
+    vector<pair<string, struct stat>>   entries;
+    std::atomic<int>                    reading(TEST_THREADS);
+    vector<thread>                      readers;
+
+    serverDir = tree.AddNode(tree.GetRoot(), "srv", NODE_DIRECTORY);
+    queryDir = tree.AddNode(serverDir, CUSTOM_QUERY_FOLDER_NAME, NODE_DIRECTORY);
+    tree.ReplaceFiles(serverDir, { "dm_b", "dm_a" }, NODE_DMV_FILE);
+
+    node = tree.Lookup("/srv/dm_a");
+    EXPECT(node && node->m_type == NODE_DMV_FILE && node->m_dmvName == "dm_a");
+    EXPECT(node == tree.LookupChild(serverDir, "dm_a"));
+    EXPECT(node->m_stat.st_ino != tree.Lookup("/srv/dm_b")->m_stat.st_ino);
+    EXPECT(!tree.Lookup("/srv/dm_c"));
+
+    tree.ListChildren(serverDir, entries);
+    EXPECT(entries.size() == 3);
+    EXPECT(entries[0].first == CUSTOM_QUERY_FOLDER_NAME && entries[1].first == "dm_a");
+
+    tree.ReplaceFiles(serverDir, { "dm_a", "dm_c" }, NODE_DMV_FILE);
+    EXPECT(tree.Lookup("/srv/dm_a") == node);
+    EXPECT(!tree.Lookup("/srv/dm_b"));
+    EXPECT(tree.Lookup("/srv/dm_c"));
+    EXPECT(tree.Lookup("/srv/" CUSTOM_QUERY_FOLDER_NAME) == queryDir);
+
+    templateDir = tree.AddNode(queryDir, "blocking", NODE_CUSTOM_QUERY_TEMPLATE);
+    node = tree.AddNode(templateDir, "@spid=73", NODE_CUSTOM_QUERY_CALL_FILE);
+    EXPECT(node->m_queryName == "blocking");
+    EXPECT(tree.Lookup("/srv/" CUSTOM_QUERY_FOLDER_NAME "/blocking/@spid=73") == node);
+
+    tree.RemoveNode(queryDir, "blocking");
+    EXPECT(!tree.Lookup("/srv/" CUSTOM_QUERY_FOLDER_NAME "/blocking"));
+    EXPECT(!tree.Lookup("/srv/" CUSTOM_QUERY_FOLDER_NAME "/blocking/@spid=73"));
+
+    // Only the two calls used last are kept, unless one is held.
+    //
+    templateDir = tree.AddNode(queryDir, "blocking", NODE_CUSTOM_QUERY_TEMPLATE);
+    tree.AddCall(templateDir, "@spid=1", 2);
+    tree.AddCall(templateDir, "@spid=2", 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    tree.AddCall(templateDir, "@spid=1", 2);
+
+    tree.AddCall(templateDir, "@spid=3", 2);
+    EXPECT(tree.LookupChild(templateDir, "@spid=1"));
+    EXPECT(!tree.LookupChild(templateDir, "@spid=2"));
+
+    node = tree.LookupChild(templateDir, "@spid=1");
+    tree.AddCall(templateDir, "@spid=4", 2);
+    EXPECT(tree.LookupChild(templateDir, "@spid=1") == node);
+    EXPECT(!tree.LookupChild(templateDir, "@spid=3"));
+    EXPECT(!tree.Lookup("/srv/" CUSTOM_QUERY_FOLDER_NAME "/blocking/@spid=3"));
+    tree.RemoveNode(queryDir, "blocking");
+
+    // dm_a stays in every list, dm_b and dm_c come and go while the
+    // readers make a fixed number of passes.
+    //
+    for (int i = 0; i < TEST_THREADS; i++)
+    {
+        readers.emplace_back([&]()
+        {
+            vector<pair<string, struct stat>>   listed;
+            shared_ptr<VirtualNode>             found;
+
+            for (int pass = 0; pass < 1000; pass++)
+            {
+                EXPECT(tree.Lookup("/srv/dm_a"));
+
+                found = tree.Lookup("/srv/dm_b");
+                EXPECT(!found || found->m_path == "/srv/dm_b");
+
+                tree.ListChildren(serverDir, listed);
+                EXPECT(listed.size() == 3);
+                EXPECT(std::is_sorted(listed.begin(), listed.end(),
+                    [](const pair<string, struct stat>& a, const pair<string, struct stat>& b)
+                    {
+                        return a.first < b.first;
+                    }));
+            }
+            reading--;
+        });
+    }
+
+    for (int i = 0; reading > 0; i++)
+    {
+        tree.ReplaceFiles(serverDir, { "dm_a", (i % 2) ? "dm_b" : "dm_c" }, NODE_DMV_FILE);
+    }
+
+    for (thread& reader : readers)
+    {
+        reader.join();
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestResultStream
+//
+// Description:
+//    Has several readers read a stream from start to end while the query
+//    appends to it, large enough for the snapshot to go to a memory file.
+//    Every reader must get the whole output, and the readers of a query
+//    which failed must get EIO after the output it sent.
+//
+static void
+TestResultStream()
+{
+    string expected;
+
+    for (int row = 0; expected.size() < 2 * SNAPSHOT_FILE_MIN_SIZE; row++)
+    {
+        expected += "row " + to_string(row) + "\n";
+    }
+
+    for (int error : { 0, -EIO })
+    {
+        ResultStream    stream;
+        vector<thread>  readers;
+
+        for (int i = 0; i < TEST_THREADS; i++)
+        {
+            readers.emplace_back([&stream, &expected, error]()
+            {
+                char    buffer[4096];
+                string  output;
+                ssize_t length;
+
+                while ((length = stream.Read(buffer, sizeof(buffer), output.size())) > 0)
+                {
+                    output.append(buffer, length);
+                }
+
+                EXPECT(length == error);
+                EXPECT(output == expected);
+            });
+        }
+
+        for (size_t offset = 0; offset < expected.size(); offset += 1000)
+        {
+            stream.Append(expected.data() + offset, min((size_t)1000, expected.size() - offset));
+        }
+        stream.Finish(error);
+
+        for (thread& reader : readers)
+        {
+            reader.join();
+        }
+
+        EXPECT(error ? !stream.GetSnapshot() :
+                       stream.GetSnapshot()->GetSize() == expected.size());
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: TestQueryWorkerPool
+//
+// Description:
+//    Checks that a server whose work is the only work waiting gets all the
+//    workers, that work of another server arriving meanwhile goes ahead of
+//    the busy server's next task, and that the work still queued when the
+//    pool stops is run.
+//
+static void
+TestQueryWorkerPool()
+{
+    QueryWorkerPool             pool;
+    std::atomic<int>            started(0);
+    std::atomic<bool>           release[2] = { { false }, { false } };
+    vector<string>              order;
+    mutex                       orderLock;
+    vector<std::future<int>>    results;
+
+    auto blocking = [&](int i)
+    {
+        return [&, i]() -> int
+        {
+            started++;
+            return WaitUntil([&] { return release[i].load(); }) ? 0 : -1;
+        };
+    };
+
+    auto recording = [&](const string& name)
+    {
+        return [&, name]() -> int
+        {
+            lock_guard<mutex> lock(orderLock);
+            order.push_back(name);
+            return 0;
+        };
+    };
+
+    pool.Start(2);
+
+    results.push_back(pool.Submit("busy", blocking(0)));
+    results.push_back(pool.Submit("busy", blocking(1)));
+    EXPECT(WaitUntil([&] { return started == 2; }));
+
+    results.push_back(pool.Submit("busy", recording("busy")));
+    results.push_back(pool.Submit("other", recording("other")));
+
+    // The worker freed up takes the other server's work first. After that
+    // the busy server is the only one waiting again, so the worker goes on
+    // with it while the second blocking task still runs.
+    //
+    release[0] = true;
+    EXPECT(WaitUntil([&] { lock_guard<mutex> lock(orderLock); return order.size() == 2; }));
+    EXPECT((order == vector<string>{ "other", "busy" }));
+    release[1] = true;
+
+    for (auto&& result : results)
+    {
+        EXPECT(result.get() == 0);
+    }
+
+    results.clear();
+    for (int i = 0; i < TEST_THREADS; i++)
+    {
+        results.push_back(pool.Submit("busy", [] { return 0; }));
+    }
+    pool.Stop();
+
+    for (auto&& result : results)
+    {
+        EXPECT(result.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Method: main
+//
+// Description:
+//    Runs all the tests.
+//
+// Returns:
+//    0 if all the checks passed, 1 otherwise.
+//
+int
+main()
+{
+    TestParseRoute();
+    TestParseCustomQueryDirectives();
+    TestParseCustomQueryArguments();
+    TestBuildCustomQueryBatch();
+    TestParseDmvCacheTTLs();
+    TestGetCustomQuery();
+    TestPipeRowSink();
+    TestResultCache();
+    TestCatalogCache();
+    TestSingleFlight();
+    TestVirtualTree();
+    TestResultStream();
+    TestQueryWorkerPool();
+
+    if (s_Failures)
+    {
+        fprintf(stderr, "%d check(s) failed.\n", s_Failures.load());
+        return 1;
+    }
+
+    printf("All tests passed.\n");
+    return 0;
+}